@@ -0,0 +1,100 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Byte budgets for what a server holds back until it can be delivered: the fifo, causal
+ * and total order hold-back queues of each room, and our own totally ordered messages
+ * waiting for proposals. An entry counts as its text plus HOLD_OVERHEAD for the
+ * bookkeeping around it. Each room and the server as a whole have a limit; what happens
+ * beyond it is up to the server's policy. */
+
+const long long HOLD_OVERHEAD = 64; // bytes counted per held entry besides its text
+const int HOLD_SHED = 0; // refuse our clients' posts while over the budget
+const int HOLD_DROP = 1; // give up on the oldest undelivered messages
+const int HOLD_NACK = 2; // free a sender's held messages and have it send them again
+
+inline long long hold_size(size_t len) {
+	return len + HOLD_OVERHEAD;
+}
+
+class HoldBudget {
+private:
+	long long room_limit; // bytes per room, 0 for no limit
+	long long limit; // bytes in all, 0 for no limit
+	long long used;
+	long long peak;
+public:
+	HoldBudget() {
+		this->room_limit = 0;
+		this->limit = 0;
+		this->used = 0;
+		this->peak = 0;
+	}
+	bool parse(const char* spec);
+	bool enabled() const;
+	void add(long long &room, long long n);
+	bool fits(long long room, long long n) const;
+	long long get_used() const;
+	long long get_peak() const;
+	long long get_room_limit() const;
+	long long get_limit() const;
+};
+/* Read a byte count with an optional k or m suffix; false if there is none */
+inline bool parse_bytes(const char* &spec, long long &n) {
+	char* end;
+	double v = strtod(spec, &end);
+	if (end == spec || v < 0) {
+		return false;
+	}
+	if (*end == 'k' || *end == 'K') {
+		v *= 1024;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		v *= 1024 * 1024;
+		end++;
+	}
+	n = (long long) v;
+	spec = end;
+	return true;
+}
+/* Read "room[:total]", the total defaulting to no limit */
+inline bool HoldBudget::parse(const char* spec) {
+	long long r = 0, t = 0;
+	if (!parse_bytes(spec, r) || (*spec == ':' && !parse_bytes(++spec, t)) || *spec != 0) {
+		return false;
+	}
+	this->room_limit = r;
+	this->limit = t;
+	return true;
+}
+inline bool HoldBudget::enabled() const {
+	return this->room_limit > 0 || this->limit > 0;
+}
+/* Count n more bytes, or fewer if negative, held in a room */
+inline void HoldBudget::add(long long &room, long long n) {
+	room += n;
+	this->used += n;
+	this->peak = this->used > this->peak ? this->used : this->peak;
+}
+/* Whether n more bytes can be held in a room */
+inline bool HoldBudget::fits(long long room, long long n) const {
+	return (this->room_limit == 0 || room + n <= this->room_limit)
+			&& (this->limit == 0 || this->used + n <= this->limit);
+}
+inline long long HoldBudget::get_used() const {
+	return this->used;
+}
+inline long long HoldBudget::get_peak() const {
+	return this->peak;
+}
+inline long long HoldBudget::get_room_limit() const {
+	return this->room_limit;
+}
+inline long long HoldBudget::get_limit() const {
+	return this->limit;
+}
+
+#endif
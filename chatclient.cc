@@ -10,14 +10,59 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <math.h>
 #include <iostream>
 #include <cstring>
+#include <ctime>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "fragment.h"
+#include "mcast.h"
 
 using namespace std;
 
+const int MSG_LEN = 32768; // longest line we send as one message
+const int LOAD_DEFAULT_RATE = 10; // messages per second of a script without -r
+const double LOAD_MAX_RATE = 1e6; // one message per microsecond, as fine as we schedule
+
 unsigned int listen_fd;
 bool RUNNING;
 bool DEBUG;
+int KEEPALIVE;
+sockaddr_in SERVER_ADDR;
+unsigned int FRAG_ID;
+Reassembler REASSEMBLY;
+char INPUT[MSG_LEN + 1];
+int INPUT_LEN;
+bool MCAST; // asked the server for multicast delivery
+int mcast_fd = -1; // subscribed to the group of our room
+McastStream STREAM;
+unsigned int MCAST_COOKIE; // from the server's J, proves our /repair comes from us
+
+/* Load mode: instead of reading stdin we send messages at a rate, tagged with an id of
+ * this run, a sequence number and the time they were sent, "#id:seq:time text". Our
+ * own come back from the server with the delay of a round trip through the room */
+bool LOAD;
+double LOAD_RATE; // messages per second
+bool LOAD_POISSON; // exponential gaps between messages instead of fixed ones
+long long LOAD_COUNT; // tagged messages to send, 0 for no limit
+int LOAD_PAD; // bytes of filler after the tag of generated messages
+int LOAD_WAIT = 2; // seconds to wait for our last messages to come back
+vector<string> LOAD_SCRIPT; // lines to send in turn, commands as they are
+unsigned int LOAD_ID;
+unsigned int LOAD_SENT;
+unsigned int LOAD_HIGHEST; // highest sequence number that came back
+long long LOAD_START;
+long long LOAD_NEXT; // when the next message is due
+long long LOAD_END; // when we stop waiting for echoes, 0 while sending
+size_t LOAD_LINE; // next line of the script
+vector<bool> LOAD_SEEN; // by sequence number
+vector<long long> LOAD_LATENCY; // of each echo, in microseconds
+long long LOAD_DUPLICATES;
+long long LOAD_REORDERED;
+long long LOAD_GAPS;
+long long LOAD_OTHERS; // messages of other clients
 
 /* Signal handler for ctrl-c */
 void sig_handler(int arg) {
@@ -28,6 +73,297 @@ void sig_handler(int arg) {
 	}
 }
 
+/* Get a timestamp in microseconds */
+long long now_us() {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+/* Match one of our tagged messages coming back and note how long it took */
+void load_receive(const string &text) {
+	size_t tag = text.find("> #");
+	unsigned int id, seq;
+	long long sent;
+	if (text[0] != '<') { // a response of the server
+		if (DEBUG || text[0] == '-') {
+			fprintf(stderr, "%s\n", text.c_str());
+		}
+		return;
+	}
+	if (tag == string::npos
+			|| sscanf(text.c_str() + tag + 3, "%x:%u:%lld", &id, &seq, &sent) != 3
+			|| id != LOAD_ID || seq == 0 || seq > LOAD_SENT) {
+		LOAD_OTHERS++;
+		return;
+	}
+	if (LOAD_SEEN[seq]) {
+		LOAD_DUPLICATES++;
+		return;
+	}
+	LOAD_SEEN[seq] = true;
+	LOAD_LATENCY.push_back(now_us() - sent);
+	if (seq < LOAD_HIGHEST) {
+		LOAD_REORDERED++;
+	} else {
+		if (seq > LOAD_HIGHEST + 1) {
+			LOAD_GAPS++;
+			if (DEBUG) {
+				fprintf(stderr, "Gap: %u to %u missing so far\n", LOAD_HIGHEST + 1, seq - 1);
+			}
+		}
+		LOAD_HIGHEST = seq;
+	}
+}
+
+/* Print a message of the room */
+void print_msg(const string &text) {
+	if (LOAD) {
+		load_receive(text);
+		return;
+	}
+	fprintf(stdout, "%s\n", text.c_str());
+}
+
+/* Subscribe to the group of a room, leaving the one we were in */
+void mcast_join(int room, char* group, unsigned int next) {
+	if (mcast_fd != -1) {
+		close(mcast_fd);
+	}
+	sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	char* port = strchr(group, ':');
+	if (port == NULL) {
+		return;
+	}
+	*port++ = 0;
+	addr.sin_port = htons(atoi(port));
+	ip_mreq mreq;
+	inet_pton(AF_INET, group, &mreq.imr_multiaddr);
+	sockaddr_in local; // join on the interface we reach the server through
+	socklen_t local_len = sizeof(local);
+	int probe = socket(PF_INET, SOCK_DGRAM, 0);
+	connect(probe, (const struct sockaddr*) &SERVER_ADDR, sizeof(SERVER_ADDR));
+	getsockname(probe, (struct sockaddr*) &local, &local_len);
+	close(probe);
+	mreq.imr_interface = local.sin_addr;
+	int on = 1;
+	mcast_fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (mcast_fd == -1
+			|| setsockopt(mcast_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+			|| bind(mcast_fd, (const struct sockaddr*) &addr, sizeof(addr)) == -1
+			|| setsockopt(mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+					sizeof(mreq)) == -1) {
+		fprintf(stderr, "Unable to subscribe to %s:%s.\n", group, port);
+		if (mcast_fd != -1) {
+			close(mcast_fd);
+			mcast_fd = -1;
+		}
+		return;
+	}
+	STREAM.reset(room, next);
+	if (DEBUG) {
+		fprintf(stderr, "Subscribed to %s:%s for room %d\n", group, port, room);
+	}
+}
+
+/* Handle a message from the server or the group: multicast frames and notices go to the
+ * stream, everything else is printed */
+void handle_msg(char* msg) {
+	if (msg[0] != MCAST_MARK) {
+		print_msg(msg);
+		return;
+	}
+	char kind = msg[1];
+	if (kind >= '0' && kind <= '9') { // "room:seq:text"
+		char* seq = strchr(msg + 1, ':');
+		char* text = seq == NULL ? NULL : strchr(seq + 1, ':');
+		if (text != NULL && atoi(msg + 1) == STREAM.get_room()) {
+			STREAM.add(strtoul(seq + 1, NULL, 10), string(text + 1), print_msg);
+		}
+		return;
+	}
+	char* room = strtok(msg + 2, " ");
+	char* arg = strtok(NULL, " ");
+	if (room == NULL) {
+		return;
+	}
+	if (kind == 'J') {
+		char* next = strtok(NULL, " ");
+		char* cookie = strtok(NULL, " ");
+		if (arg != NULL && next != NULL) {
+			MCAST_COOKIE = cookie == NULL ? 0 : strtoul(cookie, NULL, 10);
+			mcast_join(atoi(room), arg, strtoul(next, NULL, 10));
+		}
+	} else if (kind == 'G' && arg != NULL && atoi(room) == STREAM.get_room()) {
+		STREAM.skip_to(strtoul(arg, NULL, 10), print_msg);
+	} else if (kind == 'P' && atoi(room) == STREAM.get_room()) {
+		close(mcast_fd);
+		mcast_fd = -1;
+		STREAM.reset(-1, 0);
+	}
+}
+
+/* Receive a datagram from the server or the group, reassembling long messages */
+void receive(int fd) {
+	static char buffer[MAX_MESSAGE_LEN + 1];
+	sockaddr_in from;
+	socklen_t from_len = sizeof(from);
+	int len = recvfrom(fd, buffer, MAX_MESSAGE_LEN, MSG_DONTWAIT, // a resubscribed group may have nothing yet
+			(struct sockaddr*) &from, &from_len);
+	if (len < 0) {
+		return;
+	}
+	buffer[len] = 0;
+	long long now = now_us();
+	REASSEMBLY.expire(now);
+	if (buffer[0] == FRAG_MARK) {
+		string whole;
+		if (REASSEMBLY.add(from, buffer, len, now, whole)) {
+			handle_msg(&whole[0]);
+		}
+	} else {
+		handle_msg(buffer);
+	}
+	fflush(stdout);
+}
+
+/* Ask the server again for the messages missing from the group */
+void request_repair() {
+	unsigned int first, last;
+	if (STREAM.repair(now_us(), first, last, print_msg)) {
+		char req[64] = { };
+		snprintf(req, sizeof(req), "/repair %d %u %u %u", STREAM.get_room(), first, last,
+				MCAST_COOKIE);
+		sendto(listen_fd, req, strlen(req), 0, (const struct sockaddr*) &SERVER_ADDR,
+				sizeof(SERVER_ADDR));
+		if (DEBUG) {
+			fprintf(stderr, "Missing %u to %u, repair requested\n", first, last);
+		}
+	}
+	fflush(stdout);
+}
+
+/* Send one line of input to the server, in fragments if it is long */
+void send_line(char* line) {
+	send_fragmented(listen_fd, line, strlen(line), SERVER_ADDR, FRAG_ID);
+	if (strncasecmp(line, "/quit", 5) == 0
+			&& (line[5] == 0 || line[5] == ' ')) {
+		RUNNING = false;
+		close(listen_fd);
+		if (DEBUG) {
+			printf("\nClient socket closed\n");
+		}
+	}
+}
+
+/* Schedule the message after the one due at LOAD_NEXT */
+void load_schedule() {
+	double gap = LOAD_POISSON ? -log(1 - drand48()) / LOAD_RATE : 1 / LOAD_RATE;
+	LOAD_NEXT += (long long) (gap * 1000000);
+}
+
+/* Send the messages that are due; once the last is out, wait LOAD_WAIT for the echoes.
+ * Returns the microseconds until the next one, -1 when done */
+long long load_send(long long now) {
+	static char line[MSG_LEN + 1];
+	while (RUNNING && LOAD_END == 0 && now >= LOAD_NEXT) {
+		bool script = !LOAD_SCRIPT.empty();
+		if ((script && LOAD_LINE == LOAD_SCRIPT.size())
+				|| (LOAD_COUNT > 0 && LOAD_SENT == LOAD_COUNT)) {
+			LOAD_END = now + LOAD_WAIT * 1000000LL;
+			break;
+		}
+		const char* text = script ? LOAD_SCRIPT[LOAD_LINE++].c_str() : "";
+		if (text[0] == '/') { // commands go as they are and do not count
+			snprintf(line, sizeof(line), "%s", text);
+		} else {
+			LOAD_SENT++;
+			LOAD_SEEN.push_back(false);
+			int n = snprintf(line, sizeof(line), "#%08x:%u:%lld %s", LOAD_ID, LOAD_SENT, now,
+					text);
+			int end = script ? n : n + LOAD_PAD;
+			while (n < (int) sizeof(line) - 1 && n < end) {
+				line[n++] = 'x';
+			}
+			line[n] = 0;
+		}
+		send_line(line);
+		load_schedule();
+	}
+	if (LOAD_END != 0) {
+		return now >= LOAD_END ? -1 : LOAD_END - now;
+	}
+	return LOAD_NEXT - now;
+}
+
+/* What a load run sent and how long its messages took to come back */
+void load_report() {
+	long long end = LOAD_END != 0 ? LOAD_END - LOAD_WAIT * 1000000LL : now_us(); // done sending
+	double secs = (end - LOAD_START) / 1e6;
+	fprintf(stderr, "Sent %u messages in %.3f s (%.1f per second), %zu came back, %u missing, %lld duplicates, %lld out of order, %lld gaps, %lld from other clients\n",
+			LOAD_SENT, secs, secs > 0 ? LOAD_SENT / secs : 0.0, LOAD_LATENCY.size(),
+			LOAD_SENT - (unsigned int) LOAD_LATENCY.size(), LOAD_DUPLICATES, LOAD_REORDERED,
+			LOAD_GAPS, LOAD_OTHERS);
+	vector<long long> &l = LOAD_LATENCY;
+	if (l.empty()) {
+		return;
+	}
+	sort(l.begin(), l.end());
+	long long sum = 0;
+	for (long long x : l) {
+		sum += x;
+	}
+	fprintf(stderr, "Latency (us): mean %lld, median %lld, 90th percentile %lld, 99th percentile %lld, max %lld\n",
+			sum / (long long) l.size(), l[l.size() / 2], l[l.size() * 9 / 10],
+			l[l.size() * 99 / 100], l.back());
+}
+
+/* Read the lines a load run sends */
+void load_script(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to read script %s.\n", path);
+		exit(1);
+	}
+	static char line[MSG_LEN + 2];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] != 0) {
+			LOAD_SCRIPT.push_back(line);
+		}
+	}
+	fclose(f);
+	LOAD = true;
+}
+
+/* Read from stdin and send every complete line */
+bool read_input() {
+	int len = read(STDIN_FILENO, INPUT + INPUT_LEN, MSG_LEN - INPUT_LEN);
+	if (len <= 0) {
+		return false;
+	}
+	INPUT_LEN += len;
+	char* line = INPUT;
+	char* nl;
+	while (RUNNING
+			&& (nl = (char*) memchr(line, '\n', INPUT + INPUT_LEN - line))
+					!= NULL) {
+		*nl = 0;
+		send_line(line);
+		line = nl + 1;
+	}
+	INPUT_LEN -= line - INPUT;
+	memmove(INPUT, line, INPUT_LEN);
+	if (RUNNING && INPUT_LEN == MSG_LEN) { // no newline in sight: send what fits
+		INPUT[INPUT_LEN] = 0;
+		send_line(INPUT);
+		INPUT_LEN = 0;
+	}
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	if (argc < 2) {
 		fprintf(stderr, "*** Author: Gongyao Chen (gongyaoc)\n");
@@ -41,17 +377,52 @@ int main(int argc, char *argv[]) {
 
 	/* Parsing command line arguments */
 	int ch = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
+	const char* join = NULL;
+	while ((ch = getopt(argc, argv, "b:j:k:mn:pr:s:vw:")) != -1) {
 		switch (ch) {
 		case 'v':
 			DEBUG = true;
 			break;
+		case 'k':
+			KEEPALIVE = atoi(optarg);
+			break;
+		case 'm':
+			MCAST = true;
+			break;
+		case 'r':
+			LOAD_RATE = atof(optarg);
+			LOAD = true;
+			if (LOAD_RATE <= 0 || LOAD_RATE > LOAD_MAX_RATE) {
+				fprintf(stderr, "Please enter a rate of up to %.0f messages per second.\n",
+						LOAD_MAX_RATE);
+				exit(1);
+			}
+			break;
+		case 'p':
+			LOAD_POISSON = true;
+			break;
+		case 'n':
+			LOAD_COUNT = max(atoll(optarg), 0LL);
+			LOAD = true;
+			break;
+		case 's':
+			load_script(optarg);
+			break;
+		case 'b':
+			LOAD_PAD = min(max(atoi(optarg), 0), MSG_LEN - 64);
+			break;
+		case 'w':
+			LOAD_WAIT = max(atoi(optarg), 0);
+			break;
+		case 'j':
+			join = optarg;
+			break;
 		case '?':
 			fprintf(stderr, "Error: Invalid choose: %c\n", (char) optopt);
 			exit(1);
 		default:
 			fprintf(stderr,
-					"Error: Please input [IP address:port number] [-v]\n");
+					"Error: Please input [IP address:port number] [-b bytes] [-j room] [-k keepalive seconds] [-m] [-n messages] [-p] [-r rate] [-s script] [-v] [-w seconds]\n");
 			exit(1);
 		}
 	}
@@ -73,7 +444,7 @@ int main(int argc, char *argv[]) {
 	}
 	unsigned int port_N = atoi(port);
 
-	struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
+	struct sockaddr_in client_addr; // Structure to represent the server
 
 	/* Set up client socket */
 	if ((listen_fd = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
@@ -90,20 +461,74 @@ int main(int argc, char *argv[]) {
 	}
 	fflush(stdout);
 	RUNNING = true;
+	SERVER_ADDR = client_addr;
+	if (MCAST) {
+		const char* req = "/mcast";
+		sendto(listen_fd, req, strlen(req), 0, (const struct sockaddr*) &client_addr,
+				sizeof(client_addr));
+	}
+	if (join != NULL) {
+		string req = string("/join ") + join;
+		sendto(listen_fd, req.data(), req.size(), 0, (const struct sockaddr*) &client_addr,
+				sizeof(client_addr));
+	}
+	if (LOAD) { // the first message goes right away
+		LOAD_RATE = LOAD_RATE > 0 ? LOAD_RATE : LOAD_DEFAULT_RATE;
+		srand48(now_us() ^ getpid());
+		LOAD_ID = lrand48();
+		LOAD_SEEN.push_back(false); // sequence numbers start at 1
+		LOAD_START = now_us();
+		LOAD_NEXT = LOAD_START;
+	}
 
 	/* Set up selection reading */
 	fd_set readfds;
 	struct timeval timeout;
+	time_t last_sent = time(NULL);
+	bool input_open = !LOAD;
 
 	while (RUNNING) {
 		/* Set up client monitoring */
-		socklen_t server_len = sizeof(server_addr);
 		FD_ZERO(&readfds);
 		FD_SET(listen_fd, &readfds);
-		FD_SET(STDIN_FILENO, &readfds);
-		timeout.tv_sec = 10;
+		if (input_open) {
+			FD_SET(STDIN_FILENO, &readfds);
+		}
+		if (mcast_fd != -1) {
+			FD_SET(mcast_fd, &readfds);
+		}
+		timeout.tv_sec = KEEPALIVE - (time(NULL) - last_sent);
 		timeout.tv_usec = 0;
-		int res = select(listen_fd + 1, &readfds, NULL, NULL, NULL);
+		if (timeout.tv_sec < 0) {
+			timeout.tv_sec = 0;
+		}
+		long long gap = STREAM.wait(now_us()); // wake up to repair a gap in the group
+		if (gap >= 0 && (KEEPALIVE <= 0 || gap < timeout.tv_sec * 1000000LL)) {
+			timeout.tv_sec = gap / 1000000;
+			timeout.tv_usec = gap % 1000000;
+		}
+		long long due = -1; // until the next message of a load run
+		if (LOAD) {
+			due = load_send(now_us());
+			if (due < 0) { // sent everything and waited for it
+				break;
+			}
+			if ((KEEPALIVE <= 0 && gap < 0)
+					|| due < timeout.tv_sec * 1000000LL + timeout.tv_usec) {
+				timeout.tv_sec = due / 1000000;
+				timeout.tv_usec = due % 1000000;
+			}
+		}
+		int res = select(max((int) listen_fd, mcast_fd) + 1, &readfds, NULL, NULL,
+				KEEPALIVE > 0 || gap >= 0 || due >= 0 ? &timeout : NULL);
+		request_repair();
+		if (res == 0 && KEEPALIVE > 0 && time(NULL) - last_sent >= KEEPALIVE) { // keep the server from evicting us while idle
+			const char* ka = "/keepalive";
+			sendto(listen_fd, ka, strlen(ka), 0,
+					(const struct sockaddr*) &client_addr, sizeof(client_addr));
+			last_sent = time(NULL);
+			continue;
+		}
 		if (res <= 0) {
 			if (DEBUG) {
 				fprintf(stderr, "Client waiting income...\n");
@@ -112,31 +537,21 @@ int main(int argc, char *argv[]) {
 		}
 
 		/* Handle income message */
-		char buffer[1025] = { };
-		int len = 0;
 		if (FD_ISSET(STDIN_FILENO, &readfds)) {
-			len = read(STDIN_FILENO, buffer, 1024);
-			buffer[len - 1] = 0; // get away the \n
-			sendto(listen_fd, buffer, strlen(buffer), 0,
-					(const struct sockaddr*) &client_addr, sizeof(client_addr));
-			char* token = strtok(buffer, " ");
-			if (strcasecmp(token, "/quit") == 0) {
-				RUNNING = false;
-				close(listen_fd);
-				if (DEBUG) {
-					printf("\nClient socket closed\n");
-				}
-				break;
-			}
-		} else {
-			len = recvfrom(listen_fd, buffer, 1024, 0,
-					(struct sockaddr*) &server_addr, &server_len);
-			buffer[len] = 0;
-			fprintf(stdout, "%s\n", buffer);
+			input_open = read_input();
+			last_sent = time(NULL);
+		}
+		if (RUNNING && FD_ISSET(listen_fd, &readfds)) {
+			receive(listen_fd);
+		}
+		if (RUNNING && mcast_fd != -1 && FD_ISSET(mcast_fd, &readfds)) {
+			receive(mcast_fd);
 		}
-		memset(buffer, 0, 1025);
 	}
 
+	if (LOAD) {
+		load_report();
+	}
 	if (DEBUG) {
 		printf("Client successfully shut down.\n");
 	}
@@ -1,5 +1,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -9,13 +11,29 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <deque>
+#include <unordered_set>
+#include "trace.h"
+#include "fragment.h"
+#include "compress.h"
+#include "history.h"
+#include "snapshot.h"
+#include "mcast.h"
+#include "outbox.h"
+#include "ratelimit.h"
+#include "budget.h"
+#include "ring.h"
+#include "net.h"
+#include "profile.h"
 
 using namespace std;
 
@@ -26,16 +44,47 @@ const char* JOINED = "-ERR You are already in room #";
 const char* LEFT = "+OK You have left chat room #";
 const char* UNJOINED = "-ERR Haven't joined any chat room yet.";
 const char* UNKNOWN = "-ERR Unknown command.";
+const char* BUSY = "-ERR Server busy, message dropped.";
 
-const int ROOM_NUM = 16;
-const int MSG_LEN = 1024;
+const int ROOM_LINGER = 60; // seconds a room stays allocated after it went quiet
+const int MAX_SERVERS = 1024; // highest server index a joining server may use
+const long long JOIN_RETRY = 1000000; // microseconds between join requests until we are in
+const long long TOTAL_RESEND = 200000; // microseconds until a total order phase is sent again
+const long long AGREED_KEEP = 10000000; // microseconds we answer for an agreement we sent
+const long long INTEREST_BACKLOG = 1000000; // microseconds of our multicasts a newly interested server gets
+const long long INTEREST_RETRY = 500000; // microseconds until an INTEREST without its SEQ is sent again
+const long long SNAPSHOT_INTERVAL = 1000000; // microseconds between snapshots of changed state
+const int HISTORY_LINES = 10; // lines /history replays without a count
+const int HISTORY_MAX_LINES = 200; // lines one /history replays at most
+const int STATS_MAX_CLIENTS = 100; // clients listed by /admin stats
+const int STATS_MAX_ROOMS = 100; // rooms listed by /admin memory
+const long long NACK_INTERVAL = 200000; // microseconds between retransmission requests in a room
+const int SHAPE_MAX_LINES = 64; // lines deferred per client before they are refused
+const int RECEIVE_BATCH = 64; // datagrams handled between timer checks
+const int MSG_LEN = 32768; // longest chat line a client may post
+const int NICK_LEN = 63; // longest nick name
+const int FRAME_LEN = MAX_MESSAGE_LEN; // chat line plus sender name and multicast header
 const int UNORDERED = 0;
 const int FIFO = 1;
 const int CAUSAL = 2;
 const int TOTAL = 3;
+const char* ORDER_NAMES[] = { "unordered", "fifo", "causal", "total" };
+const int PROF_CLASSIFY = 0; // stages profiled with -p, see profile.h
+const int PROF_PARSE = 1; // of peer frames
+const int PROF_CLIENT_PARSE = 2; // of client datagrams, into a command or a chat line
+const int PROF_ENGINE = 3; // and on, one per order
+const int PROF_FANOUT = PROF_ENGINE + TOTAL + 1;
+const char* PROF_STAGES[] = { "classify", "peer parse", "client parse", "unordered", "fifo",
+		"causal", "total", "fan-out" };
 const char NEW_MSG = 0;
 const char PROPOSAL = 1;
 const char AGREEMENT = 2;
+const char PLAIN_MSG = 3; // unordered, fifo and causal multicasts carry PLAIN_MSG + their order
+const char CTRL_MARK = '\x04'; // first byte of a control message between servers
+const char RELAY_MARK = '\x05'; // first byte of a multicast relayed along its origin's tree
+const uint8_t SNAP_GLOBAL = 'G';
+const uint8_t SNAP_CLIENTS = 'C';
+const uint8_t SNAP_ROOM = 'R';
 
 /* A class for the message that deals with its info, deliverable and clock */
 class Message {
@@ -44,7 +93,7 @@ private:
 	int sender;
 	bool deliverable;
 	vector<int> clock;
-	char* message;
+	string message;
 public:
 	Message(int id, int sender) { // for totally ordered
 		this->id = id;
@@ -62,12 +111,19 @@ public:
 		}
 		this->message = message;
 	}
+	Message(int id, int sender, bool deliverable, vector<int> clock, string message) { // restored from a snapshot
+		this->id = id;
+		this->sender = sender;
+		this->deliverable = deliverable;
+		this->clock = clock;
+		this->message = message;
+	}
 	int get_id() const;
 	int get_sender() const;
 	void set_deliverable();
 	bool is_deliverable() const;
 	vector<int> get_clock();
-	char* get_msg();
+	const char* get_msg();
 };
 int Message::get_id() const {
 	return this->id;
@@ -84,8 +140,8 @@ bool Message::is_deliverable() const {
 vector<int> Message::get_clock() {
 	return this->clock;
 }
-char* Message::get_msg() {
-	return this->message;
+const char* Message::get_msg() {
+	return this->message.c_str();
 }
 
 /* A class for the client that deals with its address, room and nick name */
@@ -93,34 +149,215 @@ class Client {
 private:
 	sockaddr_in addr;
 	string nick_name;
+	string prefix; // "<nick name> " or "<ip:port> ", put before the client's chat lines
 	int room;
+	unsigned long long id;
+	long long last_active;
+	bool mcast;
+	Outbox outbox;
+	TokenBucket bucket;
 public:
 	Client(sockaddr_in addr) {
 		this->addr = addr;
-		this->nick_name = "";
+		set_nick_name("");
 		this->room = -1;
+		this->id = 0;
+		this->last_active = 0;
+		this->mcast = false;
 	}
 	sockaddr_in get_addr();
 	void set_nick_name(string name);
 	string get_nick_name();
+	const string& get_prefix();
 	void set_room(int room);
 	int get_room();
+	void set_id(unsigned long long id);
+	unsigned long long get_id();
+	void set_last_active(long long t);
+	long long get_last_active();
+	void set_mcast(bool on);
+	bool get_mcast();
+	Outbox& get_outbox();
+	TokenBucket& get_bucket();
 };
 sockaddr_in Client::get_addr() {
 	return this->addr;
 }
 void Client::set_nick_name(string name) {
 	this->nick_name = name;
+	if (name == "") { // known by its address
+		char ip_name[64] = { };
+		snprintf(ip_name, sizeof(ip_name), "<%s:%d> ", inet_ntoa(this->addr.sin_addr),
+				ntohs(this->addr.sin_port));
+		this->prefix = ip_name;
+	} else {
+		this->prefix = "<" + name + "> ";
+	}
 }
 string Client::get_nick_name() {
 	return this->nick_name;
 }
+const string& Client::get_prefix() {
+	return this->prefix;
+}
 void Client::set_room(int room) {
 	this->room = room;
 }
 int Client::get_room() {
 	return this->room;
 }
+void Client::set_id(unsigned long long id) {
+	this->id = id;
+}
+unsigned long long Client::get_id() {
+	return this->id;
+}
+void Client::set_last_active(long long t) {
+	this->last_active = t;
+}
+long long Client::get_last_active() {
+	return this->last_active;
+}
+void Client::set_mcast(bool on) {
+	this->mcast = on;
+}
+bool Client::get_mcast() {
+	return this->mcast;
+}
+Outbox& Client::get_outbox() {
+	return this->outbox;
+}
+TokenBucket& Client::get_bucket() {
+	return this->bucket;
+}
+
+/* Client ids hold a slot in the low half and the slot's generation in the high half,
+ * so an id of a removed client never matches the client that reuses its slot */
+typedef unsigned long long ClientId;
+
+/* A slot map of the clients: lookup by id or address and removal are O(1), ids of other
+ * clients stay valid on removal and the clients stay densely packed for the fan-out */
+class ClientTable {
+private:
+	vector<Client> clients;
+	vector<unsigned int> dense_slot; // position in clients -> slot
+	vector<unsigned int> slot_pos; // slot -> position in clients
+	vector<unsigned int> slot_gen;
+	vector<unsigned int> free_slots;
+	unordered_map<unsigned long long, ClientId> by_addr;
+	static unsigned long long addr_key(sockaddr_in addr);
+public:
+	ClientId add(Client c);
+	Client* get(ClientId id);
+	bool find(sockaddr_in addr, ClientId &id);
+	void remove(ClientId id);
+	int size() const;
+	vector<Client>::iterator begin();
+	vector<Client>::iterator end();
+};
+unsigned long long ClientTable::addr_key(sockaddr_in addr) {
+	return ((unsigned long long) addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+ClientId ClientTable::add(Client c) {
+	unsigned int slot;
+	if (free_slots.empty()) {
+		slot = slot_pos.size();
+		slot_pos.push_back(0);
+		slot_gen.push_back(1);
+	} else {
+		slot = free_slots.back();
+		free_slots.pop_back();
+	}
+	ClientId id = ((ClientId) slot_gen[slot] << 32) | slot;
+	slot_pos[slot] = clients.size();
+	c.set_id(id);
+	clients.push_back(c);
+	dense_slot.push_back(slot);
+	by_addr[addr_key(c.get_addr())] = id;
+	return id;
+}
+Client* ClientTable::get(ClientId id) {
+	unsigned int slot = id & 0xffffffff;
+	if (slot >= slot_gen.size() || slot_gen[slot] != (id >> 32)) {
+		return NULL;
+	}
+	return &clients[slot_pos[slot]];
+}
+bool ClientTable::find(sockaddr_in addr, ClientId &id) {
+	auto it = by_addr.find(addr_key(addr));
+	if (it == by_addr.end()) {
+		return false;
+	}
+	id = it->second;
+	return true;
+}
+void ClientTable::remove(ClientId id) {
+	Client* c = get(id);
+	if (c == NULL) {
+		return;
+	}
+	unsigned int slot = id & 0xffffffff;
+	unsigned int pos = slot_pos[slot];
+	by_addr.erase(addr_key(c->get_addr()));
+	clients[pos] = clients.back(); // move the last client into the hole
+	dense_slot[pos] = dense_slot.back();
+	slot_pos[dense_slot[pos]] = pos;
+	clients.pop_back();
+	dense_slot.pop_back();
+	slot_gen[slot]++;
+	free_slots.push_back(slot);
+}
+int ClientTable::size() const {
+	return clients.size();
+}
+vector<Client>::iterator ClientTable::begin() {
+	return clients.begin();
+}
+vector<Client>::iterator ClientTable::end() {
+	return clients.end();
+}
+
+/* Printable number of a client for debug use */
+unsigned int client_no(ClientId id) {
+	return (id & 0xffffffff) + 1;
+}
+
+/* A hashed timer wheel with one-second ticks, used for idle client eviction and room
+ * reclamation. An entry is scheduled once and rescheduled lazily when its bucket comes
+ * up, so activity costs nothing */
+template<typename T> class TimerWheel {
+private:
+	vector<vector<T>> buckets;
+	long long tick;
+public:
+	TimerWheel(int size) {
+		this->buckets.resize(size);
+		this->tick = 0;
+	}
+	void start(long long now);
+	void schedule(T id, long long due);
+	template<typename F> void advance(long long now, F expire);
+};
+template<typename T> void TimerWheel<T>::start(long long now) {
+	this->tick = now;
+}
+template<typename T> void TimerWheel<T>::schedule(T id, long long due) {
+	if (due <= tick) {
+		due = tick + 1;
+	}
+	buckets[due % buckets.size()].push_back(id);
+}
+template<typename T> template<typename F> void TimerWheel<T>::advance(
+		long long now, F expire) {
+	while (tick < now) {
+		tick++;
+		vector<T> due;
+		due.swap(buckets[tick % buckets.size()]);
+		for (T id : due) {
+			expire(id, tick);
+		}
+	}
+}
 
 /* Comparison structure for total order's hold-back queue */
 struct Comp {
@@ -134,30 +371,222 @@ struct Comp {
 	}
 };
 
-vector<Client> CLIENTS;
-vector<sockaddr_in> SERVERS;
-vector<vector<unordered_map<int, string>>> FIFO_QUEUE;
-vector<vector<Message>> CAUSAL_QUEUE;
-vector<map<Message, string, Comp>> TOTAL_QUEUE;
-vector<int> FIFO_ID;
-vector<int> CLOCK;
-vector<int> PROPOSED;
-vector<int> AGREED;
-vector<vector<int>> RECEIVED;
-unsigned int listen_fd;
-int SELF_IDX;
-string CF_NAME;
-int ORDER;
-bool DEBUG;
-bool RUNNING;
-
-/* Signal handler for ctrl-c */
+/* One of our own multicasts, kept for a while for servers that become interested */
+struct Recent {
+	long long sent; // slots of a Ring, reused with their frame's buffer
+	int seq; // fifo id, or our entry of the causal clock
+	string frame;
+};
+
+/* Ordering state of a chat room. Rooms are created on first use and reclaimed once
+ * they have no members, no held-back messages and no interested servers and have been
+ * quiet for ROOM_LINGER */
+struct Room {
+	int order; // the engine our clients' posts to this room go through
+	int members;
+	long long last_active;
+	int fifo_id; // our own fifo sequence number in this room
+	long long fifo_epoch; // when we started numbering, so peers notice a reclaimed room
+	int fifo_base; // first id after we were quiet, where peers without state start
+	long long fifo_last_sent;
+	vector<long long> epoch; // fifo epoch per sender
+	vector<int> received; // last fifo id delivered per sender
+	vector<unordered_map<int, string>> fifo_queue; // per sender
+	vector<bool> interested; // servers with members in this room
+	vector<bool> baseline; // senders whose starting point we learnt since we became interested
+	vector<int> clock; // causal clock of this room
+	Ring<Recent> recent; // our multicasts of the last INTEREST_BACKLOG
+	vector<Message> causal_queue;
+	map<Message, string, Comp> total_queue;
+	unordered_map<string, Message> total_index; // message key -> its undelivered entry
+	unordered_map<string, long long> total_asked; // undelivered key -> when its agreement was last asked for
+	int proposed;
+	int agreed;
+	unsigned int mcast_seq; // last message sent to the room's multicast group
+	Ring<string> mcast_sent; // the last MCAST_BACKLOG of them, for repairs
+	TokenBucket bucket; // posts of our clients to this room
+	long long held; // bytes held back in this room, counted against HOLD
+	long long nacked; // when we last asked for a retransmission in this room
+	vector<bool> nack_due; // senders to ask for one once NACK_INTERVAL has passed
+	bool snap_dirty; // changed since its last snapshot, and in SNAP_DIRTY
+	long long interest_sent; // when we last announced our interest in it
+	Room() {
+		this->order = UNORDERED;
+		this->members = 0;
+		this->last_active = 0;
+		this->fifo_id = 0;
+		this->fifo_epoch = 0;
+		this->fifo_base = 1;
+		this->fifo_last_sent = 0;
+		this->proposed = 0;
+		this->agreed = 0;
+		this->mcast_seq = 0;
+		this->held = 0;
+		this->nacked = 0;
+		this->snap_dirty = false;
+		this->interest_sent = 0;
+	}
+};
+
+/* Proposed numbers collected for one of our totally ordered messages */
+struct Pending {
+	int room;
+	vector<Message> votes;
+	string frame; // our NEW_MSG, sent again to servers whose vote is missing
+	long long sent;
+	Pending() {
+		this->room = 0;
+		this->sent = 0;
+	}
+};
+typedef unordered_map<string, Pending> Proposals; // by message key
+
+/* A multicast between servers, "id,clock,ord,proby,room,text", parsed in place */
+struct Frame {
+	int from; // index of the server it came from
+	int id;
+	char* clock;
+	int ord;
+	int proby;
+	int room;
+	char* text;
+};
+
+/* Ordering engines, one policy class per multicast order. post builds the frame of a
+ * client's message, false if it cannot be held; receive takes a frame posted in the
+ * engine's order. Only total order takes the proposals collected for our messages.
+ * LOCAL engines only route a room's traffic to servers with members in it. The paths
+ * from a client and from a server are templates instantiated once per engine, so each
+ * order runs its own copy without branching on the mode */
+struct UnorderedEngine {
+	static const int ID = UNORDERED;
+	static const bool LOCAL = true;
+	static bool post(int room, Room &r, const char* text, char* frame);
+	static void receive(Frame &f, Room &r);
+};
+struct FifoEngine {
+	static const int ID = FIFO;
+	static const bool LOCAL = true;
+	static bool post(int room, Room &r, const char* text, char* frame);
+	static void receive(Frame &f, Room &r);
+};
+struct CausalEngine {
+	static const int ID = CAUSAL;
+	static const bool LOCAL = true;
+	static bool post(int room, Room &r, const char* text, char* frame);
+	static void receive(Frame &f, Room &r);
+};
+struct TotalEngine {
+	static const int ID = TOTAL;
+	static const bool LOCAL = false; // every server proposes a number
+	static bool post(int room, Room &r, const char* text, char* frame, Proposals &proposals);
+	static void receive(Frame &f, Room &r, Proposals &proposals);
+};
+
+/* State of the server, per thread so a simulator can run many servers in one process */
+thread_local ClientTable CLIENTS;
+thread_local TimerWheel<ClientId> IDLE_WHEEL(64);
+thread_local vector<sockaddr_in> SERVERS;
+thread_local unordered_map<int, Room> ROOMS;
+thread_local TimerWheel<int> ROOM_WHEEL(64);
+thread_local int ROOM_NUM = 16;
+thread_local unsigned int listen_fd; // peer socket, and the client socket unless one is configured
+thread_local unsigned int client_fd;
+thread_local int PEER_WEIGHT; // peer datagrams handled per client datagram, 0 for strict priority
+thread_local long long PEER_OVERFLOW; // datagrams the kernel dropped on the peer socket
+thread_local long long CLIENT_OVERFLOW;
+thread_local int SELF_IDX;
+thread_local string CF_NAME;
+thread_local int ORDER; // of rooms not configured otherwise
+thread_local bool DEBUG;
+thread_local bool RUNNING;
+thread_local HistoryLog HISTORY;
+thread_local Reassembler REASSEMBLY;
+thread_local unsigned int FRAG_ID;
+thread_local bool ZIP;
+thread_local vector<bool> PEER_ZIP; // whether a server accepts compressed messages
+thread_local long long ZIP_RAW;
+thread_local long long ZIP_SENT;
+thread_local long long PEER_SENT; // messages sent to servers
+thread_local int FANOUT; // children per server in the relay trees, 0 for a full mesh
+thread_local sockaddr_in MCAST_GROUP; // base of the rooms' multicast groups, port 0 if off
+thread_local unsigned int MCAST_SECRET; // key of the cookies clients repair with
+thread_local long long MCAST_LOST; // group frames the socket did not take, left to /repair
+thread_local const char* ADMIN_TOKEN; // lets clients off the loopback interface use /admin
+thread_local int OUTBOX_LIMIT = OUTBOX_LEN;
+thread_local int OUTBOX_POLICY = OUTBOX_DROP_OLDEST;
+thread_local unordered_set<ClientId> BACKLOGGED; // clients with queued messages
+thread_local vector<ClientId> SLOW; // clients to disconnect under the drop client policy
+thread_local long long CLIENT_DROPS;
+thread_local long long CLIENT_SHED;
+thread_local RateLimit CLIENT_RATE; // posts per client
+thread_local RateLimit ROOM_RATE; // posts per room, of the clients on this server
+thread_local bool SHAPING; // defer posts over the rate instead of refusing them
+thread_local unordered_map<ClientId, deque<string>> SHAPED; // deferred lines per client
+thread_local long long RATE_DEFERRED;
+thread_local long long RATE_REFUSED;
+thread_local HoldBudget HOLD; // bytes of held-back messages, see budget.h
+thread_local long long ENGINE_FRAMES[TOTAL + 1]; // frames each ordering engine received
+thread_local char REPLY[1024]; // responses to clients are formatted here
+thread_local Profiler PROF;
+thread_local int HOLD_POLICY;
+thread_local long long HOLD_SHEDS; // messages refused because they would not fit the budget
+thread_local long long HOLD_DROPS; // messages given up on to free it
+thread_local long long HOLD_NACKS; // retransmissions asked for to free it
+thread_local unordered_set<int> NACK_ROOMS; // rooms with retransmissions still to ask for
+
+/* Order of a room other than ORDER, as configured or as the coordinator last set it */
+struct RoomOrder {
+	int order;
+	int version; // 0 as configured, counting up with each change
+};
+thread_local unordered_map<int, RoomOrder> ROOM_ORDERS;
+thread_local unordered_map<int, vector<bool>> ORDER_UNACKED; // room -> servers yet to acknowledge its ORDER
+thread_local int TOTAL_ROOMS; // rooms in ROOM_ORDERS in total order
+thread_local unsigned int TOTAL_SEQ;
+thread_local long long TOTAL_EPOCH;
+thread_local const char* SNAP_PATH;
+thread_local long long SNAP_LAST;
+thread_local unordered_map<int, Section> SNAP_ROOMS; // serialized state per room
+thread_local unordered_set<int> SNAP_DIRTY; // rooms whose serialized state is stale
+thread_local Section SNAP_CLIENTS_BLOB;
+thread_local SnapshotWriter SNAP_WRITER;
+thread_local long long SNAP_FAILED; // failed writes reported so far
+thread_local bool CLIENTS_DIRTY;
+thread_local FILE* TRACE_FILE;
+thread_local long long TRACE_LAST;
+thread_local int IDLE_TIMEOUT;
+thread_local vector<bool> ACTIVE; // servers in the current view
+thread_local int VIEW_ID;
+thread_local bool VIEW_DIRTY;
+thread_local bool JOINING; // joining a running cluster rather than starting with the configured one
+thread_local bool IN_VIEW;
+thread_local bool HAVE_STATE;
+thread_local bool LEAVING;
+thread_local long long FAILURE_TIMEOUT; // microseconds of silence until a server is suspected, 0 for never
+thread_local vector<long long> LAST_HEARD; // per server
+thread_local vector<long long> VIEW_HINT; // when we last told a server outside the view about it
+thread_local long long LAST_PING;
+thread_local long long LAST_RESEND;
+thread_local long long LAST_INTEREST; // when INTEREST was last retried
+thread_local bool INTEREST_WAITING; // some server has not answered our INTEREST yet
+thread_local vector<long long> INTEREST_DENIED; // per server, when we last told it again we have no members in a room
+thread_local unordered_map<string, string> AGREED; // message key -> agreement we sent or got for it
+thread_local deque<pair<long long, string>> AGREED_ORDER; // when each was sent, for expiry
+
+/* A message whose origin left the view before we got its agreement. Another member may
+ * have got it and delivered the message, so we ask each member for it and drop the message
+ * only once every one has told us it has none, so either all of us deliver it or none */
+struct Orphan {
+	int room;
+	vector<bool> none; // members that told us they have no agreement for it
+};
+thread_local unordered_map<string, Orphan> ORPHANS; // by message key
+
+/* Signal handler for ctrl-c, and for SIGTERM which leaves the cluster */
 void sig_handler(int arg) {
 	RUNNING = false;
-	close(listen_fd);
-	if (DEBUG) {
-		printf("\nServer %d socket closed\n", SELF_IDX);
-	}
+	LEAVING = arg == SIGTERM;
 }
 
 /* Generate the head info for debug use */
@@ -176,6 +605,218 @@ string debug_str() {
 	return string(time_s) + " " + string(idx_s);
 }
 
+/* Get a monotonic timestamp in microseconds */
+long long now_us() {
+	if (NET != NULL) {
+		return NET->now();
+	}
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* Nanosecond clock for timing the engines */
+long long now_ns() {
+	if (NET != NULL) {
+		return NET->now() * 1000;
+	}
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Next space separated word of a command, advancing rest past it; empty at the end */
+string_view next_word(string_view &rest) {
+	size_t start = rest.find_first_not_of(' ');
+	if (start == string_view::npos) {
+		rest = string_view();
+		return rest;
+	}
+	size_t end = rest.find(' ', start);
+	string_view word = rest.substr(start, end == string_view::npos ? end : end - start);
+	rest = end == string_view::npos ? string_view() : rest.substr(end);
+	return word;
+}
+
+/* Whether a word is name, ignoring case */
+bool is_word(string_view word, const char* name) {
+	return word.size() == strlen(name) && strncasecmp(word.data(), name, word.size()) == 0;
+}
+
+/* Format a response to a client into REPLY */
+const char* format_reply(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(REPLY, sizeof(REPLY), format, args);
+	va_end(args);
+	return REPLY;
+}
+
+/* Start capturing received datagrams into a trace file */
+void open_trace(const char* path) {
+	TRACE_FILE = fopen(path, "wb");
+	if (TRACE_FILE == NULL) {
+		fprintf(stderr, "Unable to open trace file %s.\n", path);
+		exit(1);
+	}
+	setvbuf(TRACE_FILE, NULL, _IOFBF, 1 << 20); // keep writes off the receive path
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	TraceHeader h;
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.server = SELF_IDX;
+	h.start_us = t.tv_sec * 1000000ULL + t.tv_usec;
+	fwrite(&h, sizeof(h), 1, TRACE_FILE);
+	TRACE_LAST = now_us();
+}
+
+/* Append a received datagram to the trace file */
+void trace_datagram(uint8_t kind, sockaddr_in addr, const char* buffer, int len) {
+	if (TRACE_FILE == NULL) {
+		return;
+	}
+	long long now = now_us();
+	long long delta = now - TRACE_LAST;
+	TRACE_LAST = now;
+	TraceRecord r;
+	r.delta_us = delta > UINT32_MAX ? UINT32_MAX : delta;
+	r.ip = addr.sin_addr.s_addr;
+	r.port = ntohs(addr.sin_port);
+	r.kind = kind;
+	r.len = len;
+	fwrite(&r, sizeof(r), 1, TRACE_FILE);
+	fwrite(buffer, 1, len, TRACE_FILE);
+}
+
+/* Send a message to a server, in fragments if it is too long for a datagram */
+void send_msg(const sockaddr_in &addr, const char* msg, int len) {
+	send_fragmented(listen_fd, msg, len, addr, FRAG_ID);
+}
+
+/* Send a message to a client without blocking, queueing it while the socket is full */
+void send_client(Client &c, const char* msg, int len) {
+	Outbox &out = c.get_outbox();
+	long long dropped = out.get_dropped();
+	if (!out.send(client_fd, c.get_addr(), FRAG_ID, msg, len, OUTBOX_LIMIT,
+			OUTBOX_POLICY)) {
+		SLOW.push_back(c.get_id());
+	}
+	CLIENT_DROPS += out.get_dropped() - dropped;
+	if (!out.empty()) {
+		BACKLOGGED.insert(c.get_id());
+	}
+}
+
+/* Send a last message to a client we are about to drop. Its outbox goes with it, so
+ * what the socket does not take now is lost */
+void send_notice(Client &c, const string &msg) {
+	if (!send_fragmented(client_fd, msg.data(), msg.size(), c.get_addr(), FRAG_ID,
+			MSG_DONTWAIT)) {
+		CLIENT_DROPS++;
+	}
+}
+
+/* A message of a room's history for a replay in an outbox, see HistoryLog::read */
+bool read_history(int room, uint32_t &seq, const char* &text, int &len) {
+	return HISTORY.read(room, seq, text, len);
+}
+
+/* Replay the messages first .. end of a room's history to a client from the mapped
+ * segments, queueing the rest of the range while the socket is full */
+void replay_client(Client &c, int room, uint32_t first, uint32_t end) {
+	Outbox &out = c.get_outbox();
+	out.replay(client_fd, c.get_addr(), FRAG_ID, room, first, end, read_history);
+	if (!out.empty()) {
+		BACKLOGGED.insert(c.get_id());
+	}
+}
+
+/* Send queued messages now that the socket is writable, until it is full again */
+void flush_clients() {
+	for (auto it = BACKLOGGED.begin(); it != BACKLOGGED.end();) {
+		Client* c = CLIENTS.get(*it);
+		if (c != NULL && !c->get_outbox().flush(client_fd, c->get_addr(), FRAG_ID,
+				read_history)) {
+			return;
+		}
+		it = BACKLOGGED.erase(it);
+	}
+}
+
+/* Let a whole message through, or hold a fragment back until its message is complete */
+bool reassemble(sockaddr_in addr, char* buffer, int &len, long long now) {
+	if (len == 0 || buffer[0] != FRAG_MARK) {
+		return true;
+	}
+	string whole;
+	if (!REASSEMBLY.add(addr, buffer, len, now, whole)) {
+		return false;
+	}
+	len = min((int) whole.size(), FRAME_LEN);
+	memcpy(buffer, whole.data(), len);
+	buffer[len] = 0;
+	return true;
+}
+
+/* Send a message to another server, compressed if the server accepts it and it pays off */
+void send_server(int i, const char* msg, int len) {
+	PEER_SENT++;
+	ZIP_RAW += len;
+	if (ZIP && PEER_ZIP[i] && len >= ZIP_MIN_LEN) {
+		char zipped[FRAME_LEN + 1];
+		zipped[0] = ZIP_MARK;
+		int n = zip_compress(msg, len, zipped + 1, len - 2);
+		if (n > 0) {
+			ZIP_SENT += n + 1;
+			send_msg(SERVERS[i], zipped, n + 1);
+			return;
+		}
+	}
+	ZIP_SENT += len;
+	send_msg(SERVERS[i], msg, len);
+}
+
+/* Expand a compressed message from a server in place */
+bool unzip(char* buffer, int &len) {
+	if (len == 0 || buffer[0] != ZIP_MARK) {
+		return true;
+	}
+	char plain[FRAME_LEN + 1];
+	int n = zip_decompress(buffer + 1, len - 1, plain, FRAME_LEN);
+	if (n < 0) {
+		return false;
+	}
+	memcpy(buffer, plain, n);
+	buffer[n] = 0;
+	len = n;
+	return true;
+}
+
+/* Write a multicast between servers into frame, which holds FRAME_LEN + 1 bytes */
+void encode_frame(char* frame, int id, const char* clock, int ord, int proby, int room,
+		const char* text) {
+	snprintf(frame, FRAME_LEN + 1, "%d,%s,%d,%d,%d,%s", id, clock, ord, proby, room, text);
+}
+
+/* Split a multicast from server from in place; the text is the rest, commas included */
+void parse_frame(int from, char* buffer, int len, Frame &f) {
+	f.from = from;
+	char* mids = strtok(buffer, ",");
+	f.id = atoi(mids);
+	f.clock = strtok(NULL, ",");
+	char* ords = strtok(NULL, ",");
+	f.ord = atoi(ords);
+	char* probys = strtok(NULL, ",");
+	f.proby = atoi(probys);
+	char* rooms = strtok(NULL, ",");
+	f.room = atoi(rooms);
+	f.text = rooms + strlen(rooms) + 1;
+	if (f.text > buffer + len) {
+		f.text = buffer + len;
+	}
+}
+
 /* Converts an ip address to a sockaddr structure */
 sockaddr_in to_sockaddr(char* addr) {
 	struct sockaddr_in res;
@@ -184,30 +825,24 @@ sockaddr_in to_sockaddr(char* addr) {
 	char* IP_addr = strtok(addr, ":");
 	inet_pton(AF_INET, IP_addr, &(res.sin_addr));
 	char* port = strtok(NULL, ":");
-	res.sin_port = htons(atoi(port));
+	res.sin_port = htons(port == NULL ? 0 : atoi(port));
 	return res;
 }
 
 /* Check if sender is a client */
-bool is_client(sockaddr_in addr, int & index, int &room) {
-	for (int i = 0; i < CLIENTS.size(); i++) {
-		Client c = CLIENTS[i];
-		sockaddr_in client = c.get_addr();
-		if (strcmp(inet_ntoa(client.sin_addr), inet_ntoa(addr.sin_addr)) == 0
-				&& client.sin_port == addr.sin_port) {
-			index = i + 1;
-			room = c.get_room();
-			return true;
-		}
+bool is_client(sockaddr_in addr, ClientId &id, int &room) {
+	if (!CLIENTS.find(addr, id)) {
+		return false;
 	}
-	return false;
+	room = CLIENTS.get(id)->get_room();
+	return true;
 }
 
 /* Check if sender is a server */
-bool is_server(sockaddr_in addr, int & index) {
+bool is_server(const sockaddr_in &addr, int & index) {
 	for (int i = 0; i < SERVERS.size(); i++) {
-		sockaddr_in server = SERVERS[i];
-		if (strcmp(inet_ntoa(server.sin_addr), inet_ntoa(addr.sin_addr)) == 0
+		const sockaddr_in &server = SERVERS[i];
+		if (server.sin_addr.s_addr == addr.sin_addr.s_addr
 				&& server.sin_port == addr.sin_port) {
 			index = i + 1;
 			return true;
@@ -216,366 +851,2594 @@ bool is_server(sockaddr_in addr, int & index) {
 	return false;
 }
 
-/* Handler for a new client */
-void do_new_client(int idx, char* buffer) {
-	Client &c = CLIENTS[idx - 1];
-	char* tk = strtok(buffer, " ");
-	string response = "";
-	if (strcasecmp(tk, "/nick") == 0) { // set nick name
-		char name[64] = { };
-		tk = strtok(NULL, " ");
-		if (tk == NULL) {
-			response += "-ERR Invalid nick name.";
-		} else {
-			strcpy(name, tk);
-			while ((tk = strtok(NULL, " ")) != NULL) {
-				strcat(name, " ");
-				strcat(name, tk);
-			}
-			c.set_nick_name(string(name));
-			response += SET_NAME + string(name) + "\'";
-		}
-	} else if (strcasecmp(tk, "/join") == 0) { // join a chat room
-		tk = strtok(NULL, " ");
-		if (tk == NULL) {
-			response += "-ERR Invalid chat room number.";
-		} else {
-			int rn = atoi(tk);
-			if (rn <= 0) {
-				response += "-ERR Invalid chat room number.";
-			} else if (rn > ROOM_NUM) {
-				response += "-ERR There are only total " + to_string(ROOM_NUM)
-						+ " chat rooms.";
-			} else {
-				c.set_room(rn);
-				response += JOIN_OK + to_string(rn);
-			}
+/* Make room for the per-sender state of every server we know of */
+void grow_room(Room &r) {
+	int n = SERVERS.size();
+	if (r.received.size() < n) {
+		r.epoch.resize(n, 0);
+		r.received.resize(n, 0);
+		r.fifo_queue.resize(n);
+		r.interested.resize(n, false);
+		r.baseline.resize(n, false);
+		r.clock.resize(n, 0);
+		r.nack_due.resize(n, false);
+	}
+}
+
+/* Order of a multicast mode named on the command line or by an admin, -1 if unknown */
+int parse_order(string_view name) {
+	for (int i = UNORDERED; i <= TOTAL; i++) {
+		if (is_word(name, ORDER_NAMES[i])) {
+			return i;
 		}
-	} else { // should first join a chat room
-		response = UNJOINED;
 	}
+	return -1;
+}
 
-	const char* res = response.c_str();
-	sockaddr_in addr = c.get_addr();
-	sendto(listen_fd, res, strlen(res), 0, (const struct sockaddr*) &addr,
-			sizeof(addr));
-	if (DEBUG) {
-		fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
-				debug_str().c_str(), SELF_IDX, idx, res);
+/* The order messages of a room are posted in */
+int room_order(int room) {
+	auto it = ROOM_ORDERS.find(room);
+	return it == ROOM_ORDERS.end() ? ORDER : it->second.order;
+}
+
+/* Whether some room may be in total order */
+bool total_used() {
+	return ORDER == TOTAL || TOTAL_ROOMS > 0;
+}
+
+/* Note that the state of a room changed since the last snapshot, if snapshots are on */
+void room_changed(int room, Room &r) {
+	if (SNAP_PATH != NULL && !r.snap_dirty) {
+		r.snap_dirty = true;
+		SNAP_DIRTY.insert(room);
 	}
 }
 
-/* Forward message to clients */
-void forward_client(int room, const char* text) {
-	for (int i = 0; i < CLIENTS.size(); i++) {
-		Client c = CLIENTS[i];
-		sockaddr_in addr = c.get_addr();
-		if (c.get_room() == room) {
-			sendto(listen_fd, text, strlen(text), 0,
-					(const struct sockaddr*) &addr, sizeof(addr));
-			if (DEBUG) {
-				fprintf(stderr,
-						"%s Server %d send to client %d at room %d: \"%s\"\n",
-						debug_str().c_str(), SELF_IDX, i + 1, c.get_room(),
-						text);
-			}
-		}
+/* Look up the state of a room, creating it on first use */
+Room& get_room(int room) {
+	long long now = now_us();
+	auto it = ROOMS.find(room);
+	if (it != ROOMS.end()) {
+		it->second.last_active = now;
+		grow_room(it->second);
+		return it->second;
+	}
+	Room &r = ROOMS[room];
+	r.order = room_order(room);
+	r.last_active = now;
+	r.fifo_epoch = now;
+	ROOM_WHEEL.schedule(room, now / 1000000 + ROOM_LINGER);
+	grow_room(r);
+	room_changed(room, r);
+	return r;
+}
+
+/* Reclaim a room that has been quiet for long enough, otherwise check it again later */
+void expire_room(int room, long long tick) {
+	auto it = ROOMS.find(room);
+	if (it == ROOMS.end()) {
+		return;
+	}
+	Room &r = it->second;
+	bool idle = r.members == 0 && r.causal_queue.empty()
+			&& r.total_queue.empty() && r.held == 0
+			&& count(r.interested.begin(), r.interested.end(), true) == 0;
+	for (int i = 0; i < r.fifo_queue.size(); i++) {
+		idle = idle && r.fifo_queue[i].empty();
+	}
+	long long due = r.last_active / 1000000 + ROOM_LINGER;
+	if (!idle || due > tick) {
+		ROOM_WHEEL.schedule(room, idle ? due : tick + ROOM_LINGER);
+		return;
+	}
+	ROOMS.erase(it);
+	HISTORY.close(room);
+	SNAP_ROOMS.erase(room);
+	if (SNAP_PATH != NULL) { // write the snapshot again without it
+		SNAP_DIRTY.insert(room);
 	}
+	if (DEBUG) {
+		fprintf(stderr, "%s Room %d reclaimed.\n", debug_str().c_str(), room);
+	}
+}
+
+/* Send a control message to another server */
+void send_control(int i, const string &text) {
+	string msg = CTRL_MARK + text;
+	send_msg(SERVERS[i], msg.c_str(), msg.length());
 }
 
-/* Forward message to servers */
-void forward_server(bool include, char* message) {
+/* Tell the other servers whether we have members in a room, so they only route its
+ * unordered, fifo and causal traffic to us while we do. A server answers an INTEREST
+ * with a SEQ; until it does, the INTEREST is sent again (see retry_interest) */
+void announce_interest(int room, bool on, int to) {
+	string msg = CTRL_MARK + string("INTEREST ") + to_string(room) + (on ? " 1" : " 0");
+	auto it = on ? ROOMS.find(room) : ROOMS.end();
+	if (it != ROOMS.end()) {
+		it->second.interest_sent = now_us();
+		INTEREST_WAITING = true;
+	}
 	for (int i = 0; i < SERVERS.size(); i++) {
-		if (!include && i == SELF_IDX - 1) { // do not multicast to self except total order
-			continue;
-		}
-		sendto(listen_fd, message, strlen(message), 0,
-				(const struct sockaddr*) &SERVERS[i], sizeof(SERVERS[i]));
-		if (DEBUG) {
-			fprintf(stderr, "%s Server %d forward to server %d: \"%s\"\n",
-					debug_str().c_str(), SELF_IDX, i + 1, message);
+		if (ACTIVE[i] && i != SELF_IDX - 1 && (to < 0 || i == to)) {
+			send_msg(SERVERS[i], msg.c_str(), msg.length());
 		}
 	}
 }
 
-/* Handler for a message from client */
-void do_client(int idx, char* buffer) {
-	Client &c = CLIENTS[idx - 1];
-	sockaddr_in addr = c.get_addr();
-	string response = "";
-	char cast_msg[MSG_LEN + 1] = { };
-	if (buffer[0] == '/') { // command from client
-		char* comm = strtok(buffer, " ");
-		if (strcasecmp(comm, "/join") == 0) { // handle join chat room
-			if (c.get_room() != -1) {
-				response += JOINED + to_string(c.get_room());
-			} else {
-				char* room = strtok(NULL, " ");
-				if (room == NULL) {
-					response += "-ERR Invalid chat room number.";
-				} else {
-					int rn = atoi(room);
-					if (rn <= 0) {
-						response += "-ERR Invalid chat room number.";
-					} else if (rn > ROOM_NUM) {
-						response += "-ERR There are only total "
-								+ to_string(ROOM_NUM) + " chat rooms.";
-					} else {
-						c.set_room(rn);
-						response += JOIN_OK + to_string(rn);
-					}
-				}
-			}
-		} else if (strcasecmp(comm, "/part") == 0) { // handle leave chat room
-			if (c.get_room() == -1) {
-				response = UNJOINED;
-			} else {
-				int leave = c.get_room();
-				c.set_room(-1);
-				response += LEFT + to_string(leave);
-			}
-		} else if (strcasecmp(comm, "/nick") == 0) { // handle get nickname
-			char name[64] = { };
-			char* nm = strtok(NULL, " ");
-			if (nm == NULL) {
-				response += "-ERR Invalid nick name.";
-			} else {
-				strcpy(name, nm);
-				while ((nm = strtok(NULL, " ")) != NULL) {
-					strcat(name, " ");
-					strcat(name, nm);
-				}
-				c.set_nick_name(string(name));
-				response += SET_NAME + string(name) + "\'";
-			}
-		} else if (strcasecmp(comm, "/quit") == 0) { // handle quit
-			CLIENTS.erase(CLIENTS.begin() + idx - 1);
-			if (DEBUG) {
-				fprintf(stderr, "%s Client %d quit.\n", debug_str().c_str(),
-						idx);
-			}
-			return;
-		} else {
-			response = UNKNOWN;
+/* Index of the coordinator of the current view, the lowest active server apart from one
+ * that is leaving */
+int coordinator(int leaving) {
+	for (int i = 0; i < ACTIVE.size(); i++) {
+		if (ACTIVE[i] && i + 1 != leaving) {
+			return i + 1;
 		}
+	}
+	return 0;
+}
 
-		const char* res = response.c_str();
-		sendto(listen_fd, res, strlen(res), 0, (const struct sockaddr*) &addr,
-				sizeof(addr));
-		if (DEBUG) {
-			fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
-					debug_str().c_str(), SELF_IDX, idx, res);
+/* Switch a room to an order decided by the coordinator, unless a later decision is known
+ * already. Messages held back by the engine it leaves are still delivered by it, as
+ * each multicast tells the order it was posted in */
+void set_room_order(int room, int order, int version) {
+	auto it = ROOM_ORDERS.find(room);
+	if (it != ROOM_ORDERS.end() && version <= it->second.version) {
+		return;
+	}
+	int was = room_order(room);
+	TOTAL_ROOMS += (order == TOTAL) - (it != ROOM_ORDERS.end() && was == TOTAL);
+	ROOM_ORDERS[room] = { order, version };
+	VIEW_DIRTY = true;
+	auto r = ROOMS.find(room);
+	if (r != ROOMS.end()) {
+		r->second.order = order;
+		if (r->second.members > 0 && (was == TOTAL) != (order == TOTAL)) {
+			announce_interest(room, order != TOTAL, -1); // total order reaches everyone
 		}
-	} else { // chat content from client
-		if (c.get_room() == -1) {
-			response = UNJOINED;
-			const char* res = response.c_str();
-			sendto(listen_fd, res, strlen(res), 0,
-					(const struct sockaddr*) &addr, sizeof(addr));
-			if (DEBUG) {
-				fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
-						debug_str().c_str(), SELF_IDX, idx, res);
-			}
-		} else {
-			string content = "";
-			string type = "";
-			bool include = false;
-			if (c.get_nick_name() == "") { // make showing name
-				char ip_name[256] = { };
-				sprintf(ip_name, "%s:%d", inet_ntoa(addr.sin_addr),
-						ntohs(addr.sin_port));
-				content += "<" + string(ip_name) + "> " + string(buffer);
-			} else {
-				content += "<" + c.get_nick_name() + "> " + string(buffer);
-			}
-			const char* text = content.c_str();
-			if (ORDER == UNORDERED || ORDER == FIFO) { // prepare for multicast to clients
-				forward_client(c.get_room(), text); // a server's own messages can be directly delivered except totally ordered
-				int msg_id = ++FIFO_ID[c.get_room() - 1];
-				sprintf(cast_msg, "%d,%s,%d,%d,%d,%s", msg_id, "n/a", NEW_MSG,
-						0, c.get_room(), text);
-				type = ORDER == UNORDERED ? "Unordered" : "Fifo";
-			} else if (ORDER == CAUSAL) {
-				forward_client(c.get_room(), text);
-				CLOCK[SELF_IDX - 1]++;
-				string vc = to_string(CLOCK[0]);
-				for (int i = 1; i < CLOCK.size(); i++) {
-					vc += "$" + to_string(CLOCK[i]);
-				}
-				const char* vec = vc.c_str();
-				sprintf(cast_msg, "%d,%s,%d,%d,%d,%s", 0, vec, NEW_MSG, 0,
-						c.get_room(), text);
-				type = "Causal";
-			} else if (ORDER == TOTAL) {
-				include = true;
-				sprintf(cast_msg, "%d,%s,%d,%d,%d,%s", 0, "n/a", NEW_MSG, 0,
-						c.get_room(), text);
-				type = "Total";
-			}
+	}
+	if (DEBUG) {
+		fprintf(stderr, "%s Server %d has room %d in %s order\n", debug_str().c_str(),
+				SELF_IDX, room, ORDER_NAMES[order]);
+	}
+}
 
-			forward_server(include, cast_msg); // multicast message to other servers
-			if (DEBUG) {
-				fprintf(stderr,
-						"%s Server %d starts multicast with order: %s\n",
-						debug_str().c_str(), SELF_IDX, type.c_str());
-			}
+/* Tell a server, or all members of the view if -1, the order the coordinator set for a
+ * room; it is sent again until they acknowledge it */
+void send_order(int room, int to) {
+	const RoomOrder &o = ROOM_ORDERS[room];
+	string msg = "ORDER " + to_string(room) + " " + ORDER_NAMES[o.order] + " "
+			+ to_string(o.version);
+	vector<bool> &unacked = ORDER_UNACKED[room];
+	unacked.resize(SERVERS.size(), false);
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i] && i != SELF_IDX - 1 && (to < 0 || i == to)) {
+			unacked[i] = true;
+			send_control(i, msg);
 		}
 	}
 }
 
-/* Handler for unordered multicast */
-void do_unordered(int room, char* message) {
-	forward_client(room, message);
-}
-
-/* Handler for fifo multicast */
-void do_fifo(int idx, int msg_id, int room, char* message) {
-	int sender = idx - 1;
-	int group = room - 1;
-	FIFO_QUEUE[group][sender][msg_id] = string(message);
-	int next = RECEIVED[group][sender] + 1;
-	while (FIFO_QUEUE[group][sender].find(next)
-			!= FIFO_QUEUE[group][sender].end()) {
-		const char* res = FIFO_QUEUE[group][sender][next].c_str();
-		forward_client(room, res);
-		FIFO_QUEUE[group][sender].erase(next);
-		next = (++RECEIVED[group][sender]) + 1;
-	}
-}
-
-/* Handler for causal ordering multicast */
-void do_causal(int idx, char* vec_cl, int room, char* message) {
-	int group = room - 1;
-	Message m(idx, vec_cl, message);
-	CAUSAL_QUEUE[group].push_back(m);
-	while (true) {
-		bool progress = false;
-		for (int i = 0; i < CAUSAL_QUEUE[group].size(); i++) {
-			Message cur = CAUSAL_QUEUE[group][i];
-			int sender = cur.get_sender() - 1;
-			bool all = true;
-			for (int j = 0; j < CLOCK.size(); j++) {
-				if (j == sender) {
-					continue;
-				}
-				if (cur.get_clock()[j] > CLOCK[j]) {
-					all = false;
-				}
-			}
-			if (cur.get_clock()[sender] == CLOCK[sender] + 1 && all) {
-				char* res = cur.get_msg();
-				forward_client(room, res);
-				CLOCK[sender]++;
-				CAUSAL_QUEUE[group].erase(CAUSAL_QUEUE[group].begin() + i);
-				i--;
-				progress = true;
-			}
-		}
-		if (!progress) {
-			break;
+/* Tell a server, or all members of the view if -1, the orders the coordinator set */
+void send_orders(int to) {
+	for (auto &e : ROOM_ORDERS) {
+		if (e.second.version != 0) { // else as configured everywhere
+			send_order(e.first, to);
 		}
 	}
 }
 
-/* Handler for totally ordered multicast */
-void do_total(int idx, int msg_id, int ord, int proby,
-		unordered_map<string, vector<Message>> &proposals, int room,
-		char* message) {
-	int group = room - 1;
-	int seq = idx - 1;
-	char msg[MSG_LEN + 1] = { };
-	string s = string(message);
-	if (ord == NEW_MSG) { // get new message, respond with proposed number
-		PROPOSED[group] = max(PROPOSED[group], AGREED[group]) + 1;
-		Message m(PROPOSED[group], 0);
-		TOTAL_QUEUE[group][m] = s;
-		sprintf(msg, "%d,%s,%d,%d,%d,%s", PROPOSED[group], "n/a", PROPOSAL,
-				SELF_IDX, room, message);
-		sendto(listen_fd, msg, strlen(msg), 0,
-				(const struct sockaddr*) &SERVERS[seq], sizeof(SERVERS[seq]));
-	} else if (ord == PROPOSAL) { // invoker pick the highest proposed number with sender as tie breaker
-		if (proposals.find(s) == proposals.end()) {
-			vector<Message> new_p;
-			proposals[s] = new_p;
-		}
-		Message m(msg_id, proby);
-		proposals[s].push_back(m);
-		if (proposals[s].size() == SERVERS.size()) {
-			int max_id = 0;
-			int max_proby = 0;
-			for (int i = 0; i < proposals[s].size(); i++) {
-				if (proposals[s][i].get_id() > max_id
-						|| (proposals[s][i].get_id() == max_id
-								&& proposals[s][i].get_sender() < max_proby)) {
-					max_id = proposals[s][i].get_id();
-					max_proby = proposals[s][i].get_sender();
-				}
+/* Send the orders that got lost again, to the members that have not acknowledged them */
+void resend_orders() {
+	for (auto it = ORDER_UNACKED.begin(); it != ORDER_UNACKED.end();) {
+		const RoomOrder &o = ROOM_ORDERS[it->first];
+		string msg = "ORDER " + to_string(it->first) + " " + ORDER_NAMES[o.order] + " "
+				+ to_string(o.version);
+		bool waiting = false;
+		for (int i = 0; i < it->second.size(); i++) {
+			if (it->second[i] && i < ACTIVE.size() && ACTIVE[i]) {
+				waiting = true;
+				send_control(i, msg);
 			}
-			sprintf(msg, "%d,%s,%d,%d,%d,%s", max_id, "n/a", AGREEMENT,
-					max_proby, room, message);
-			forward_server(true, msg);
-			proposals.erase(s);
-		}
-	} else if (ord == AGREEMENT) { // set agreed number as sequence number, update proposing number and deliver the message by sequence number
-		Message m(msg_id, proby);
-		m.set_deliverable();
-		for (auto it : TOTAL_QUEUE[group]) {
-			if (it.second.compare(s) == 0) {
-				TOTAL_QUEUE[group].erase(it.first);
-				TOTAL_QUEUE[group][m] = s;
-			}
-		}
-		AGREED[group] = max(AGREED[group], msg_id);
-		while (TOTAL_QUEUE[group].begin()->first.is_deliverable()) {
-			strcpy(msg, TOTAL_QUEUE[group].begin()->second.c_str());
-			forward_client(room, msg);
-			TOTAL_QUEUE[group].erase(TOTAL_QUEUE[group].begin());
 		}
+		it = waiting ? next(it) : ORDER_UNACKED.erase(it);
 	}
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		fprintf(stderr, "*** Author: Gongyao Chen (gongyaoc)\n");
-		exit(1);
+/* Change the order of a room: the coordinator decides and tells the others, anyone else
+ * asks the coordinator to */
+void change_order(int room, int order) {
+	int coord = coordinator(0);
+	if (coord == 0 || coord == SELF_IDX) {
+		auto it = ROOM_ORDERS.find(room);
+		set_room_order(room, order, it == ROOM_ORDERS.end() ? 1 : it->second.version + 1);
+		send_order(room, -1);
+	} else {
+		send_control(coord - 1, "ORDER " + to_string(room) + " " + ORDER_NAMES[order]);
 	}
+}
 
-	/* Your code here */
+/* Forget the held-back fifo messages of a sender */
+void fifo_clear(Room &r, int sender) {
+	for (auto &e : r.fifo_queue[sender]) {
+		HOLD.add(r.held, -hold_size(e.second.size()));
+	}
+	r.fifo_queue[sender].clear();
+}
 
-	/* Handling shutdown signal */
-	signal(SIGINT, sig_handler);
+/* Forget the held-back causal messages of a sender, or of everyone for -1 */
+void causal_clear(Room &r, int sender) {
+	vector<Message> &queue = r.causal_queue;
+	for (int i = 0; i < queue.size(); i++) {
+		if (sender == -1 || queue[i].get_sender() == sender + 1) {
+			HOLD.add(r.held, -hold_size(strlen(queue[i].get_msg())));
+			queue.erase(queue.begin() + i);
+			i--;
+		}
+	}
+}
 
-	/* Parsing command line arguments */
-	int ch = 0;
-	ORDER = UNORDERED;
-	while ((ch = getopt(argc, argv, "o:v")) != -1) {
+/* Forget what we learnt from other senders in a room we lost interest in; when we are
+ * interested again they tell us where to start anew */
+void reset_room(Room &r) {
+	for (int i = 0; i < r.received.size(); i++) {
+		if (i != SELF_IDX - 1) {
+			r.epoch[i] = 0;
+			r.received[i] = 0;
+			fifo_clear(r, i);
+			r.baseline[i] = false;
+			r.clock[i] = 0;
+		}
+	}
+	causal_clear(r, -1);
+}
+
+/* Move a client into a chat room */
+void join_room(Client &c, int room) {
+	CLIENTS_DIRTY = true;
+	c.set_room(room);
+	Room &r = get_room(room);
+	room_changed(room, r);
+	if (r.members++ == 0 && r.order != TOTAL) {
+		announce_interest(room, true, -1);
+	}
+}
+
+/* Take a client out of its chat room */
+void leave_room(Client &c) {
+	CLIENTS_DIRTY = true;
+	if (c.get_room() != -1) {
+		Room &r = get_room(c.get_room());
+		room_changed(c.get_room(), r);
+		if (--r.members == 0 && r.order != TOTAL) {
+			reset_room(r);
+			announce_interest(c.get_room(), false, -1);
+		}
+		c.set_room(-1);
+	}
+}
+
+/* Set the nick name of a client to the words of a /nick command, joined by single
+ * spaces; returns the response */
+const char* set_nick(Client &c, string_view rest) {
+	char name[NICK_LEN + 1];
+	size_t len = 0;
+	for (string_view w = next_word(rest); !w.empty(); w = next_word(rest)) {
+		if (len + (len > 0) + w.size() > NICK_LEN) {
+			return "-ERR Nick name too long.";
+		}
+		if (len > 0) {
+			name[len++] = ' ';
+		}
+		memcpy(name + len, w.data(), w.size());
+		len += w.size();
+	}
+	if (len == 0) {
+		return "-ERR Invalid nick name.";
+	}
+	c.set_nick_name(string(name, len));
+	CLIENTS_DIRTY = true;
+	return format_reply("%s%.*s\'", SET_NAME, (int) len, name);
+}
+
+/* Handler for a new client */
+void do_new_client(ClientId idx, char* buffer) {
+	Client &c = *CLIENTS.get(idx);
+	string_view rest(buffer);
+	string_view tk = next_word(rest);
+	const char* response = UNJOINED; // should first join a chat room
+	if (is_word(tk, "/keepalive")) { // only refreshes the idle timer
+		return;
+	} else if (is_word(tk, "/mcast")) { // receive rooms over multicast
+		if (MCAST_GROUP.sin_port == 0) {
+			response = "-ERR Multicast delivery is not enabled on this server.";
+		} else {
+			c.set_mcast(true);
+			CLIENTS_DIRTY = true;
+			response = "+OK Multicast delivery on";
+		}
+	} else if (is_word(tk, "/nick")) { // set nick name
+		response = set_nick(c, rest);
+	} else if (is_word(tk, "/join")) { // join a chat room
+		tk = next_word(rest);
+		int rn = tk.empty() ? 0 : atoi(tk.data());
+		if (rn <= 0) {
+			response = "-ERR Invalid chat room number.";
+		} else if (rn > ROOM_NUM) {
+			response = format_reply("-ERR There are only total %d chat rooms.", ROOM_NUM);
+		} else {
+			join_room(c, rn);
+			response = format_reply("%s%d", JOIN_OK, rn);
+		}
+	}
+
+	send_client(c, response, strlen(response));
+	if (DEBUG) {
+		fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
+				debug_str().c_str(), SELF_IDX, client_no(idx), response);
+	}
+}
+
+/* Send a message of a room once to its multicast group, keeping it for repairs */
+void forward_group(int room, const char* text) {
+	Room &r = get_room(room);
+	char head[32];
+	snprintf(head, sizeof(head), "%c%d:%u:", MCAST_MARK, room, ++r.mcast_seq);
+	string &frame = r.mcast_sent.push_back();
+	frame.assign(head).append(text);
+	if (!send_fragmented(client_fd, frame.data(), frame.size(),
+			mcast_group(MCAST_GROUP, SELF_IDX, room), FRAG_ID, MSG_DONTWAIT)) {
+		MCAST_LOST++; // the members notice the gap and ask for it
+	}
+	if (r.mcast_sent.size() > MCAST_BACKLOG) {
+		r.mcast_sent.pop_front();
+	}
+	if (DEBUG) {
+		fprintf(stderr, "%s Server %d send to group of room %d: \"%s\"\n",
+				debug_str().c_str(), SELF_IDX, room, text);
+	}
+}
+
+/* Tell a multicast client which group its room is on and where the sequence starts */
+void mcast_subscribe(Client &c) {
+	Room &r = get_room(c.get_room());
+	sockaddr_in group = mcast_group(MCAST_GROUP, SELF_IDX, c.get_room());
+	string msg = MCAST_MARK + string("J ") + to_string(c.get_room()) + " "
+			+ inet_ntoa(group.sin_addr) + ":" + to_string(ntohs(group.sin_port)) + " "
+			+ to_string(r.mcast_seq + 1) + " "
+			+ to_string(mcast_cookie(c.get_addr(), MCAST_SECRET));
+	send_client(c, msg.data(), msg.size());
+}
+
+/* Resend the messages first .. last of a room's group to a client that missed them, as
+ * many as fit in one message; the client asks again for the rest */
+void mcast_repair(Client &c, unsigned int first, unsigned int last) {
+	Room &r = get_room(c.get_room());
+	unsigned int oldest = r.mcast_seq - r.mcast_sent.size() + 1;
+	if ((int) (first - oldest) < 0) { // gone, let the client move on
+		string gone = MCAST_MARK + string("G ") + to_string(c.get_room()) + " "
+				+ to_string(oldest);
+		send_client(c, gone.data(), gone.size());
+		first = oldest;
+	}
+	if ((int) (last - r.mcast_seq) > 0) {
+		last = r.mcast_seq;
+	}
+	size_t bytes = 0;
+	for (unsigned int seq = first; (int) (last - seq) >= 0; seq++) {
+		const string &frame = r.mcast_sent[seq - oldest];
+		bytes += frame.size();
+		if (bytes > MAX_MESSAGE_LEN && seq != first) {
+			break;
+		}
+		send_client(c, frame.data(), frame.size());
+	}
+}
+
+/* Forward message to clients, to those that asked for multicast through the group */
+void forward_client(int room, const char* text) {
+	ProfSample ps;
+	PROF.start(ps);
+	int len = strlen(text);
+	bool group = false;
+	for (Client &c : CLIENTS) {
+		if (c.get_room() == room && c.get_mcast()) {
+			group = true;
+		} else if (c.get_room() == room) {
+			send_client(c, text, len);
+			if (DEBUG) {
+				fprintf(stderr,
+						"%s Server %d send to client %d at room %d: \"%s\"\n",
+						debug_str().c_str(), SELF_IDX, client_no(c.get_id()),
+						c.get_room(), text);
+			}
+		}
+	}
+	if (group) {
+		forward_group(room, text);
+	}
+	PROF.stop(PROF_FANOUT, ps);
+}
+
+/* Deliver a message to the clients in a room and record it in the room's history */
+void deliver(int room, const char* text) {
+	HISTORY.append(room, text, strlen(text));
+	forward_client(room, text);
+}
+
+/* Children of this server in the relay tree of an origin. The active servers in index
+ * order, rotated to start at the origin, form a k-ary tree in which position p relays to
+ * positions p*k+1 .. p*k+k, so every server sends at most FANOUT copies of a message */
+vector<int> relay_children(int origin) {
+	vector<int> members;
+	int o = -1, p = -1;
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i]) {
+			o = i == origin - 1 ? members.size() : o;
+			p = i == SELF_IDX - 1 ? members.size() : p;
+			members.push_back(i);
+		}
+	}
+	vector<int> children;
+	int n = members.size();
+	if (o < 0 || p < 0) { // not both in our view
+		return children;
+	}
+	p = (p - o + n) % n;
+	for (long long c = (long long) p * FANOUT + 1; c <= (long long) p * FANOUT + FANOUT
+			&& c < n; c++) {
+		children.push_back(members[(o + c) % n]);
+	}
+	return children;
+}
+
+/* Pass a multicast of an origin on to our children in its relay tree, in an envelope
+ * "\x05origin:message" so they know whose tree it travels */
+void relay(int origin, const char* envelope, int len) {
+	for (int i : relay_children(origin)) {
+		send_server(i, envelope, len);
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d relays for server %d to server %d\n",
+					debug_str().c_str(), SELF_IDX, origin, i + 1);
+		}
+	}
+}
+
+/* Forward message to servers, of a room only to those with members in it except in
+ * total order, where every server takes part in the agreement */
+void forward_server(bool include, int room, char* message) {
+	if (FANOUT > 0) { // along our relay tree, and to ourselves in total order
+		if (include) {
+			send_server(SELF_IDX - 1, message, strlen(message));
+		}
+		char envelope[FRAME_LEN + 16];
+		int n = snprintf(envelope, sizeof(envelope), "%c%d:%s", RELAY_MARK, SELF_IDX, message);
+		relay(SELF_IDX, envelope, min(n, (int) sizeof(envelope) - 1));
+		return;
+	}
+	Room* r = include ? NULL : &get_room(room); // total order involves everyone
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (!ACTIVE[i] || (!include && i == SELF_IDX - 1)) { // do not multicast to self except total order
+			continue;
+		}
+		if (r != NULL && !r->interested[i]) {
+			continue;
+		}
+		send_server(i, message, strlen(message));
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d forward to server %d: \"%s\"\n",
+					debug_str().c_str(), SELF_IDX, i + 1, message);
+		}
+	}
+}
+
+/* Keep one of our multicasts for servers that become interested in its room shortly
+ * after, so a message and a join racing each other do not lose the message */
+void remember(Room &r, int seq, const char* frame) {
+	long long now = now_us();
+	while (!r.recent.empty() && r.recent.front().sent < now - INTEREST_BACKLOG) {
+		r.recent.pop_front();
+	}
+	Recent &m = r.recent.push_back();
+	m.sent = now;
+	m.seq = seq;
+	m.frame.assign(frame);
+}
+
+/* Number a message in unordered or fifo order, deliver it here and build its frame */
+void plain_post(int order, int room, Room &r, const char* text, char* frame) {
+	deliver(room, text); // a server's own messages can be directly delivered except totally ordered
+	if (r.last_active - r.fifo_last_sent
+			> 2LL * ROOM_LINGER * 1000000) { // peers may have reclaimed the room meanwhile
+		r.fifo_base = r.fifo_id + 1;
+	}
+	r.fifo_last_sent = r.last_active;
+	int msg_id = ++r.fifo_id;
+	char epoch[64] = { };
+	sprintf(epoch, "%lld:%d", r.fifo_epoch, r.fifo_base);
+	encode_frame(frame, msg_id, epoch, PLAIN_MSG + order, 0, room, text);
+	remember(r, msg_id, frame);
+}
+bool UnorderedEngine::post(int room, Room &r, const char* text, char* frame) {
+	plain_post(UNORDERED, room, r, text, frame);
+	return true;
+}
+bool FifoEngine::post(int room, Room &r, const char* text, char* frame) {
+	plain_post(FIFO, room, r, text, frame);
+	return true;
+}
+bool CausalEngine::post(int room, Room &r, const char* text, char* frame) {
+	deliver(room, text);
+	r.clock[SELF_IDX - 1]++;
+	int n = snprintf(frame, FRAME_LEN + 1, "%d,%d", 0, r.clock[0]);
+	for (int i = 1; i < r.clock.size() && n < FRAME_LEN; i++) {
+		n += snprintf(frame + n, FRAME_LEN + 1 - n, "$%d", r.clock[i]);
+	}
+	if (n < FRAME_LEN) {
+		snprintf(frame + n, FRAME_LEN + 1 - n, ",%d,%d,%d,%s", PLAIN_MSG + CAUSAL, 0, room,
+				text);
+	}
+	remember(r, r.clock[SELF_IDX - 1], frame);
+	return true;
+}
+bool TotalEngine::post(int room, Room &r, const char* text, char* frame,
+		Proposals &proposals) {
+	char key[64] = { };
+	sprintf(key, "%d:%lld:%u", SELF_IDX, TOTAL_EPOCH, TOTAL_SEQ + 1);
+	encode_frame(frame, 0, key, NEW_MSG, 0, room, text);
+	if (!HOLD.fits(r.held, hold_size(strlen(frame))
+			+ hold_size(strlen(text)))) { // held here twice until it is agreed on
+		return false;
+	}
+	TOTAL_SEQ++;
+	Pending &p = proposals[key]; // kept until it is agreed on
+	p.room = room;
+	p.frame = frame;
+	p.sent = now_us();
+	HOLD.add(r.held, hold_size(p.frame.size()));
+	return true;
+}
+
+/* Post a client's message through an engine and multicast it to the other servers */
+template<typename E> void post_as(Client &c, Room &r, const char* text, Proposals &proposals) {
+	char frame[FRAME_LEN + 1] = { };
+	ProfSample ps;
+	PROF.start(ps);
+	bool posted;
+	if constexpr (E::ID == TOTAL) {
+		posted = E::post(c.get_room(), r, text, frame, proposals);
+	} else {
+		posted = E::post(c.get_room(), r, text, frame);
+	}
+	PROF.stop(PROF_ENGINE + E::ID, ps);
+	room_changed(c.get_room(), r);
+	if (!posted) {
+		HOLD_SHEDS++;
+		send_client(c, BUSY, strlen(BUSY));
+		return;
+	}
+	forward_server(!E::LOCAL, c.get_room(), frame);
+	if (DEBUG) {
+		fprintf(stderr,
+				"%s Server %d starts multicast with order: %s\n",
+				debug_str().c_str(), SELF_IDX, ORDER_NAMES[E::ID]);
+	}
+}
+typedef void (*PostPath)(Client &, Room &, const char*, Proposals &);
+const PostPath POST_PATHS[] = { post_as<UnorderedEngine>, post_as<FifoEngine>,
+		post_as<CausalEngine>, post_as<TotalEngine> };
+
+/* Post a chat line of a client to its room, in the order of the room */
+void post_message(Client &c, const char* line, Proposals &proposals) {
+	char text[NICK_LEN + 4 + MSG_LEN + 1];
+	const string &prefix = c.get_prefix();
+	size_t len = min(strlen(line), (size_t) MSG_LEN);
+	memcpy(text, prefix.data(), prefix.size());
+	memcpy(text + prefix.size(), line, len);
+	text[prefix.size() + len] = 0;
+	Room &r = get_room(c.get_room());
+	POST_PATHS[r.order](c, r, text, proposals); // by the order of the room
+}
+
+/* Whether the buckets of a client and its room have a token for a post, taking it if so */
+bool admit(Client &c, long long now) {
+	bool ok = CLIENT_RATE.ready(c.get_bucket(), now);
+	TokenBucket* room = NULL;
+	if (ROOM_RATE.enabled()) {
+		room = &get_room(c.get_room()).bucket;
+		ok = ROOM_RATE.ready(*room, now) && ok;
+	}
+	if (ok) {
+		CLIENT_RATE.take(c.get_bucket());
+		if (room != NULL) {
+			ROOM_RATE.take(*room);
+		}
+	}
+	return ok;
+}
+
+/* Apply the rate limits to a chat line before it is ordered; true if it was deferred or
+ * refused rather than posted now. A client with deferred lines queues behind them. */
+bool over_rate(Client &c, const char* line) {
+	if (!CLIENT_RATE.enabled() && !ROOM_RATE.enabled()) {
+		return false;
+	}
+	auto it = SHAPED.empty() ? SHAPED.end() : SHAPED.find(c.get_id());
+	if (it == SHAPED.end() && admit(c, now_us())) {
+		return false;
+	}
+	if (SHAPING && (it == SHAPED.end() || it->second.size() < SHAPE_MAX_LINES)) {
+		SHAPED[c.get_id()].push_back(line);
+		RATE_DEFERRED++;
+		return true;
+	}
+	RATE_REFUSED++;
+	const char* response = "-ERR Posting too fast, message dropped.";
+	send_client(c, response, strlen(response));
+	return true;
+}
+
+/* Under the shed policy, refuse a post while its room is out of hold-back budget */
+bool over_budget(Client &c, const char* line) {
+	if (HOLD_POLICY != HOLD_SHED || !HOLD.enabled()
+			|| HOLD.fits(get_room(c.get_room()).held, hold_size(strlen(line)))) {
+		return false;
+	}
+	HOLD_SHEDS++;
+	send_client(c, BUSY, strlen(BUSY));
+	return true;
+}
+
+/* Post the deferred lines whose turn has come; returns the microseconds until the next
+ * one is due, -1 if none is left */
+long long release_shaped(long long now, Proposals &proposals) {
+	long long next = -1;
+	for (auto it = SHAPED.begin(); it != SHAPED.end();) {
+		Client* c = CLIENTS.get(it->first);
+		deque<string> &q = it->second;
+		while (c != NULL && c->get_room() != -1 && !q.empty() && admit(*c, now)) {
+			if (!over_budget(*c, q.front().c_str())) {
+				post_message(*c, q.front().c_str(), proposals);
+			}
+			q.pop_front();
+		}
+		if (c == NULL || c->get_room() == -1 || q.empty()) { // gone, or nowhere to post
+			it = SHAPED.erase(it);
+			continue;
+		}
+		long long w = CLIENT_RATE.wait(c->get_bucket(), now);
+		if (ROOM_RATE.enabled()) {
+			w = max(w, ROOM_RATE.wait(get_room(c->get_room()).bucket, now));
+		}
+		next = next < 0 || w < next ? w : next;
+		it++;
+	}
+	return next;
+}
+
+/* Outbound queue statistics, overall and for the clients that fell behind */
+string client_stats() {
+	long long queued = 0;
+	long long coalesced = 0;
+	string lines = "";
+	int listed = 0;
+	for (Client &c : CLIENTS) {
+		Outbox &out = c.get_outbox();
+		queued += out.size();
+		coalesced += out.get_coalesced();
+		if ((out.size() > 0 || out.get_dropped() > 0 || out.get_coalesced() > 0)
+				&& listed++ < STATS_MAX_CLIENTS) {
+			sockaddr_in addr = c.get_addr();
+			lines += "\nclient " + to_string(client_no(c.get_id())) + " "
+					+ inet_ntoa(addr.sin_addr) + ":" + to_string(ntohs(addr.sin_port))
+					+ " room " + to_string(c.get_room()) + " queued "
+					+ to_string(out.size()) + " dropped " + to_string(out.get_dropped())
+					+ " coalesced " + to_string(out.get_coalesced());
+		}
+	}
+	return "+OK " + to_string(CLIENTS.size()) + " clients, " + to_string(queued)
+			+ " queued, " + to_string(CLIENT_DROPS) + " dropped, "
+			+ to_string(coalesced) + " coalesced, " + to_string(CLIENT_SHED)
+			+ " disconnected as slow, " + to_string(RATE_DEFERRED) + " posts deferred, "
+			+ to_string(RATE_REFUSED) + " refused, " + to_string(PEER_OVERFLOW)
+			+ (client_fd == listen_fd ? " lost on the socket" : " lost on the peer socket, "
+					+ to_string(CLIENT_OVERFLOW) + " on the client socket")
+			+ (MCAST_GROUP.sin_port == 0 ? "" : ", " + to_string(MCAST_LOST)
+					+ " multicast frames not sent") + lines;
+}
+
+/* Disconnect the clients that fell too far behind under the drop client policy */
+void shed_clients() {
+	for (ClientId id : SLOW) {
+		Client* c = CLIENTS.get(id);
+		if (c == NULL) { // already gone
+			continue;
+		}
+		send_notice(*c, "-ERR Disconnected as too slow a receiver.");
+		leave_room(*c);
+		CLIENTS.remove(id);
+		CLIENTS_DIRTY = true;
+		CLIENT_SHED++;
+		if (DEBUG) {
+			fprintf(stderr, "%s Client %d disconnected as a slow consumer.\n",
+					debug_str().c_str(), client_no(id));
+		}
+	}
+	SLOW.clear();
+}
+
+/* Held-back bytes against the budgets, and what was done to stay within them */
+string memory_stats() {
+	const char* policy[] = { "shed", "drop", "nack" };
+	string lines = "";
+	int listed = 0;
+	int rooms = 0;
+	for (auto &e : ROOMS) {
+		if (e.second.held > 0) {
+			rooms++;
+			if (listed++ < STATS_MAX_ROOMS) {
+				lines += "\nroom " + to_string(e.first) + " held " + to_string(e.second.held);
+			}
+		}
+	}
+	return "+OK " + to_string(HOLD.get_used()) + " bytes held in " + to_string(rooms)
+			+ " rooms, peak " + to_string(HOLD.get_peak()) + ", limit "
+			+ to_string(HOLD.get_room_limit()) + " per room and " + to_string(HOLD.get_limit())
+			+ " in all, policy " + policy[HOLD_POLICY] + ", " + to_string(HOLD_SHEDS)
+			+ " refused, " + to_string(HOLD_DROPS) + " given up, " + to_string(HOLD_NACKS)
+			+ " retransmissions asked" + lines;
+}
+
+/* Frames each ordering engine received and, when profiling, the time it took per post
+ * or frame as its stage of the profile measured it */
+string engine_stats() {
+	string lines = "+OK Frames received per engine";
+	for (int i = UNORDERED; i <= TOTAL; i++) {
+		char line[128];
+		int n = snprintf(line, sizeof(line), "\n%s %lld frames", ORDER_NAMES[i],
+				ENGINE_FRAMES[i]);
+		const ProfStage &p = PROF.stage(PROF_ENGINE + i);
+		if (PROF.enabled() && p.calls > 0) {
+			snprintf(line + n, sizeof(line) - n, ", %.2f us per post or frame",
+					p.ns / 1000.0 / p.calls);
+		}
+		lines += line;
+	}
+	return lines;
+}
+
+/* Whether a client may use /admin: a client on the loopback interface may, any other
+ * one only with the token of -A in front of the command, which is taken off rest */
+bool admin_allowed(Client &c, string_view &rest) {
+	if (ADMIN_TOKEN != NULL) {
+		string_view after = rest;
+		string_view token = next_word(after);
+		if (token.size() == strlen(ADMIN_TOKEN)
+				&& memcmp(token.data(), ADMIN_TOKEN, token.size()) == 0) {
+			rest = after;
+			return true;
+		}
+	}
+	return ntohl(c.get_addr().sin_addr.s_addr) >> 24 == 127;
+}
+
+/* Handler for a message from client */
+void do_client(ClientId idx, char* buffer, Proposals &proposals) {
+	Client &c = *CLIENTS.get(idx);
+	ProfSample ps;
+	PROF.start(ps);
+	bool command = buffer[0] == '/';
+	string_view rest(buffer);
+	string_view comm = command ? next_word(rest) : string_view();
+	bool too_long = !command && strlen(buffer) > MSG_LEN;
+	PROF.stop(PROF_CLIENT_PARSE, ps, false); // the datagram was counted as it was reassembled
+	if (command) { // command from client
+		const char* response = UNKNOWN;
+		string stats; // the longer responses of /admin
+		bool subscribe = false;
+		if (is_word(comm, "/join")) { // handle join chat room
+			string_view room = next_word(rest);
+			int rn = room.empty() ? 0 : atoi(room.data());
+			if (c.get_room() != -1) {
+				response = format_reply("%s%d", JOINED, c.get_room());
+			} else if (rn <= 0) {
+				response = "-ERR Invalid chat room number.";
+			} else if (rn > ROOM_NUM) {
+				response = format_reply("-ERR There are only total %d chat rooms.", ROOM_NUM);
+			} else {
+				join_room(c, rn);
+				response = format_reply("%s%d", JOIN_OK, rn);
+				subscribe = c.get_mcast();
+			}
+		} else if (is_word(comm, "/part")) { // handle leave chat room
+			if (c.get_room() == -1) {
+				response = UNJOINED;
+			} else {
+				int leave = c.get_room();
+				leave_room(c);
+				if (c.get_mcast()) {
+					char unsub[32];
+					int n = snprintf(unsub, sizeof(unsub), "%cP %d", MCAST_MARK, leave);
+					send_client(c, unsub, n);
+				}
+				response = format_reply("%s%d", LEFT, leave);
+			}
+		} else if (is_word(comm, "/nick")) { // handle get nickname
+			response = set_nick(c, rest);
+		} else if (is_word(comm, "/quit")) { // handle quit
+			leave_room(c);
+			CLIENTS.remove(idx);
+			CLIENTS_DIRTY = true;
+			if (DEBUG) {
+				fprintf(stderr, "%s Client %d quit.\n", debug_str().c_str(),
+						client_no(idx));
+			}
+			return;
+		} else if (is_word(comm, "/keepalive")) { // only refreshes the idle timer
+			return;
+		} else if (is_word(comm, "/mcast")) { // receive the room over multicast
+			if (MCAST_GROUP.sin_port == 0) {
+				response = "-ERR Multicast delivery is not enabled on this server.";
+			} else {
+				c.set_mcast(true);
+				CLIENTS_DIRTY = true;
+				response = "+OK Multicast delivery on";
+				subscribe = c.get_room() != -1;
+			}
+		} else if (is_word(comm, "/repair")) { // resend what the group lost
+			string_view rs = next_word(rest);
+			string_view fs = next_word(rest);
+			string_view ls = next_word(rest);
+			string_view cs = next_word(rest); // from the J, so the address is really the client's
+			if (!cs.empty() && c.get_mcast() && atoi(rs.data()) == c.get_room()
+					&& strtoul(cs.data(), NULL, 10) == mcast_cookie(c.get_addr(), MCAST_SECRET)
+					&& CLIENT_RATE.ready(c.get_bucket(), now_us())) {
+				CLIENT_RATE.take(c.get_bucket());
+				mcast_repair(c, strtoul(fs.data(), NULL, 10), strtoul(ls.data(), NULL, 10));
+			}
+			return;
+		} else if (is_word(comm, "/admin")) { // server internals
+			bool allowed = admin_allowed(c, rest);
+			string_view what = next_word(rest);
+			if (!allowed) {
+				response = "-ERR Admin commands are not allowed from this address.";
+			} else if (is_word(what, "stats")) {
+				stats = client_stats();
+				response = stats.c_str();
+			} else if (is_word(what, "memory")) {
+				stats = memory_stats();
+				response = stats.c_str();
+			} else if (is_word(what, "engines")) {
+				stats = engine_stats();
+				response = stats.c_str();
+			} else if (is_word(what, "profile")) {
+				if (!PROF.enabled()) {
+					response = "-ERR Profiling is not enabled on this server.";
+				} else {
+					stats = PROF.report(PROF_STAGES, PROF_FANOUT + 1);
+					if (is_word(next_word(rest), "reset")) {
+						PROF.reset();
+					}
+					response = stats.c_str();
+				}
+			} else if (is_word(what, "order")) {
+				string_view name = next_word(rest);
+				int order = parse_order(name);
+				if (c.get_room() == -1) {
+					response = UNJOINED;
+				} else if (name.empty()) {
+					response = format_reply("+OK Chat room #%d is in %s order", c.get_room(),
+							ORDER_NAMES[get_room(c.get_room()).order]);
+				} else if (order == -1) {
+					response = "-ERR Unknown order, use unordered, fifo, causal or total.";
+				} else {
+					change_order(c.get_room(), order);
+					response = format_reply("+OK Chat room #%d goes to %s order", c.get_room(),
+							ORDER_NAMES[order]);
+				}
+			} else {
+				response = "-ERR Unknown admin command.";
+			}
+		} else if (is_word(comm, "/history")) { // replay the last lines of the room
+			string_view num = next_word(rest);
+			int n = num.empty() ? HISTORY_LINES : atoi(num.data());
+			if (c.get_room() == -1) {
+				response = UNJOINED;
+			} else if (!HISTORY.enabled()) {
+				response = "-ERR No history is kept on this server.";
+			} else if (n <= 0) {
+				response = "-ERR Invalid number of lines.";
+			} else {
+				uint32_t first, end;
+				int sent = HISTORY.last(c.get_room(), min(n, HISTORY_MAX_LINES), first, end);
+				if (sent > 0) {
+					replay_client(c, c.get_room(), first, end);
+				}
+				response = format_reply("+OK Replayed %d lines of chat room #%d", sent,
+						c.get_room());
+			}
+		}
+
+		send_client(c, response, strlen(response));
+		if (subscribe) {
+			mcast_subscribe(c);
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
+					debug_str().c_str(), SELF_IDX, client_no(idx), response);
+		}
+	} else { // chat content from client
+		if (c.get_room() == -1 || too_long) {
+			const char* response = c.get_room() == -1 ? UNJOINED : "-ERR Message too long.";
+			send_client(c, response, strlen(response));
+			if (DEBUG) {
+				fprintf(stderr, "%s Server %d respond to client %d: \"%s\"\n",
+						debug_str().c_str(), SELF_IDX, client_no(idx), response);
+			}
+		} else if (over_rate(c, buffer)) { // deferred or refused by the rate limits
+			return;
+		} else if (over_budget(c, buffer)) {
+			return;
+		} else {
+			post_message(c, buffer, proposals);
+		}
+	}
+}
+
+/* Check whether an idle client is due and evict it, otherwise reschedule it */
+void expire_client(ClientId id, long long tick) {
+	Client* c = CLIENTS.get(id);
+	if (c == NULL) { // already quit
+		return;
+	}
+	long long due = c->get_last_active() / 1000000 + IDLE_TIMEOUT;
+	if (due > tick) {
+		IDLE_WHEEL.schedule(id, due);
+		return;
+	}
+	send_notice(*c, "-ERR Disconnected after " + to_string(IDLE_TIMEOUT)
+			+ " seconds of inactivity.");
+	leave_room(*c);
+	CLIENTS.remove(id);
+	CLIENTS_DIRTY = true;
+	if (DEBUG) {
+		fprintf(stderr, "%s Client %d evicted for inactivity.\n",
+				debug_str().c_str(), client_no(id));
+	}
+}
+
+/* Handler for unordered multicast */
+void UnorderedEngine::receive(Frame &f, Room &) {
+	deliver(f.room, f.text);
+}
+
+/* Deliver the messages of a sender that are next in fifo order */
+void fifo_flush(int room, Room &r, int sender) {
+	unordered_map<int, string> &queue = r.fifo_queue[sender];
+	for (auto it = queue.begin(); it != queue.end();) { // sent before our starting point
+		if (it->first <= r.received[sender]) {
+			HOLD.add(r.held, -hold_size(it->second.size()));
+			it = queue.erase(it);
+		} else {
+			++it;
+		}
+	}
+	int next = r.received[sender] + 1;
+	for (auto it = queue.find(next); it != queue.end(); it = queue.find(next)) {
+		deliver(room, it->second.c_str());
+		HOLD.add(r.held, -hold_size(it->second.size()));
+		queue.erase(it);
+		next = (++r.received[sender]) + 1;
+	}
+}
+
+/* Whether a causal message with clock cl is next from its sender and everything it
+ * depends on was delivered */
+bool causal_ready(const Room &r, int sender, const vector<int> &cl) {
+	bool all = r.baseline[sender];
+	for (int j = 0; j < r.clock.size(); j++) {
+		if (j == sender) {
+			continue;
+		}
+		if (cl[j] > r.clock[j]) {
+			all = false;
+		}
+	}
+	return cl[sender] == r.clock[sender] + 1 && all;
+}
+
+/* Deliver the held-back causal messages of a room that have become deliverable. Clocks
+ * of senders with an older view are shorter than ours, the missing entries count as
+ * zero */
+void causal_flush(int room, Room &r) {
+	vector<Message> &queue = r.causal_queue;
+	while (true) {
+		bool progress = false;
+		for (int i = 0; i < queue.size(); i++) {
+			Message cur = queue[i];
+			int sender = cur.get_sender() - 1;
+			vector<int> cl = cur.get_clock();
+			cl.resize(r.clock.size(), 0);
+			if (cl[sender] <= r.clock[sender] && r.baseline[sender]) { // sent before we became interested
+				HOLD.add(r.held, -hold_size(strlen(cur.get_msg())));
+				queue.erase(queue.begin() + i);
+				i--;
+				continue;
+			}
+			if (causal_ready(r, sender, cl)) {
+				const char* res = cur.get_msg();
+				deliver(room, res);
+				HOLD.add(r.held, -hold_size(strlen(res)));
+				r.clock[sender]++;
+				queue.erase(queue.begin() + i);
+				i--;
+				progress = true;
+			}
+		}
+		if (!progress) {
+			break;
+		}
+	}
+}
+
+/* Deliver the agreed messages at the head of a room's total order hold-back queue */
+void deliver_total(int room, Room &r) {
+	while (!r.total_queue.empty() && r.total_queue.begin()->first.is_deliverable()) {
+		deliver(room, r.total_queue.begin()->second.c_str());
+		HOLD.add(r.held, -hold_size(r.total_queue.begin()->second.size()));
+		r.total_queue.erase(r.total_queue.begin());
+	}
+}
+
+/* Key of the message at the head of a room's total order hold-back queue */
+string total_key(const Room &r) {
+	const Message &head = r.total_queue.begin()->first;
+	for (auto &t : r.total_index) {
+		if (t.second.get_id() == head.get_id()
+				&& t.second.get_sender() == head.get_sender()) {
+			return t.first;
+		}
+	}
+	return "";
+}
+
+/* Give up on the oldest undelivered message of a room to free what is held back for it.
+ * In fifo and causal order we stop waiting for the messages missing in front of the
+ * oldest held one, which is then delivered; in total order the head still waiting for
+ * its agreement is dropped. A room changing its order may hold messages of both. False
+ * if nothing is held */
+bool drop_oldest(int room, Room &r) {
+	if (!r.total_queue.empty()) {
+		string key = total_key(r);
+		r.total_index.erase(key);
+		r.total_asked.erase(key);
+		HOLD.add(r.held, -hold_size(r.total_queue.begin()->second.size()));
+		r.total_queue.erase(r.total_queue.begin());
+		HOLD_DROPS++;
+		deliver_total(room, r);
+		return true;
+	}
+	if (!r.causal_queue.empty()) {
+		Message &m = r.causal_queue.front();
+		int sender = m.get_sender() - 1;
+		vector<int> cl = m.get_clock();
+		cl.resize(r.clock.size(), 0);
+		for (int j = 0; j < r.clock.size(); j++) {
+			int missing = j == sender ? cl[j] - 1 - r.clock[j] : cl[j] - r.clock[j];
+			HOLD_DROPS += max(missing, 0);
+			r.clock[j] = max(r.clock[j], j == sender ? cl[j] - 1 : cl[j]);
+		}
+		r.baseline[sender] = true;
+		causal_flush(room, r);
+		return true;
+	}
+	int sender = -1;
+	for (int i = 0; i < r.fifo_queue.size(); i++) { // the sender we hold the most for
+		if (!r.fifo_queue[i].empty()
+				&& (sender == -1 || r.fifo_queue[i].size() > r.fifo_queue[sender].size())) {
+			sender = i;
+		}
+	}
+	if (sender == -1) {
+		return false;
+	}
+	unordered_map<int, string> &queue = r.fifo_queue[sender];
+	auto first = queue.begin();
+	for (auto it = queue.begin(); it != queue.end(); it++) {
+		first = it->first < first->first ? it : first;
+	}
+	if (!r.baseline[sender]) { // without its starting point only the message itself can go
+		HOLD.add(r.held, -hold_size(first->second.size()));
+		queue.erase(first);
+		HOLD_DROPS++;
+		return true;
+	}
+	HOLD_DROPS += max(first->first - 1 - r.received[sender], 0);
+	r.received[sender] = first->first - 1;
+	fifo_flush(room, r, sender);
+	return true;
+}
+
+/* Free what a room holds back of the senders we refused messages of, in causal order of
+ * every sender, and ask them to send it again from the first message we miss; at most
+ * once per NACK_INTERVAL. They resend what is left of the multicasts they keep for
+ * INTEREST_BACKLOG. False while some are still to be asked */
+bool send_nacks(int room, Room &r, long long now) {
+	if (now - r.nacked < NACK_INTERVAL) {
+		return false;
+	}
+	if (r.order == CAUSAL) {
+		for (Message &m : r.causal_queue) {
+			r.nack_due[m.get_sender() - 1] = true;
+		}
+		causal_clear(r, -1);
+	}
+	for (int i = 0; i < r.nack_due.size(); i++) {
+		if (!r.nack_due[i]) {
+			continue;
+		}
+		r.nack_due[i] = false;
+		if (r.order != CAUSAL) {
+			fifo_clear(r, i);
+		}
+		if (ACTIVE[i]) {
+			int first = (r.order != CAUSAL ? r.received[i] : r.clock[i]) + 1;
+			send_control(i, "NACK " + to_string(room) + " " + to_string(first));
+			HOLD_NACKS++;
+		}
+	}
+	r.nacked = now;
+	room_changed(room, r);
+	return true;
+}
+
+/* Ask for the retransmissions that had to wait for NACK_INTERVAL */
+void retry_nacks(long long now) {
+	for (auto it = NACK_ROOMS.begin(); it != NACK_ROOMS.end();) {
+		auto r = ROOMS.find(*it);
+		if (r == ROOMS.end() || send_nacks(*it, r->second, now)) {
+			it = NACK_ROOMS.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+/* Make room within the budgets for n more bytes held back in a room for a message from
+ * sender; false if the message is to be refused instead. Under the shed policy a fifo or
+ * causal message is held anyway, as its sender would not send it again and what we
+ * hold is bounded by refusing our own clients' posts. Total order refuses under every
+ * policy but drop, as the origin sends a message again until we propose for it */
+bool make_room(int room, Room &r, int order, int sender, long long n) {
+	if (HOLD.fits(r.held, n) || (HOLD_POLICY == HOLD_SHED && order != TOTAL)) {
+		return true;
+	}
+	if (HOLD_POLICY == HOLD_DROP) {
+		while (!HOLD.fits(r.held, n) && drop_oldest(room, r)) {
+		}
+		if (HOLD.fits(r.held, n)) {
+			return true;
+		}
+	} else if (HOLD_POLICY == HOLD_NACK && order != TOTAL && order == r.order) { // the message itself comes again too
+		r.nack_due[sender] = true;
+		if (!send_nacks(room, r, now_us())) {
+			NACK_ROOMS.insert(room);
+		}
+	}
+	HOLD_SHEDS++;
+	return false;
+}
+
+/* Hold back a fifo message until the ones before it are delivered, if it fits */
+void fifo_hold(int room, Room &r, int sender, int msg_id, const char* message) {
+	if (r.fifo_queue[sender].count(msg_id) > 0) { // duplicate
+		return;
+	}
+	long long n = hold_size(strlen(message));
+	bool next = r.baseline[sender] && msg_id == r.received[sender] + 1;
+	if (next || make_room(room, r, FIFO, sender, n)) {
+		r.fifo_queue[sender][msg_id] = string(message);
+		HOLD.add(r.held, n);
+	}
+}
+
+/* Handler for fifo multicast. Until a sender told us where it was when we became
+ * interested in the room, its messages are only held back */
+void FifoEngine::receive(Frame &f, Room &r) {
+	int sender = f.from - 1;
+	int room = f.room;
+	int msg_id = f.id; // as sequence number
+	char* message = f.text;
+	long long epoch = 0;
+	int base = 1;
+	sscanf(f.clock, "%lld:%d", &epoch, &base);
+	if (!r.baseline[sender]) {
+		fifo_hold(room, r, sender, msg_id, message);
+		return;
+	}
+	if (epoch > r.epoch[sender]) { // first message since the sender (re)created the room
+		r.epoch[sender] = epoch;
+		r.received[sender] = base - 1;
+		fifo_clear(r, sender);
+	} else if (epoch < r.epoch[sender] || msg_id <= r.received[sender]) { // stale or duplicate
+		return;
+	}
+	if (msg_id == r.received[sender] + 1 && r.fifo_queue[sender].empty()) { // in order, no need to hold it
+		deliver(room, message);
+		r.received[sender]++;
+		return;
+	}
+	fifo_hold(room, r, sender, msg_id, message);
+	fifo_flush(room, r, sender);
+}
+
+/* Handler for causal ordering multicast, with a causal clock per room */
+void CausalEngine::receive(Frame &f, Room &r) {
+	int room = f.room;
+	char* message = f.text;
+	Message m(f.from, f.clock, message);
+	vector<int> clock = m.get_clock();
+	int from = f.from - 1;
+	if (from >= clock.size()
+			|| (r.baseline[from] && clock[from] <= r.clock[from])) { // duplicate
+		return;
+	}
+	long long n = hold_size(strlen(message));
+	clock.resize(r.clock.size(), 0);
+	if (!causal_ready(r, from, clock) && !make_room(room, r, CAUSAL, from, n)) {
+		return;
+	}
+	r.causal_queue.push_back(m);
+	HOLD.add(r.held, n);
+	causal_flush(room, r);
+}
+
+/* Once every server in the current view proposed a number for one of our messages, the
+ * invoker picks the highest with sender as tie breaker and multicasts the agreement */
+void check_agreement(const string &key, Proposals &proposals) {
+	auto it = proposals.find(key);
+	if (it == proposals.end()) {
+		return;
+	}
+	Pending &p = it->second;
+	vector<bool> voted(SERVERS.size(), false);
+	int votes = 0;
+	int max_id = 0;
+	int max_proby = 0;
+	for (int i = 0; i < p.votes.size(); i++) {
+		int s = p.votes[i].get_sender() - 1;
+		if (s < 0 || s >= SERVERS.size() || !ACTIVE[s] || voted[s]) {
+			continue;
+		}
+		voted[s] = true;
+		votes++;
+		if (p.votes[i].get_id() > max_id
+				|| (p.votes[i].get_id() == max_id
+						&& p.votes[i].get_sender() < max_proby)) {
+			max_id = p.votes[i].get_id();
+			max_proby = p.votes[i].get_sender();
+		}
+	}
+	if (votes < count(ACTIVE.begin(), ACTIVE.end(), true)) {
+		return;
+	}
+	char msg[FRAME_LEN + 1] = { };
+	encode_frame(msg, max_id, key.c_str(), AGREEMENT, max_proby, p.room, "");
+	int room = p.room;
+	auto rt = ROOMS.find(room);
+	if (!p.frame.empty() && rt != ROOMS.end()) {
+		HOLD.add(rt->second.held, -hold_size(p.frame.size()));
+	}
+	proposals.erase(it);
+	AGREED[key] = msg;
+	AGREED_ORDER.push_back(make_pair(now_us(), key));
+	forward_server(true, room, msg);
+}
+
+/* Handler for totally ordered multicast. Only the NEW_MSG phase carries the text, the
+ * proposals and the agreement name the message by the key its origin gave it */
+void TotalEngine::receive(Frame &f, Room &r, Proposals &proposals) {
+	int room = f.room;
+	int msg_id = f.id; // as proposed or agreed number
+	char* key = f.clock; // clock as message key
+	int ord = f.ord;
+	int proby = f.proby;
+	char* message = f.text;
+	int seq = f.from - 1;
+	char msg[FRAME_LEN + 1] = { };
+	string k = string(key);
+	if (ord == NEW_MSG) { // get new message, respond with proposed number
+		auto done = AGREED.find(k);
+		if (done != AGREED.end()) { // sent again, but its agreement overtook it
+			send_server(seq, done->second.c_str(), done->second.size());
+			return;
+		}
+		auto dup = r.total_index.find(k);
+		if (dup != r.total_index.end()) { // sent again, our proposal may have been lost
+			encode_frame(msg, dup->second.get_id(), key, PROPOSAL, SELF_IDX, room, "");
+			send_server(seq, msg, strlen(msg));
+			return;
+		}
+		long long n = hold_size(strlen(message));
+		if (!make_room(room, r, TOTAL, seq, n)) { // the origin sends it again
+			return;
+		}
+		r.proposed = max(r.proposed, r.agreed) + 1;
+		Message m(r.proposed, 0);
+		r.total_queue[m] = string(message);
+		HOLD.add(r.held, n);
+		r.total_index.insert(make_pair(k, m));
+		r.total_asked[k] = now_us();
+		encode_frame(msg, r.proposed, key, PROPOSAL, SELF_IDX, room, "");
+		send_server(seq, msg, strlen(msg));
+	} else if (ord == PROPOSAL) { // collect the proposed numbers for our message
+		auto it = proposals.find(k);
+		if (it == proposals.end()) { // late, already agreed on
+			return;
+		}
+		Pending &p = it->second;
+		p.votes.push_back(Message(msg_id, proby));
+		check_agreement(k, proposals);
+	} else if (ord == AGREEMENT) { // set agreed number as sequence number, update proposing number and deliver the message by sequence number
+		if (seq < 0 || seq >= ACTIVE.size() || !ACTIVE[seq]) { // the members settle the messages of a server that left
+			return;
+		}
+		encode_frame(msg, msg_id, key, AGREEMENT, proby, room, "");
+		if (AGREED.emplace(k, msg).second) { // so we can answer for it if its origin fails
+			AGREED_ORDER.push_back(make_pair(now_us(), k));
+		}
+		auto it = r.total_index.find(k);
+		if (it != r.total_index.end()) {
+			auto q = r.total_queue.find(it->second);
+			Message m(msg_id, proby);
+			m.set_deliverable();
+			r.total_queue[m] = q->second;
+			r.total_queue.erase(q);
+			r.total_index.erase(it);
+			r.total_asked.erase(k);
+		}
+		r.agreed = max(r.agreed, msg_id);
+		deliver_total(room, r);
+	}
+}
+
+/* Hand a frame to the engine of the order it was posted in, timing it when profiling */
+template<typename E> void receive_as(Frame &f, Proposals &proposals) {
+	if (E::LOCAL) { // nobody here to deliver to, as when relayed past us
+		auto it = ROOMS.find(f.room);
+		if (it == ROOMS.end() || it->second.members == 0) {
+			int i = f.from - 1;
+			if (FANOUT == 0 && i < INTEREST_DENIED.size()
+					&& now_us() - INTEREST_DENIED[i] >= INTEREST_RETRY) { // our INTEREST 0 got lost
+				INTEREST_DENIED[i] = now_us();
+				announce_interest(f.room, false, i);
+			}
+			return;
+		}
+	}
+	ProfSample ps;
+	PROF.start(ps);
+	Room &r = get_room(f.room);
+	if constexpr (E::ID == TOTAL) {
+		E::receive(f, r, proposals);
+	} else {
+		E::receive(f, r);
+	}
+	PROF.stop(PROF_ENGINE + E::ID, ps);
+	room_changed(f.room, r);
+	ENGINE_FRAMES[E::ID]++;
+}
+typedef void (*ReceivePath)(Frame &, Proposals &);
+const ReceivePath RECEIVE_PATHS[] = { receive_as<UnorderedEngine>, receive_as<FifoEngine>,
+		receive_as<CausalEngine>, receive_as<TotalEngine> };
+
+/* Announce to another server which optional features we understand */
+void send_hello(int i, const char* verb) {
+	send_control(i, string(verb) + (ZIP ? " zip" : ""));
+}
+
+/* Make room for the per-sender state of servers up to index n */
+void grow_servers(int n) {
+	if (n <= SERVERS.size()) {
+		return;
+	}
+	sockaddr_in none;
+	bzero(&none, sizeof(none));
+	SERVERS.resize(n, none);
+	ACTIVE.resize(n, false);
+	PEER_ZIP.resize(n, false);
+	LAST_HEARD.resize(n, now_us());
+	VIEW_HINT.resize(n, 0);
+	INTEREST_DENIED.resize(n, 0);
+}
+
+/* Members of the current view with their addresses */
+vector<pair<int, sockaddr_in>> view_members() {
+	vector<pair<int, sockaddr_in>> members;
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i]) {
+			members.push_back(make_pair(i + 1, SERVERS[i]));
+		}
+	}
+	return members;
+}
+
+/* Describe the current view as "VIEW id index=ip:port ..." */
+string view_str() {
+	string v = "VIEW " + to_string(VIEW_ID);
+	for (auto &m : view_members()) {
+		v += " " + to_string(m.first) + "=" + inet_ntoa(m.second.sin_addr) + ":"
+				+ to_string(ntohs(m.second.sin_port));
+	}
+	return v;
+}
+
+/* Send a server our view, at most once per a quarter of the failure timeout */
+void tell_view(int idx, long long now) {
+	if (now - VIEW_HINT[idx - 1] < FAILURE_TIMEOUT / 4) {
+		return;
+	}
+	VIEW_HINT[idx - 1] = now;
+	send_control(idx - 1, view_str());
+}
+
+/* Whether a view replaces ours: a later one, or one of the same id that the other side
+ * of a partition issued, if it has more members or else the lowest server ours lacks */
+bool view_above(int v, const vector<pair<int, sockaddr_in>> &members) {
+	if (v != VIEW_ID) {
+		return v > VIEW_ID;
+	}
+	vector<bool> theirs(max((int) ACTIVE.size(), MAX_SERVERS), false);
+	for (auto &m : members) {
+		theirs[m.first - 1] = true;
+	}
+	int ours = count(ACTIVE.begin(), ACTIVE.end(), true);
+	if (members.size() != ours) {
+		return members.size() > ours;
+	}
+	for (int i = 0; i < theirs.size(); i++) {
+		bool mine = i < ACTIVE.size() && ACTIVE[i];
+		if (theirs[i] != mine) {
+			return theirs[i];
+		}
+	}
+	return false;
+}
+
+/* Whether a view keeps a majority of the current one. Only such a view is issued when
+ * servers fail, so the two sides of a partition never both go on */
+bool has_quorum(const vector<pair<int, sockaddr_in>> &members) {
+	int kept = 0;
+	for (auto &m : members) {
+		kept += m.first <= ACTIVE.size() && ACTIVE[m.first - 1];
+	}
+	return 2 * kept > count(ACTIVE.begin(), ACTIVE.end(), true);
+}
+
+/* Ask the members for the agreement of a message whose origin left the view, all but
+ * those that told us already they have none */
+void ask_orphan(int room, const string &key) {
+	Orphan &o = ORPHANS[key];
+	o.room = room;
+	o.none.resize(SERVERS.size(), false);
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i] && i != SELF_IDX - 1 && !o.none[i]) {
+			send_control(i, "ASK " + key);
+		}
+	}
+}
+
+/* Forget the orphans that got their agreement, and drop those every member has none for */
+void settle_orphans() {
+	for (auto it = ORPHANS.begin(); it != ORPHANS.end();) {
+		Orphan &o = it->second;
+		auto rt = ROOMS.find(o.room);
+		if (rt == ROOMS.end() || rt->second.total_index.count(it->first) == 0) {
+			it = ORPHANS.erase(it);
+			continue;
+		}
+		o.none.resize(SERVERS.size(), false);
+		bool answered = true;
+		for (int i = 0; i < SERVERS.size(); i++) {
+			answered = answered && (!ACTIVE[i] || i == SELF_IDX - 1 || o.none[i]);
+		}
+		if (!answered) {
+			it++;
+			continue;
+		}
+		Room &r = rt->second;
+		auto t = r.total_index.find(it->first);
+		auto q = r.total_queue.find(t->second);
+		if (q != r.total_queue.end()) {
+			HOLD.add(r.held, -hold_size(q->second.size()));
+			r.total_queue.erase(q);
+		}
+		r.total_index.erase(t);
+		r.total_asked.erase(it->first);
+		room_changed(o.room, r);
+		deliver_total(o.room, r);
+		it = ORPHANS.erase(it);
+	}
+}
+
+/* Adopt a new view of the cluster. Per-sender state is indexed by the stable server
+ * index, so it only grows, and a server that left keeps its slot for when it returns */
+void install_view(int view_id, vector<pair<int, sockaddr_in>> &members,
+		Proposals &proposals) {
+	for (auto &m : members) {
+		grow_servers(m.first);
+	}
+	vector<bool> was = ACTIVE;
+	ACTIVE.assign(SERVERS.size(), false);
+	for (auto &m : members) {
+		SERVERS[m.first - 1] = m.second;
+		ACTIVE[m.first - 1] = true;
+	}
+	VIEW_ID = view_id;
+	VIEW_DIRTY = true;
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i] && !was[i] && i != SELF_IDX - 1) {
+			send_hello(i, "HELLO");
+		}
+	}
+	for (int i = 0; i < SERVERS.size(); i++) { // a new member gets a full timeout
+		if (ACTIVE[i] && !was[i]) {
+			LAST_HEARD[i] = now_us();
+		}
+	}
+	IN_VIEW = IN_VIEW || ACTIVE[SELF_IDX - 1];
+	for (auto &e : ROOMS) { // messages of servers that left are settled with the members
+		Room &r = e.second;
+		grow_room(r);
+		room_changed(e.first, r);
+		for (int i = 0; i < SERVERS.size(); i++) {
+			if (!ACTIVE[i]) {
+				r.interested[i] = false;
+			} else if (!was[i] && i != SELF_IDX - 1 && r.members > 0 && r.order != TOTAL) {
+				announce_interest(e.first, true, i);
+			}
+		}
+		for (auto &t : r.total_index) {
+			int origin = atoi(t.first.c_str()) - 1;
+			if (origin >= 0 && origin < ACTIVE.size() && !ACTIVE[origin]) {
+				ask_orphan(e.first, t.first);
+			}
+		}
+	}
+	settle_orphans();
+	vector<string> keys;
+	for (auto &e : proposals) {
+		keys.push_back(e.first);
+	}
+	for (string &k : keys) { // the vote we waited for may have been from a server that left
+		check_agreement(k, proposals);
+	}
+	if (DEBUG) {
+		fprintf(stderr, "%s Server %d installed %s\n", debug_str().c_str(), SELF_IDX,
+				view_str().c_str());
+	}
+}
+
+/* As the coordinator, move the cluster to a new view */
+void issue_view(vector<pair<int, sockaddr_in>> &members, Proposals &proposals) {
+	install_view(VIEW_ID + 1, members, proposals);
+	string v = view_str();
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (ACTIVE[i] && i != SELF_IDX - 1) {
+			send_control(i, v);
+		}
+	}
+	send_orders(-1);
+}
+
+/* Give a joining server the proposed and agreed numbers of each room, so its
+ * proposals follow the agreed ones. Senders tell it where they are in fifo and causal
+ * order once it becomes interested in a room */
+void send_state(int i) {
+	string st = "STATE";
+	for (auto &e : ROOMS) {
+		st += " " + to_string(e.first) + ":" + to_string(e.second.proposed) + ":"
+				+ to_string(e.second.agreed);
+	}
+	send_control(i, st);
+}
+
+/* Ask the servers we know of to let us into the cluster */
+void send_join() {
+	sockaddr_in self = SERVERS[SELF_IDX - 1];
+	string join = "JOIN " + to_string(SELF_IDX) + " " + inet_ntoa(self.sin_addr) + ":"
+			+ to_string(ntohs(self.sin_port));
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (i != SELF_IDX - 1 && SERVERS[i].sin_port != 0) {
+			send_control(i, join);
+		}
+	}
+}
+
+/* Handler for control messages between servers. A HELLO tells what the sender
+ * understands and is answered with a WELCOME telling the same about us. JOIN and LEAVE
+ * ask the coordinator for a new VIEW, which it multicasts, and a joining server also
+ * gets our STATE and the ORDER of rooms changed since start. ORDER with a version sets
+ * the order of a room and is acknowledged with ORDERED, without one asks the
+ * coordinator to change it. ASK asks for an
+ * agreement that got lost, the origin of a message or, if it left the view, the other
+ * members, who answer NONE if they have none. NACK asks a sender for its multicasts
+ * from a number on, answered with GONE for those it no longer has, and PING shows that
+ * its sender is alive and which view it is in. A server we have no address of yet comes
+ * as index 0 and may only JOIN, from the address it claims */
+void do_control(int idx, const sockaddr_in &from, char* buffer, Proposals &proposals) {
+	vector<char*> args;
+	for (char* tk = strtok(buffer + 1, " "); tk != NULL; tk = strtok(NULL, " ")) {
+		args.push_back(tk);
+	}
+	if (args.empty() || (idx == 0 && strcmp(args[0], "JOIN") != 0)) {
+		return;
+	}
+	if (strcmp(args[0], "HELLO") == 0 || strcmp(args[0], "WELCOME") == 0) {
+		bool zip = false;
+		for (int i = 1; i < args.size(); i++) {
+			zip = zip || strcmp(args[i], "zip") == 0;
+		}
+		PEER_ZIP[idx - 1] = zip;
+		if (strcmp(args[0], "HELLO") == 0) {
+			send_hello(idx - 1, "WELCOME");
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d %s compressed messages.\n",
+					debug_str().c_str(), idx, zip ? "accepts" : "does not accept");
+		}
+	} else if (strcmp(args[0], "JOIN") == 0 && args.size() == 3) {
+		int j = atoi(args[1]);
+		if (!IN_VIEW || coordinator(0) != SELF_IDX || j <= 0 || j > MAX_SERVERS
+				|| j == SELF_IDX) {
+			return;
+		}
+		sockaddr_in addr = to_sockaddr(args[2]);
+		bool same = j <= SERVERS.size()
+				&& SERVERS[j - 1].sin_addr.s_addr == addr.sin_addr.s_addr
+				&& SERVERS[j - 1].sin_port == addr.sin_port;
+		if (addr.sin_addr.s_addr != from.sin_addr.s_addr || addr.sin_port != from.sin_port
+				|| (idx != 0 && idx != j) || (j <= SERVERS.size() && ACTIVE[j - 1] && !same)) {
+			/* not sent from the address it claims, or would take over a member's slot */
+			if (DEBUG) {
+				fprintf(stderr, "%s Server %d refused a join as server %d from %s:%d\n",
+						debug_str().c_str(), SELF_IDX, j, inet_ntoa(from.sin_addr),
+						ntohs(from.sin_port));
+			}
+			return;
+		}
+		if (!same || !ACTIVE[j - 1]) {
+			vector<pair<int, sockaddr_in>> members;
+			for (auto &m : view_members()) {
+				if (m.first != j) {
+					members.push_back(m);
+				}
+			}
+			members.push_back(make_pair(j, addr));
+			issue_view(members, proposals);
+		} else { // already in, it missed the view
+			send_control(j - 1, view_str());
+		}
+		send_state(j - 1);
+		send_orders(j - 1);
+	} else if (strcmp(args[0], "LEAVE") == 0 && args.size() == 2) {
+		int j = atoi(args[1]);
+		if (j <= 0 || j > SERVERS.size() || !ACTIVE[j - 1] || coordinator(j) != SELF_IDX) {
+			return;
+		}
+		vector<pair<int, sockaddr_in>> members;
+		for (auto &m : view_members()) {
+			if (m.first != j) {
+				members.push_back(m);
+			}
+		}
+		issue_view(members, proposals);
+	} else if (strcmp(args[0], "VIEW") == 0 && args.size() >= 2) {
+		int v = atoi(args[1]);
+		vector<pair<int, sockaddr_in>> members;
+		bool in = false;
+		for (int i = 2; i < args.size(); i++) {
+			char* eq = strchr(args[i], '=');
+			if (eq == NULL) {
+				continue;
+			}
+			*eq = 0;
+			int j = atoi(args[i]);
+			if (j > 0 && j <= MAX_SERVERS) {
+				members.push_back(make_pair(j, to_sockaddr(eq + 1)));
+				in = in || j == SELF_IDX;
+			}
+		}
+		bool above = view_above(v, members);
+		if (!in && IN_VIEW && !LEAVING && above) {
+			/* taken for dead, or cut off in a smaller view: join the others again */
+			install_view(v, members, proposals);
+			IN_VIEW = false;
+			HAVE_STATE = false;
+			if (DEBUG) {
+				fprintf(stderr, "%s Server %d was left out of view %d, joining again\n",
+						debug_str().c_str(), SELF_IDX, v);
+			}
+			return;
+		}
+		if (!above) { // old, already installed, or lost a tie
+			return;
+		}
+		install_view(v, members, proposals);
+	} else if (strcmp(args[0], "STATE") == 0 && !HAVE_STATE) {
+		HAVE_STATE = true;
+		for (int i = 1; i < args.size(); i++) {
+			int room = 0, proposed = 0, agreed = 0;
+			if (sscanf(args[i], "%d:%d:%d", &room, &proposed, &agreed) == 3) {
+				Room &r = get_room(room);
+				r.proposed = max(r.proposed, proposed);
+				r.agreed = max(r.agreed, agreed);
+				room_changed(room, r);
+			}
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d received state from server %d\n",
+					debug_str().c_str(), SELF_IDX, idx);
+		}
+	} else if (strcmp(args[0], "INTEREST") == 0 && args.size() == 3) {
+		int room = atoi(args[1]);
+		if (room <= 0 || room > ROOM_NUM) {
+			return;
+		}
+		Room &r = get_room(room);
+		r.interested[idx - 1] = atoi(args[2]) != 0;
+		room_changed(room, r);
+		if (r.interested[idx - 1]) { // tell it where to start, then resend what came after
+			long long now = now_us();
+			while (!r.recent.empty() && r.recent.front().sent < now - INTEREST_BACKLOG) {
+				r.recent.pop_front();
+			}
+			int fifo_start = r.fifo_id;
+			int causal_start = r.clock[SELF_IDX - 1];
+			if (!r.recent.empty()) {
+				fifo_start = r.order != CAUSAL ? r.recent.front().seq - 1 : fifo_start;
+				causal_start = r.order == CAUSAL ? r.recent.front().seq - 1 : causal_start;
+			}
+			send_control(idx - 1, "SEQ " + to_string(room) + " "
+					+ to_string(r.fifo_epoch) + " " + to_string(fifo_start) + " "
+					+ to_string(causal_start));
+			for (size_t i = 0; i < r.recent.size(); i++) {
+				send_server(idx - 1, r.recent[i].frame.c_str(), r.recent[i].frame.size());
+			}
+		}
+	} else if (strcmp(args[0], "NACK") == 0 && args.size() == 3) { // resend what we still have
+		int room = atoi(args[1]);
+		auto it = ROOMS.find(room);
+		if (it == ROOMS.end()) {
+			return;
+		}
+		Room &r = it->second;
+		int first = atoi(args[2]);
+		long long now = now_us();
+		while (!r.recent.empty() && r.recent.front().sent < now - INTEREST_BACKLOG) {
+			r.recent.pop_front();
+		}
+		int oldest = r.recent.empty() ? (r.order != CAUSAL ? r.fifo_id : r.clock[SELF_IDX - 1]) + 1
+				: r.recent.front().seq;
+		if (first < oldest) { // the rest is gone, do not wait for it
+			send_control(idx - 1, "GONE " + to_string(room) + " " + to_string(oldest - 1));
+		}
+		for (size_t i = 0; i < r.recent.size(); i++) {
+			Recent &m = r.recent[i];
+			if (m.seq >= first) {
+				send_server(idx - 1, m.frame.c_str(), m.frame.size());
+			}
+		}
+	} else if (strcmp(args[0], "GONE") == 0 && args.size() == 3) {
+		int room = atoi(args[1]);
+		auto it = ROOMS.find(room);
+		if (it == ROOMS.end()) {
+			return;
+		}
+		Room &r = it->second;
+		int sender = idx - 1;
+		int last = atoi(args[2]);
+		room_changed(room, r);
+		if (r.order != CAUSAL && r.baseline[sender] && last > r.received[sender]) {
+			HOLD_DROPS += last - r.received[sender];
+			r.received[sender] = last;
+			fifo_flush(room, r, sender);
+		} else if (r.order == CAUSAL && last > r.clock[sender]) {
+			HOLD_DROPS += last - r.clock[sender];
+			r.clock[sender] = last;
+			causal_flush(room, r);
+		}
+	} else if (strcmp(args[0], "ORDER") == 0 && (args.size() == 3 || args.size() == 4)) {
+		int room = atoi(args[1]);
+		int order = parse_order(args[2]);
+		if (room <= 0 || room > ROOM_NUM || order == -1) {
+			return;
+		}
+		if (args.size() == 4) {
+			set_room_order(room, order, atoi(args[3]));
+			send_control(idx - 1, "ORDERED " + to_string(room) + " " + args[3]);
+		} else if (IN_VIEW && coordinator(0) == SELF_IDX) { // asked to change it
+			change_order(room, order);
+		}
+	} else if (strcmp(args[0], "ORDERED") == 0 && args.size() == 3) {
+		auto it = ORDER_UNACKED.find(atoi(args[1]));
+		auto o = ROOM_ORDERS.find(atoi(args[1]));
+		if (it != ORDER_UNACKED.end() && o != ROOM_ORDERS.end()
+				&& o->second.version == atoi(args[2]) && idx - 1 < it->second.size()) {
+			it->second[idx - 1] = false;
+		}
+	} else if (strcmp(args[0], "ASK") == 0 && args.size() == 2) { // an agreement got lost
+		auto it = AGREED.find(args[1]);
+		int origin = atoi(args[1]);
+		if (it != AGREED.end()) {
+			send_server(idx - 1, it->second.c_str(), it->second.size());
+		} else if (origin == SELF_IDX ? proposals.count(args[1]) == 0
+				: origin <= 0 || origin > ACTIVE.size() || !ACTIVE[origin - 1]) {
+			/* none will come: ours is gone, or its origin left our view */
+			send_control(idx - 1, string("NONE ") + args[1]);
+		}
+	} else if (strcmp(args[0], "NONE") == 0 && args.size() == 2) {
+		auto it = ORPHANS.find(args[1]);
+		if (it != ORPHANS.end()) {
+			it->second.none.resize(SERVERS.size(), false);
+			it->second.none[idx - 1] = true;
+			settle_orphans();
+		}
+	} else if (strcmp(args[0], "PING") == 0 && args.size() == 3) {
+		if (IN_VIEW && ACTIVE[idx - 1]
+				&& (atoi(args[1]) != VIEW_ID || atoi(args[2]) != coordinator(0))) {
+			tell_view(idx, now_us()); // a member that installed another view
+		}
+	} else if (strcmp(args[0], "SEQ") == 0 && args.size() == 5) {
+		int room = atoi(args[1]);
+		auto it = ROOMS.find(room);
+		if (it == ROOMS.end() || it->second.members == 0
+				|| it->second.baseline[idx - 1]) { // not interested, or known already
+			return;
+		}
+		Room &r = get_room(room);
+		int sender = idx - 1;
+		r.baseline[sender] = true;
+		r.epoch[sender] = atoll(args[2]);
+		r.received[sender] = atoi(args[3]);
+		r.clock[sender] = max(r.clock[sender], atoi(args[4]));
+		room_changed(room, r);
+		fifo_flush(room, r, sender);
+		causal_flush(room, r);
+	}
+}
+
+/* Serialize the state of a room into its snapshot section */
+void snap_room(int room, const Room &r, string &out) {
+	SnapWriter w(out, SNAP_ROOM, room);
+	w.put_int(r.members);
+	w.put_int(r.fifo_id);
+	w.put_ll(r.fifo_epoch);
+	w.put_int(r.fifo_base);
+	w.put_int(r.proposed);
+	w.put_int(r.agreed);
+	w.put_int(r.received.size());
+	for (int i = 0; i < r.received.size(); i++) {
+		w.put_ll(r.epoch[i]);
+		w.put_int(r.received[i]);
+		w.put_int(r.interested[i]);
+		w.put_int(r.baseline[i]);
+		w.put_int(r.clock[i]);
+		w.put_int(r.fifo_queue[i].size());
+		for (auto &e : r.fifo_queue[i]) {
+			w.put_int(e.first);
+			w.put_str(e.second);
+		}
+	}
+	w.put_int(r.causal_queue.size());
+	for (Message m : r.causal_queue) {
+		w.put_int(m.get_sender());
+		vector<int> clock = m.get_clock();
+		w.put_int(clock.size());
+		for (int c : clock) {
+			w.put_int(c);
+		}
+		w.put_str(m.get_msg());
+	}
+	w.put_int(r.total_queue.size());
+	for (auto &e : r.total_queue) {
+		w.put_int(e.first.get_id());
+		w.put_int(e.first.get_sender());
+		w.put_int(e.first.is_deliverable());
+		w.put_str(e.second);
+	}
+	w.put_int(r.total_index.size());
+	for (auto &e : r.total_index) {
+		w.put_str(e.first);
+		w.put_int(e.second.get_id());
+		w.put_int(e.second.get_sender());
+	}
+	w.finish();
+}
+
+/* Restore a room from its snapshot section */
+bool load_room(int room, SnapReader &in, long long now) {
+	Room &r = ROOMS[room];
+	r.order = room_order(room);
+	r.last_active = now;
+	r.members = in.get_int();
+	r.fifo_id = in.get_int();
+	r.fifo_epoch = in.get_ll();
+	r.fifo_base = in.get_int();
+	r.proposed = in.get_int();
+	r.agreed = in.get_int();
+	int senders = in.get_int();
+	for (int i = 0; in.ok && i < senders; i++) {
+		r.epoch.push_back(in.get_ll());
+		r.received.push_back(in.get_int());
+		r.interested.push_back(in.get_int());
+		r.baseline.push_back(in.get_int());
+		r.clock.push_back(in.get_int());
+		r.fifo_queue.push_back(unordered_map<int, string>());
+		int n = in.get_int();
+		for (int j = 0; in.ok && j < n; j++) {
+			int id = in.get_int();
+			r.fifo_queue[i][id] = in.get_str();
+		}
+	}
+	int n = in.get_int();
+	for (int i = 0; in.ok && i < n; i++) {
+		int sender = in.get_int();
+		vector<int> clock(max(in.get_int(), 0));
+		for (int j = 0; in.ok && j < clock.size(); j++) {
+			clock[j] = in.get_int();
+		}
+		r.causal_queue.push_back(Message(0, sender, true, clock, in.get_str()));
+	}
+	n = in.get_int();
+	for (int i = 0; in.ok && i < n; i++) {
+		int id = in.get_int();
+		int sender = in.get_int();
+		bool deliverable = in.get_int();
+		r.total_queue[Message(id, sender, deliverable, vector<int>(), "")] = in.get_str();
+	}
+	n = in.get_int();
+	for (int i = 0; in.ok && i < n; i++) {
+		string key = in.get_str();
+		int id = in.get_int();
+		r.total_index.insert(make_pair(key, Message(id, in.get_int())));
+	}
+	grow_room(r);
+	ROOM_WHEEL.schedule(room, now / 1000000 + ROOM_LINGER);
+	return in.ok;
+}
+
+/* Hand a snapshot of the server state to the writer, serializing again only what
+ * changed since the last one */
+void save_snapshot(Proposals &proposals) {
+	if (SNAP_PATH == NULL) {
+		return;
+	}
+	long long failed = SNAP_WRITER.get_failed();
+	if (failed > SNAP_FAILED) {
+		fprintf(stderr, "%s Unable to write snapshot %s.\n", debug_str().c_str(),
+				SNAP_PATH);
+		SNAP_FAILED = failed;
+	}
+	if (SNAP_DIRTY.empty() && !CLIENTS_DIRTY && !VIEW_DIRTY) {
+		return;
+	}
+	for (int room : SNAP_DIRTY) {
+		auto it = ROOMS.find(room);
+		if (it != ROOMS.end()) {
+			shared_ptr<string> section = make_shared<string>();
+			snap_room(room, it->second, *section);
+			SNAP_ROOMS[room] = section;
+			it->second.snap_dirty = false;
+		}
+	}
+	SNAP_DIRTY.clear();
+	if (CLIENTS_DIRTY) {
+		shared_ptr<string> clients = make_shared<string>();
+		SnapWriter w(*clients, SNAP_CLIENTS, 0);
+		w.put_int(CLIENTS.size());
+		for (Client &c : CLIENTS) {
+			sockaddr_in addr = c.get_addr();
+			w.put_int(addr.sin_addr.s_addr);
+			w.put_int(addr.sin_port);
+			w.put_str(c.get_nick_name());
+			w.put_int(c.get_room());
+			w.put_int(c.get_mcast());
+		}
+		w.finish();
+		SNAP_CLIENTS_BLOB = clients;
+		CLIENTS_DIRTY = false;
+	}
+	shared_ptr<string> global = make_shared<string>();
+	SnapWriter w(*global, SNAP_GLOBAL, 0);
+	w.put_int(SELF_IDX);
+	w.put_int(VIEW_ID);
+	w.put_int(SERVERS.size());
+	for (int i = 0; i < SERVERS.size(); i++) {
+		w.put_int(ACTIVE[i]);
+		w.put_int(SERVERS[i].sin_addr.s_addr);
+		w.put_int(SERVERS[i].sin_port);
+	}
+	w.put_int(TOTAL_SEQ);
+	w.put_ll(TOTAL_EPOCH);
+	w.put_int(proposals.size());
+	for (auto &e : proposals) {
+		w.put_str(e.first);
+		w.put_int(e.second.room);
+		w.put_int(e.second.votes.size());
+		for (Message &m : e.second.votes) {
+			w.put_int(m.get_id());
+			w.put_int(m.get_sender());
+		}
+		w.put_str(e.second.frame);
+	}
+	w.put_int(ROOM_ORDERS.size());
+	for (auto &e : ROOM_ORDERS) {
+		w.put_int(e.first);
+		w.put_int(e.second.order);
+		w.put_int(e.second.version);
+	}
+	w.finish();
+	VIEW_DIRTY = false;
+	vector<Section> sections;
+	sections.push_back(global);
+	if (SNAP_CLIENTS_BLOB) {
+		sections.push_back(SNAP_CLIENTS_BLOB);
+	}
+	for (auto &e : SNAP_ROOMS) {
+		sections.push_back(e.second);
+	}
+	SNAP_WRITER.submit(sections);
+}
+
+/* Resume from the last snapshot, if there is one. Clients get new ids but keep their
+ * nick names and rooms */
+void load_state(Proposals &proposals) {
+	long long now = now_us();
+	bool found = load_snapshot(SNAP_PATH,
+			[&](uint8_t type, int32_t key, SnapReader &in) {
+				if (type == SNAP_GLOBAL) {
+					if (in.get_int() != SELF_IDX) {
+						return false;
+					}
+					VIEW_ID = in.get_int();
+					int servers = in.get_int();
+					if (servers <= 0 || servers > MAX_SERVERS) {
+						return false;
+					}
+					grow_servers(servers);
+					for (int i = 0; i < servers; i++) {
+						ACTIVE[i] = in.get_int();
+						sockaddr_in addr = SERVERS[i];
+						addr.sin_family = AF_INET;
+						addr.sin_addr.s_addr = in.get_int();
+						addr.sin_port = in.get_int();
+						if (addr.sin_port != 0) {
+							SERVERS[i] = addr;
+						}
+					}
+					TOTAL_SEQ = in.get_int();
+					TOTAL_EPOCH = in.get_ll();
+					int n = in.get_int();
+					for (int i = 0; in.ok && i < n; i++) {
+						Pending &p = proposals[in.get_str()];
+						p.room = in.get_int();
+						int votes = in.get_int();
+						for (int j = 0; in.ok && j < votes; j++) {
+							int id = in.get_int();
+							p.votes.push_back(Message(id, in.get_int()));
+						}
+						p.frame = in.get_str();
+						p.sent = now;
+					}
+					n = in.get_int();
+					for (int i = 0; in.ok && i < n; i++) {
+						int room = in.get_int();
+						int order = in.get_int();
+						int version = in.get_int();
+						if (order >= UNORDERED && order <= TOTAL) {
+							set_room_order(room, order, version);
+						}
+					}
+				} else if (type == SNAP_CLIENTS) {
+					int n = in.get_int();
+					for (int i = 0; in.ok && i < n; i++) {
+						sockaddr_in addr;
+						bzero(&addr, sizeof(addr));
+						addr.sin_family = AF_INET;
+						addr.sin_addr.s_addr = in.get_int();
+						addr.sin_port = in.get_int();
+						Client c(addr);
+						c.set_nick_name(in.get_str());
+						c.set_room(in.get_int());
+						c.set_mcast(in.get_int());
+						c.set_last_active(now);
+						ClientId id = CLIENTS.add(c);
+						if (IDLE_TIMEOUT > 0) {
+							IDLE_WHEEL.schedule(id, now / 1000000 + IDLE_TIMEOUT);
+						}
+					}
+				} else if (type == SNAP_ROOM) {
+					return load_room(key, in, now);
+				}
+				return in.ok;
+			});
+	if (!found) {
+		if (access(SNAP_PATH, F_OK) == 0) {
+			fprintf(stderr, "Snapshot %s is not usable, starting empty.\n", SNAP_PATH);
+		}
+		CLIENTS = ClientTable();
+		ROOMS.clear();
+		proposals.clear();
+		ACTIVE.assign(SERVERS.size(), !JOINING);
+		ACTIVE[SELF_IDX - 1] = true;
+		VIEW_ID = 0;
+		TOTAL_SEQ = 0;
+		TOTAL_EPOCH = net_time();
+		return;
+	}
+	for (auto &e : ROOMS) { // count what the rooms hold back against the budgets
+		Room &r = e.second;
+		room_changed(e.first, r);
+		for (auto &q : r.fifo_queue) {
+			for (auto &m : q) {
+				HOLD.add(r.held, hold_size(m.second.size()));
+			}
+		}
+		for (Message &m : r.causal_queue) {
+			HOLD.add(r.held, hold_size(strlen(m.get_msg())));
+		}
+		for (auto &m : r.total_queue) {
+			HOLD.add(r.held, hold_size(m.second.size()));
+		}
+	}
+	for (auto &e : proposals) {
+		if (!e.second.frame.empty()) {
+			HOLD.add(get_room(e.second.room).held, hold_size(e.second.frame.size()));
+		}
+	}
+	for (Client &c : CLIENTS) { // our group sequences start over
+		if (c.get_mcast() && c.get_room() != -1 && MCAST_GROUP.sin_port != 0) {
+			mcast_subscribe(c);
+		}
+	}
+	CLIENTS_DIRTY = true;
+	if (DEBUG) {
+		printf("Server %d restored %d clients and %d rooms in %lld us\n", SELF_IDX,
+				CLIENTS.size(), (int) ROOMS.size(), now_us() - now);
+	}
+}
+
+/* Heartbeats and failure detection. Every server we know of gets a PING a few times per
+ * FAILURE_TIMEOUT, and any datagram counts as a sign of life. When a member of the view
+ * has been silent for FAILURE_TIMEOUT, the lowest member we do not suspect moves the
+ * cluster to a view without the suspects, if that keeps a majority of the view. That
+ * settles their undelivered messages with the other members and lets the agreements
+ * that waited for their votes complete. A PING carries the view of its sender, so a
+ * member that installed another one is told ours */
+void check_peers(long long now, Proposals &proposals) {
+	if (FAILURE_TIMEOUT == 0 || now - LAST_PING < FAILURE_TIMEOUT / 4) {
+		return;
+	}
+	if (now - LAST_PING > FAILURE_TIMEOUT) { // we were the one stalled, the others were not heard
+		fill(LAST_HEARD.begin(), LAST_HEARD.end(), now);
+	}
+	LAST_PING = now;
+	for (int i = 0; i < SERVERS.size(); i++) {
+		if (i != SELF_IDX - 1 && SERVERS[i].sin_port != 0) {
+			send_control(i, "PING " + to_string(VIEW_ID) + " " + to_string(coordinator(0)));
+		}
+	}
+	if (!IN_VIEW) {
+		return;
+	}
+	resend_orders(); // the ORDERs not acknowledged yet
+	vector<pair<int, sockaddr_in>> members;
+	int coord = 0;
+	for (auto &m : view_members()) {
+		if (m.first == SELF_IDX || now - LAST_HEARD[m.first - 1] <= FAILURE_TIMEOUT) {
+			members.push_back(m);
+			coord = coord == 0 ? m.first : coord;
+		} else if (DEBUG) {
+			fprintf(stderr, "%s Server %d suspects server %d\n", debug_str().c_str(),
+					SELF_IDX, m.first);
+		}
+	}
+	if (members.size() < count(ACTIVE.begin(), ACTIVE.end(), true) && coord == SELF_IDX
+			&& has_quorum(members)) {
+		issue_view(members, proposals);
+	}
+}
+
+/* A server outside our view is still talking to us; as the coordinator, tell it the view
+ * now and then, so it joins again */
+void hint_view(int idx, long long now) {
+	if (FAILURE_TIMEOUT == 0 || ACTIVE[idx - 1] || !IN_VIEW || coordinator(0) != SELF_IDX) {
+		return;
+	}
+	tell_view(idx, now);
+}
+
+/* Repair lost total order phases: send our messages again to the servers whose proposal
+ * we miss, and ask the origin of each message that has waited TOTAL_RESEND for its
+ * agreement for it, or the members if the origin left the view */
+void resend_total(long long now, Proposals &proposals) {
+	if (!total_used() || now - LAST_RESEND < TOTAL_RESEND / 4) {
+		return;
+	}
+	LAST_RESEND = now;
+	for (auto &e : proposals) {
+		Pending &p = e.second;
+		if (p.frame.empty() || now - p.sent < TOTAL_RESEND) {
+			continue;
+		}
+		p.sent = now;
+		vector<bool> voted(SERVERS.size(), false);
+		for (Message &m : p.votes) {
+			if (m.get_sender() > 0 && m.get_sender() <= SERVERS.size()) {
+				voted[m.get_sender() - 1] = true;
+			}
+		}
+		for (int i = 0; i < SERVERS.size(); i++) {
+			if (ACTIVE[i] && !voted[i]) {
+				send_server(i, p.frame.c_str(), p.frame.size());
+			}
+		}
+	}
+	for (auto &e : ROOMS) {
+		Room &r = e.second;
+		for (auto &t : r.total_index) {
+			long long &asked = r.total_asked[t.first];
+			if (now - asked < TOTAL_RESEND) {
+				continue;
+			}
+			asked = now;
+			int origin = atoi(t.first.c_str());
+			if (origin > 0 && origin <= SERVERS.size() && ACTIVE[origin - 1]) {
+				send_control(origin - 1, "ASK " + t.first); // ours too, as we send ourselves the agreement
+			} else {
+				ask_orphan(e.first, t.first);
+			}
+		}
+	}
+	while (!AGREED_ORDER.empty() && now - AGREED_ORDER.front().first > AGREED_KEEP) {
+		AGREED.erase(AGREED_ORDER.front().second);
+		AGREED_ORDER.pop_front();
+	}
+}
+
+/* Announce our interest in a room again to the servers that have not answered it with
+ * a SEQ for INTEREST_RETRY, as the INTEREST or the SEQ may have been lost; until they do,
+ * their messages in the room are only held back */
+void retry_interest(long long now) {
+	if (!INTEREST_WAITING || now - LAST_INTEREST < INTEREST_RETRY / 4) {
+		return;
+	}
+	LAST_INTEREST = now;
+	INTEREST_WAITING = false;
+	for (auto &e : ROOMS) {
+		Room &r = e.second;
+		if (r.members == 0 || r.order == TOTAL) {
+			continue;
+		}
+		bool due = now - r.interest_sent >= INTEREST_RETRY;
+		for (int i = 0; i < SERVERS.size(); i++) {
+			if (ACTIVE[i] && i != SELF_IDX - 1 && !r.baseline[i]) {
+				INTEREST_WAITING = true;
+				if (due) {
+					announce_interest(e.first, true, i);
+				}
+			}
+		}
+	}
+}
+
+/* Whether a total order phase may need repairing soon */
+bool total_waiting(const Proposals &proposals) {
+	if (!total_used()) {
+		return false;
+	}
+	if (!proposals.empty()) {
+		return true;
+	}
+	for (auto &e : ROOMS) {
+		if (!e.second.total_queue.empty()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Receive and handle one datagram waiting on a socket; false if there is none. The
+ * kernel's count of datagrams dropped on the socket comes along with it */
+bool receive(int fd, Proposals &proposals) {
+	char buffer[FRAME_LEN + 1] = { };
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	sockaddr_in client_addr;
+	iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = FRAME_LEN;
+	msghdr mh;
+	bzero(&mh, sizeof(mh));
+	mh.msg_name = &client_addr;
+	mh.msg_namelen = sizeof(client_addr);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	int len = net_recvmsg(fd, &mh, MSG_DONTWAIT);
+	if (len < 0) {
+		return false;
+	}
+	for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t dropped;
+			memcpy(&dropped, CMSG_DATA(cm), sizeof(dropped));
+			(fd == listen_fd ? PEER_OVERFLOW : CLIENT_OVERFLOW) = dropped;
+		}
+	}
+	buffer[len] = 0;
+	long long now = now_us();
+	int idx = 0;
+	ClientId cid = 0;
+	int rn = 0;
+	ProfSample ps;
+	PROF.start(ps);
+	bool from_client = is_client(client_addr, cid, rn);
+	bool from_server = !from_client && is_server(client_addr, idx);
+	PROF.stop(PROF_CLASSIFY, ps);
+	if (from_client) { // get a message from an existing client
+		trace_datagram(TRACE_CLIENT, client_addr, buffer, len);
+		CLIENTS.get(cid)->set_last_active(now);
+		PROF.start(ps);
+		bool whole = reassemble(client_addr, buffer, len, now);
+		PROF.stop(PROF_CLIENT_PARSE, ps);
+		if (!whole) {
+			return true;
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Client %d posts \"%s\" to chat room #%d\n",
+					debug_str().c_str(), client_no(cid), buffer, rn);
+		}
+		do_client(cid, buffer, proposals);
+	} else if (from_server) { // get a message from another server
+		trace_datagram(TRACE_PEER, client_addr, buffer, len);
+		LAST_HEARD[idx - 1] = now;
+		hint_view(idx, now);
+		PROF.start(ps);
+		bool whole = reassemble(client_addr, buffer, len, now) && unzip(buffer, len);
+		PROF.stop(PROF_PARSE, ps);
+		if (!whole) {
+			return true;
+		}
+		if (buffer[0] == CTRL_MARK) {
+			do_control(idx, client_addr, buffer, proposals);
+			return true;
+		}
+		if (buffer[0] == RELAY_MARK) { // pass it on first, then handle it as the origin's
+			int origin = atoi(buffer + 1);
+			char* body = strchr(buffer, ':');
+			if (body == NULL || origin <= 0 || origin > SERVERS.size()) {
+				return true;
+			}
+			relay(origin, buffer, len);
+			body++;
+			len -= body - buffer;
+			memmove(buffer, body, len + 1);
+			idx = origin;
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Server %d sends \"%s\"\n",
+					debug_str().c_str(), idx, buffer);
+		}
+		PROF.start(ps);
+		Frame f;
+		parse_frame(idx, buffer, len, f);
+		PROF.stop(PROF_PARSE, ps, false); // the datagram was counted as it was unpacked
+		if (DEBUG) {
+			fprintf(stderr,
+					"%s Parsed result: id: %d, clock: %s, order: %d, proposed by: %d, room: %d, message: %s\n",
+					debug_str().c_str(), f.id, f.clock, f.ord, f.proby, f.room, f.text);
+		}
+		/* Handle each frame in the order the sender posted it in */
+		int order = f.ord >= PLAIN_MSG && f.ord < PLAIN_MSG + TOTAL ? f.ord - PLAIN_MSG : TOTAL;
+		RECEIVE_PATHS[order](f, proposals);
+	} else { // get a message from a new client
+		trace_datagram(TRACE_CLIENT, client_addr, buffer, len);
+		if (len > 0 && buffer[0] == CTRL_MARK) { // a server we do not know yet
+			do_control(0, client_addr, buffer, proposals);
+			return true;
+		}
+		if (fd != client_fd) { // only servers talk to the peer socket
+			return true;
+		}
+		Client new_c(client_addr);
+		new_c.set_last_active(now);
+		cid = CLIENTS.add(new_c);
+		CLIENTS_DIRTY = true;
+		if (IDLE_TIMEOUT > 0) {
+			IDLE_WHEEL.schedule(cid, now / 1000000 + IDLE_TIMEOUT);
+		}
+		if (!reassemble(client_addr, buffer, len, now)) {
+			return true;
+		}
+		if (DEBUG) {
+			fprintf(stderr, "%s Client %d posts \"%s\" New Client!\n",
+					debug_str().c_str(), client_no(cid), buffer);
+		}
+		do_new_client(cid, buffer);
+		if (DEBUG) {
+			fprintf(stderr,
+					"%s This is a new client and is accepted as %d\n",
+					debug_str().c_str(), client_no(cid));
+		}
+	}
+	return true;
+}
+
+/* Handle what the sockets have waiting, peer traffic first: in strict priority a client
+ * datagram is only taken once no peer datagram waits, with -P after every PEER_WEIGHT
+ * peer datagrams. Returns after RECEIVE_BATCH datagrams so the timers get their turn */
+void receive_all(Proposals &proposals) {
+	int handled = 0;
+	bool more = true;
+	while (more && handled < RECEIVE_BATCH) {
+		more = false;
+		for (int n = 0; (PEER_WEIGHT == 0 || n < PEER_WEIGHT) && handled < RECEIVE_BATCH
+				&& receive(listen_fd, proposals); n++) {
+			handled++;
+			more = true;
+		}
+		if (client_fd != listen_fd && handled < RECEIVE_BATCH
+				&& receive(client_fd, proposals)) {
+			handled++;
+			more = true;
+		}
+	}
+}
+
+/* Run a server until it is shut down, as the process or as a simulator's thread */
+int server_main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "*** Author: Gongyao Chen (gongyaoc)\n");
+		exit(1);
+	}
+
+	/* Your code here */
+
+	/* Handling shutdown signal */
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	/* Parsing command line arguments */
+	int ch = 0;
+	optind = 0; // a simulator parses the arguments of every server it runs
+	ORDER = UNORDERED;
+	const char* trace_path = NULL;
+	while ((ch = getopt(argc, argv, "A:b:B:df:H:jk:l:L:m:o:O:pP:q:Q:r:S:t:vw:z")) != -1) {
 		switch (ch) {
 		case 'v':
 			DEBUG = true;
 			break;
-		case 'o':
-			if (strcasecmp(optarg, "unordered") == 0) {
-				ORDER = UNORDERED;
-			} else if (strcasecmp(optarg, "fifo") == 0) {
-				ORDER = FIFO;
-			} else if (strcasecmp(optarg, "causal") == 0) {
-				ORDER = CAUSAL;
-			} else if (strcasecmp(optarg, "total") == 0) {
-				ORDER = TOTAL;
+		case 't':
+			IDLE_TIMEOUT = atoi(optarg);
+			break;
+		case 'r':
+			ROOM_NUM = atoi(optarg);
+			break;
+		case 'w':
+			trace_path = optarg;
+			break;
+		case 'z':
+			ZIP = true;
+			break;
+		case 'k':
+			FANOUT = atoi(optarg);
+			break;
+		case 'j':
+			JOINING = true;
+			break;
+		case 'm':
+			MCAST_GROUP = to_sockaddr(optarg);
+			if (!IN_MULTICAST(ntohl(MCAST_GROUP.sin_addr.s_addr))
+					|| MCAST_GROUP.sin_port == 0) {
+				fprintf(stderr, "Please enter a multicast group as address:port.\n");
+				exit(1);
+			}
+			break;
+		case 'S':
+			SNAP_PATH = optarg;
+			break;
+		case 'A':
+			ADMIN_TOKEN = optarg;
+			break;
+		case 'l':
+		case 'L':
+			if (!(ch == 'l' ? CLIENT_RATE : ROOM_RATE).parse(optarg)) {
+				fprintf(stderr, "Please enter a rate limit as posts per second[:burst].\n");
+				exit(1);
+			}
+			break;
+		case 'd':
+			SHAPING = true;
+			break;
+		case 'b':
+			if (!HOLD.parse(optarg)) {
+				fprintf(stderr, "Please enter a hold-back budget as bytes per room[:bytes in all], with k or m for kilo- or megabytes.\n");
+				exit(1);
+			}
+			break;
+		case 'B':
+			if (strcasecmp(optarg, "shed") == 0) {
+				HOLD_POLICY = HOLD_SHED;
+			} else if (strcasecmp(optarg, "drop") == 0) {
+				HOLD_POLICY = HOLD_DROP;
+			} else if (strcasecmp(optarg, "nack") == 0) {
+				HOLD_POLICY = HOLD_NACK;
+			} else {
+				fprintf(stderr, "Please enter a hold-back budget policy: shed, drop or nack.\n");
+				exit(1);
+			}
+			break;
+		case 'f':
+			FAILURE_TIMEOUT = max(atoll(optarg), 0LL) * 1000;
+			break;
+		case 'p':
+			if (!PROF.open()) {
+				fprintf(stderr, "Hardware counters are not available, profiling with the clock only.\n");
+			}
+			break;
+		case 'P':
+			PEER_WEIGHT = max(atoi(optarg), 0);
+			break;
+		case 'q':
+			OUTBOX_LIMIT = max(atoi(optarg), 1);
+			break;
+		case 'Q':
+			if (strcasecmp(optarg, "oldest") == 0) {
+				OUTBOX_POLICY = OUTBOX_DROP_OLDEST;
+			} else if (strcasecmp(optarg, "client") == 0) {
+				OUTBOX_POLICY = OUTBOX_DROP_CLIENT;
+			} else if (strcasecmp(optarg, "coalesce") == 0) {
+				OUTBOX_POLICY = OUTBOX_COALESCE;
 			} else {
+				fprintf(stderr, "Please enter a slow client policy: oldest, client or coalesce.\n");
+				exit(1);
+			}
+			break;
+		case 'H':
+			if (!HISTORY.open(optarg)) {
+				fprintf(stderr, "Unable to use history directory %s.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			ORDER = parse_order(optarg);
+			if (ORDER == -1) {
 				fprintf(stderr, "Please enter a valid multicast order.\n");
 				exit(1);
 			}
 			break;
+		case 'O': {
+			char* colon = strchr(optarg, ':');
+			int order = colon == NULL ? -1 : parse_order(colon + 1);
+			if (order == -1 || atoi(optarg) <= 0) {
+				fprintf(stderr, "Please enter the order of a room as room:order.\n");
+				exit(1);
+			}
+			ROOM_ORDERS[atoi(optarg)] = { order, 0 };
+			break;
+		}
 		case '?':
 			fprintf(stderr, "Error: Invalid choose: %c\n", (char) optopt);
 			exit(1);
 		default:
 			fprintf(stderr,
-					"Error: Please input [-o order] [-v] [configuration file] [index]\n");
+					"Error: Please input [-A admin token] [-b room bytes[:total bytes]] [-B shed|drop|nack] [-d] [-f failure timeout ms] [-H history dir] [-j] [-k fanout] [-l client rate[:burst]] [-L room rate[:burst]] [-m group:port] [-o order] [-O room:order] [-p] [-P peer weight] [-q queue length] [-Q oldest|client|coalesce] [-r max rooms] [-S snapshot file] [-t idle seconds] [-v] [-w trace file] [-z] [configuration file] [index]\n");
 			exit(1);
 		}
 	}
+	for (auto &e : ROOM_ORDERS) {
+		TOTAL_ROOMS += e.second.order == TOTAL;
+	}
 	if (optind == argc) {
 		fprintf(stderr, "Error: Please input [configuration file] [index]\n");
 		exit(1);
@@ -588,7 +3451,8 @@ int main(int argc, char *argv[]) {
 	}
 	SELF_IDX = atoi(argv[optind]);
 
-	struct sockaddr_in server_addr, client_addr; // Structures to represent the server and client
+	struct sockaddr_in server_addr, client_addr; // Structures to represent the peer and client sockets
+	bool own_client_socket = false;
 
 	/* Parse configuration file */
 	ifstream cong_f;
@@ -600,6 +3464,7 @@ int main(int argc, char *argv[]) {
 		strcpy(address, ln.c_str());
 		char* serv_ad = strtok(address, ",");
 		char* binding = strtok(NULL, ",");
+		char* client_ad = binding == NULL ? NULL : strtok(NULL, ",");
 		SERVERS.push_back(to_sockaddr(serv_ad));
 		if (i == SELF_IDX - 1) {
 			if (binding != NULL) {
@@ -607,121 +3472,198 @@ int main(int argc, char *argv[]) {
 			} else {
 				server_addr = SERVERS[i];
 			}
+			if (client_ad != NULL) { // clients get a socket of their own
+				client_addr = to_sockaddr(client_ad);
+				own_client_socket = true;
+			}
 		}
 		i++;
 	}
 
 	/* Configure the server */
 	server_addr.sin_addr.s_addr = htons(INADDR_ANY);
-	/* Create a new socket */
-	if ((listen_fd = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
-		fprintf(stderr, "Socket open error.\n");
-		exit(1);
-	}
-	/* Use the socket and associate it with the port number */
-	if (bind(listen_fd, (const struct sockaddr *) &server_addr,
-			sizeof(struct sockaddr)) == -1) {
+	/* Create a new socket associated with the port number */
+	if ((int) (listen_fd = net_open(server_addr)) == -1) {
 		fprintf(stderr, "Unable to bind.\n");
 		exit(1);
 	}
+	client_fd = listen_fd;
+	if (own_client_socket) {
+		client_addr.sin_addr.s_addr = htons(INADDR_ANY);
+		if ((int) (client_fd = net_open(client_addr)) == -1) {
+			fprintf(stderr, "Unable to bind the client socket.\n");
+			exit(1);
+		}
+	}
+	int on = 1; // report kernel drops on the sockets
+	net_setsockopt(listen_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+	net_setsockopt(client_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
 	if (DEBUG) {
 		printf("Server %d configured to listen on IP: %s, port#: %d\n",
 				SELF_IDX, inet_ntoa(server_addr.sin_addr),
 				ntohs(server_addr.sin_port));
+		if (own_client_socket) {
+			printf("Server %d takes clients on port#: %d\n", SELF_IDX,
+					ntohs(client_addr.sin_port));
+		}
 	}
 	fflush(stdout);
+	if (MCAST_GROUP.sin_port != 0) { // send the groups out of the interface we are configured on
+		in_addr ifaddr = SERVERS[SELF_IDX - 1].sin_addr;
+		unsigned char loop = 1;
+		if (net_setsockopt(client_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr))
+				== -1 || net_setsockopt(client_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+				sizeof(loop)) == -1) {
+			fprintf(stderr, "Unable to send multicast on %s.\n", inet_ntoa(ifaddr));
+			exit(1);
+		}
+	}
+	if (trace_path != NULL) {
+		open_trace(trace_path);
+	}
 
 	/* Set initial chat room status */
-	for (int i = 0; i < SERVERS.size(); i++) {
-		CLOCK.push_back(0);
-	}
-	for (int i = 0; i < ROOM_NUM; i++) {
-		FIFO_ID.push_back(0);
-		vector<unordered_map<int, string>> fv;
-		FIFO_QUEUE.push_back(fv);
-		vector<Message> cv;
-		CAUSAL_QUEUE.push_back(cv);
-		map<Message, string, Comp> tv;
-		TOTAL_QUEUE.push_back(tv);
-		vector<int> rev;
-		RECEIVED.push_back(rev);
-		PROPOSED.push_back(0);
-		AGREED.push_back(0);
-		for (int j = 0; j < SERVERS.size(); j++) {
-			unordered_map<int, string> ump;
-			FIFO_QUEUE[i].push_back(ump);
-			RECEIVED[i].push_back(0);
+	PEER_ZIP.resize(SERVERS.size(), false);
+	PEER_ZIP[SELF_IDX - 1] = ZIP;
+	LAST_HEARD.resize(SERVERS.size(), now_us());
+	VIEW_HINT.resize(SERVERS.size(), 0);
+	INTEREST_DENIED.resize(SERVERS.size(), 0);
+	ACTIVE.assign(SERVERS.size(), !JOINING); // the configured servers form the first view
+	ACTIVE[SELF_IDX - 1] = true;
+	IN_VIEW = !JOINING;
+	HAVE_STATE = !JOINING;
+	for (int i = 0; i < SERVERS.size(); i++) { // peers that are already up learn about us now
+		if (i != SELF_IDX - 1) {
+			send_hello(i, "HELLO");
 		}
 	}
+	TOTAL_EPOCH = net_time();
+	if (getrandom(&MCAST_SECRET, sizeof(MCAST_SECRET), 0) != sizeof(MCAST_SECRET)) {
+		MCAST_SECRET = TOTAL_EPOCH ^ getpid();
+	}
 	RUNNING = true;
+	IDLE_WHEEL.start(now_us() / 1000000);
+	ROOM_WHEEL.start(now_us() / 1000000);
 
-	unordered_map<string, vector<Message>> proposals;
+	Proposals proposals;
+	long long last_join = 0;
+	if (SNAP_PATH != NULL) {
+		load_state(proposals);
+		SNAP_LAST = now_us();
+		SNAP_WRITER.start(SNAP_PATH);
+	}
 	while (RUNNING) {
-		char buffer[MSG_LEN + 1] = { };
-		socklen_t client_len = sizeof(client_addr);
-		int len = recvfrom(listen_fd, buffer, MSG_LEN, 0,
-				(struct sockaddr*) &client_addr, &client_len);
-		buffer[len] = 0;
-		if (!RUNNING) {
+		/* Wake up at least every second to evict idle clients and reclaim rooms */
+		shed_clients();
+		fd_set readfds, writefds;
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(listen_fd, &readfds);
+		FD_SET(client_fd, &readfds);
+		if (!BACKLOGGED.empty()) { // clients are waiting for room in the send buffer
+			FD_SET(client_fd, &writefds);
+		}
+		struct timeval timeout;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		long long shaped = SHAPED.empty() ? -1 : release_shaped(now_us(), proposals);
+		if (shaped >= 0 && shaped < 1000000) { // a deferred post is due sooner
+			timeout.tv_sec = 0;
+			timeout.tv_usec = shaped;
+		}
+		if (FAILURE_TIMEOUT > 0 && FAILURE_TIMEOUT / 4 < timeout.tv_sec * 1000000LL
+				+ timeout.tv_usec) { // heartbeats are due sooner
+			timeout.tv_sec = 0;
+			timeout.tv_usec = FAILURE_TIMEOUT / 4;
+		}
+		if (!NACK_ROOMS.empty() && NACK_INTERVAL < timeout.tv_sec * 1000000LL
+				+ timeout.tv_usec) { // retransmissions are due sooner
+			timeout.tv_sec = 0;
+			timeout.tv_usec = NACK_INTERVAL;
+		}
+		if (INTEREST_WAITING && INTEREST_RETRY / 4 < timeout.tv_sec * 1000000LL
+				+ timeout.tv_usec) { // unanswered interest is announced again sooner
+			timeout.tv_sec = 0;
+			timeout.tv_usec = INTEREST_RETRY / 4;
+		}
+		if (total_waiting(proposals) && TOTAL_RESEND / 4 < timeout.tv_sec * 1000000LL
+				+ timeout.tv_usec) { // lost phases are repaired sooner
+			timeout.tv_sec = 0;
+			timeout.tv_usec = TOTAL_RESEND / 4;
+		}
+		int ready = net_select(max(listen_fd, client_fd) + 1, &readfds, &writefds,
+				timeout.tv_sec * 1000000LL + timeout.tv_usec);
+		if (!RUNNING || (ready < 0 && NET != NULL)) { // or the simulator is done with us
 			break;
 		}
-		int idx = 0;
-		int rn = 0;
-		if (is_client(client_addr, idx, rn)) { // get a message from an existing client
-			if (DEBUG) {
-				fprintf(stderr, "%s Client %d posts \"%s\" to chat room #%d\n",
-						debug_str().c_str(), idx, buffer, rn);
-			}
-			do_client(idx, buffer);
-		} else if (is_server(client_addr, idx)) { // get a message from another server
-			if (DEBUG) {
-				fprintf(stderr, "%s Server %d sends \"%s\"\n",
-						debug_str().c_str(), idx, buffer);
-			}
-			char* mids = strtok(buffer, ",");
-			int mid = atoi(mids);
-			char* vcl = strtok(NULL, ",");
-			char* ords = strtok(NULL, ",");
-			int ord = atoi(ords);
-			char* probys = strtok(NULL, ",");
-			int proby = atoi(probys);
-			char* rooms = strtok(NULL, ",");
-			int room = atoi(rooms);
-			char* msg = strtok(NULL, ",");
-			if (DEBUG) {
-				fprintf(stderr,
-						"%s Parsed result: id: %d, clock: %s, order: %d, proposed by: %d, room: %d, message: %s\n",
-						debug_str().c_str(), mid, vcl, ord, proby, room, msg);
-			}
-			/* Handle different multicast order */
-			if (ORDER == UNORDERED) {
-				do_unordered(room, msg);
-			} else if (ORDER == FIFO) {
-				do_fifo(idx, mid, room, msg); // mid as sequence number
-			} else if (ORDER == CAUSAL) {
-				do_causal(idx, vcl, room, msg);
-			} else {
-				do_total(idx, mid, ord, proby, proposals, room, msg); // mid as proposed number
-			}
-		} else { // get a message from a new client
-			Client new_c(client_addr);
-			CLIENTS.push_back(new_c);
-			idx = CLIENTS.size();
-			if (DEBUG) {
-				fprintf(stderr, "%s Client %d posts \"%s\" New Client!\n",
-						debug_str().c_str(), idx, buffer);
-			}
-			do_new_client(idx, buffer);
-			if (DEBUG) {
-				fprintf(stderr,
-						"%s This is a new client and is accepted as %d\n",
-						debug_str().c_str(), idx);
-			}
+		if (ready > 0 && FD_ISSET(client_fd, &writefds)) {
+			flush_clients();
+		}
+		long long now = now_us();
+		if (IDLE_TIMEOUT > 0) {
+			IDLE_WHEEL.advance(now / 1000000, expire_client);
+		}
+		ROOM_WHEEL.advance(now / 1000000, expire_room);
+		REASSEMBLY.expire(now);
+		HISTORY.maintain();
+		if (!HAVE_STATE && now - last_join >= JOIN_RETRY) {
+			send_join();
+			last_join = now;
 		}
+		check_peers(now, proposals);
+		resend_total(now, proposals);
+		retry_interest(now);
+		retry_nacks(now);
+		if (now - SNAP_LAST >= SNAPSHOT_INTERVAL) {
+			save_snapshot(proposals);
+			SNAP_LAST = now;
+		}
+		if (ready <= 0) {
+			continue;
+		}
+
+		receive_all(proposals);
 	}
 
+	if (TRACE_FILE != NULL) {
+		fclose(TRACE_FILE);
+	}
+	if (PROF.enabled()) {
+		fprintf(stderr, "Server %d profile %s\n", SELF_IDX,
+				PROF.report(PROF_STAGES, PROF_FANOUT + 1).c_str() + 4);
+	}
+	HISTORY.close_all();
+	save_snapshot(proposals); // so a restart resumes exactly where we stopped
+	SNAP_WRITER.stop();
+	if (LEAVING && IN_VIEW) {
+		for (int i = 0; i < SERVERS.size(); i++) {
+			if (ACTIVE[i] && i != SELF_IDX - 1) {
+				send_control(i, "LEAVE " + to_string(SELF_IDX));
+			}
+		}
+	}
+	net_close(listen_fd);
+	if (client_fd != listen_fd) {
+		net_close(client_fd);
+	}
+	if (DEBUG) {
+		printf("\nServer %d socket closed\n", SELF_IDX);
+	}
 	if (DEBUG) {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		printf("Server %d sent %lld messages to servers, %lld bytes, %lld before compression, dropped %lld to slow clients, lost %lld peer and %lld client datagrams, held back at most %lld bytes, %.3f s cpu.\n",
+				SELF_IDX, PEER_SENT, ZIP_SENT, ZIP_RAW, CLIENT_DROPS, PEER_OVERFLOW,
+				CLIENT_OVERFLOW, HOLD.get_peak(),
+				ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+						+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
 		printf("Server %d successfully shut down.\n", SELF_IDX);
 	}
 	return 0;
 }
+
+#ifndef SERVER_LIBRARY
+int main(int argc, char *argv[]) {
+	return server_main(argc, argv);
+}
+#endif
@@ -0,0 +1,154 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string.h>
+
+/* A small LZ77 codec for inter-server datagrams, in the spirit of LZ4. A block is a run of
+ * sequences: a token (literal count in the high nibble, match length - 4 in the low
+ * nibble, 15 meaning "more bytes follow"), the literals, and a two-byte little endian
+ * match offset. The last sequence holds only literals. A compressed datagram is
+ * ZIP_MARK followed by one block. */
+
+const char ZIP_MARK = '\x03';
+const int ZIP_MIN_LEN = 64; // shorter messages are not worth compressing
+const int ZIP_HASH_BITS = 12;
+const int ZIP_MIN_MATCH = 4;
+
+inline unsigned int zip_load32(const unsigned char* p) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Write a length that did not fit into its nibble as a run of 255s and a remainder */
+inline bool zip_put_length(unsigned char* out, int &op, int cap, int len) {
+	for (; len >= 255; len -= 255) {
+		if (op >= cap) {
+			return false;
+		}
+		out[op++] = 255;
+	}
+	if (op >= cap) {
+		return false;
+	}
+	out[op++] = len;
+	return true;
+}
+
+/* Emit one sequence; a negative offset marks the final, literal-only sequence */
+inline bool zip_put_sequence(const unsigned char* lit, int lit_len, int offset,
+		int match_len, unsigned char* out, int &op, int cap) {
+	if (op >= cap) {
+		return false;
+	}
+	int m = offset < 0 ? 0 : match_len - ZIP_MIN_MATCH;
+	out[op++] = ((lit_len < 15 ? lit_len : 15) << 4) | (m < 15 ? m : 15);
+	if (lit_len >= 15 && !zip_put_length(out, op, cap, lit_len - 15)) {
+		return false;
+	}
+	if (op + lit_len > cap) {
+		return false;
+	}
+	memcpy(out + op, lit, lit_len);
+	op += lit_len;
+	if (offset < 0) {
+		return true;
+	}
+	if (op + 2 > cap) {
+		return false;
+	}
+	out[op++] = offset & 0xff;
+	out[op++] = offset >> 8;
+	return m < 15 || zip_put_length(out, op, cap, m - 15);
+}
+
+/* Compress src into dst; returns the block length, or -1 if it needs more than cap bytes */
+inline int zip_compress(const char* src, int len, char* dst, int cap) {
+	const unsigned char* in = (const unsigned char*) src;
+	unsigned char* out = (unsigned char*) dst;
+	int table[1 << ZIP_HASH_BITS];
+	for (int i = 0; i < (1 << ZIP_HASH_BITS); i++) {
+		table[i] = -1;
+	}
+	int ip = 0, anchor = 0, op = 0;
+	while (ip + ZIP_MIN_MATCH <= len) {
+		unsigned int seq = zip_load32(in + ip);
+		unsigned int h = (seq * 2654435761u) >> (32 - ZIP_HASH_BITS);
+		int ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > 65535 || zip_load32(in + ref) != seq) {
+			ip++;
+			continue;
+		}
+		int match_len = ZIP_MIN_MATCH;
+		while (ip + match_len < len && in[ref + match_len] == in[ip + match_len]) {
+			match_len++;
+		}
+		if (!zip_put_sequence(in + anchor, ip - anchor, ip - ref, match_len, out,
+				op, cap)) {
+			return -1;
+		}
+		ip += match_len;
+		anchor = ip;
+	}
+	if (!zip_put_sequence(in + anchor, len - anchor, -1, 0, out, op, cap)) {
+		return -1;
+	}
+	return op;
+}
+
+/* Read a length continued in the bytes after the token */
+inline bool zip_get_length(const unsigned char* in, int &ip, int len, int &value) {
+	unsigned char b;
+	do {
+		if (ip >= len) {
+			return false;
+		}
+		b = in[ip++];
+		value += b;
+	} while (b == 255);
+	return true;
+}
+
+/* Decompress a block into dst; returns the original length, or -1 if the block is corrupt
+ * or would expand beyond cap */
+inline int zip_decompress(const char* src, int len, char* dst, int cap) {
+	const unsigned char* in = (const unsigned char*) src;
+	unsigned char* out = (unsigned char*) dst;
+	int ip = 0, op = 0;
+	while (ip < len) {
+		int token = in[ip++];
+		int lit_len = token >> 4;
+		if (lit_len == 15 && !zip_get_length(in, ip, len, lit_len)) {
+			return -1;
+		}
+		if (ip + lit_len > len || op + lit_len > cap) {
+			return -1;
+		}
+		memcpy(out + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == len) { // the final sequence has no match
+			break;
+		}
+		if (ip + 2 > len) {
+			return -1;
+		}
+		int offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		int match_len = token & 15;
+		if (match_len == 15 && !zip_get_length(in, ip, len, match_len)) {
+			return -1;
+		}
+		match_len += ZIP_MIN_MATCH;
+		if (offset == 0 || offset > op || op + match_len > cap) {
+			return -1;
+		}
+		for (int i = 0; i < match_len; i++, op++) { // byte by byte, matches may overlap
+			out[op] = out[op - offset];
+		}
+	}
+	return op;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "net.h"
+
+/* Messages that do not fit into one datagram travel as fragments of the form
+ * "\x02id:index:count:payload". chatserver and chatclient both send and reassemble
+ * them, so ordering and delivery always work on whole messages. */
+
+const char FRAG_MARK = '\x02';
+const int FRAG_MTU = 1200; // largest datagram we send
+const int FRAG_HEADER_LEN = 32; // room reserved for the fragment header
+const int MAX_MESSAGE_LEN = 36864; // largest message after reassembly
+const int REASSEMBLY_BYTES = 4 << 20; // budget for all partially received messages
+const long long REASSEMBLY_TIMEOUT = 5000000; // microseconds until a partial message is dropped
+
+/* Whether a message goes out as it is rather than in fragments */
+inline bool fits_datagram(const char* msg, int len) {
+	return len <= FRAG_MTU && (len == 0 || msg[0] != FRAG_MARK);
+}
+
+/* Number of fragments a message is split into */
+inline int fragment_count(int len) {
+	int payload = FRAG_MTU - FRAG_HEADER_LEN;
+	return (len + payload - 1) / payload;
+}
+
+/* Build fragment i of a message into dgram; returns the datagram length */
+inline int make_fragment(char* dgram, const char* msg, int len, unsigned int id, int i) {
+	int payload = FRAG_MTU - FRAG_HEADER_LEN;
+	int n = len - i * payload < payload ? len - i * payload : payload;
+	int h = snprintf(dgram, FRAG_HEADER_LEN, "%c%u:%d:%d:", FRAG_MARK, id, i,
+			fragment_count(len));
+	memcpy(dgram + h, msg + i * payload, n);
+	return h + n;
+}
+
+/* Send a message, split into fragments if it does not fit into one datagram; false if
+ * any of them could not be sent, as when MSG_DONTWAIT is in flags and the socket is full */
+inline bool send_fragmented(int fd, const char* msg, int len,
+		const sockaddr_in &addr, unsigned int &next_id, int flags = 0) {
+	if (fits_datagram(msg, len)) {
+		return net_sendto(fd, msg, len, flags, addr) != -1;
+	}
+	unsigned int id = next_id++;
+	char dgram[FRAG_MTU];
+	for (int i = 0; i < fragment_count(len); i++) { // the rest is no use without this one
+		int n = make_fragment(dgram, msg, len, id, i);
+		if (net_sendto(fd, dgram, n, flags, addr) == -1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Collects fragments per sender until their message is complete. Memory is capped by
+ * REASSEMBLY_BYTES, evicting the oldest partial messages first, and partial messages
+ * that do not complete within REASSEMBLY_TIMEOUT are dropped. */
+class Reassembler {
+private:
+	struct Partial {
+		int count;
+		int received;
+		long long started;
+		std::vector<std::string> parts;
+	};
+	typedef std::pair<unsigned long long, unsigned int> Key;
+	std::map<Key, Partial> partials;
+	long long bytes;
+	long long last_sweep;
+	long long dropped;
+	void drop(std::map<Key, Partial>::iterator it);
+public:
+	Reassembler() {
+		this->bytes = 0;
+		this->last_sweep = 0;
+		this->dropped = 0;
+	}
+	bool add(const sockaddr_in &from, const char* dgram, int len, long long now,
+			std::string &msg);
+	void expire(long long now);
+	long long get_bytes() const;
+	long long get_dropped() const;
+};
+inline void Reassembler::drop(std::map<Key, Partial>::iterator it) {
+	for (int i = 0; i < it->second.parts.size(); i++) {
+		this->bytes -= it->second.parts[i].size();
+	}
+	this->dropped++;
+	this->partials.erase(it);
+}
+/* Add a fragment; returns true with the whole message once its last fragment arrived */
+inline bool Reassembler::add(const sockaddr_in &from, const char* dgram, int len,
+		long long now, std::string &msg) {
+	unsigned int id = 0;
+	int idx = 0, count = 0, header = 0;
+	std::string head(dgram + 1, len - 1 < FRAG_HEADER_LEN ? len - 1 : FRAG_HEADER_LEN);
+	if (sscanf(head.c_str(), "%u:%d:%d:%n", &id, &idx, &count, &header) != 3
+			|| header == 0) {
+		return false;
+	}
+	header++;
+	int max_count = MAX_MESSAGE_LEN / (FRAG_MTU - FRAG_HEADER_LEN) + 1;
+	if (count <= 0 || count > max_count || idx < 0 || idx >= count) {
+		return false;
+	}
+	Key key(((unsigned long long) from.sin_addr.s_addr << 16) | from.sin_port, id);
+	auto it = this->partials.find(key);
+	if (it == this->partials.end()) {
+		Partial p;
+		p.count = count;
+		p.received = 0;
+		p.started = now;
+		p.parts.resize(count);
+		it = this->partials.insert(std::make_pair(key, p)).first;
+	}
+	Partial &p = it->second;
+	if (p.count != count || !p.parts[idx].empty() || len == header) {
+		return false;
+	}
+	p.parts[idx].assign(dgram + header, len - header);
+	p.received++;
+	this->bytes += len - header;
+	while (this->bytes > REASSEMBLY_BYTES) { // over budget: give up on the oldest message
+		auto oldest = this->partials.end();
+		for (auto o = this->partials.begin(); o != this->partials.end(); o++) {
+			if (o != it && (oldest == this->partials.end()
+					|| o->second.started < oldest->second.started)) {
+				oldest = o;
+			}
+		}
+		if (oldest == this->partials.end()) {
+			break;
+		}
+		drop(oldest);
+	}
+	if (p.received < p.count) {
+		return false;
+	}
+	msg.clear();
+	for (int i = 0; i < p.count; i++) {
+		msg += p.parts[i];
+	}
+	this->bytes -= msg.size();
+	this->partials.erase(it);
+	return true;
+}
+/* Drop partial messages whose remaining fragments did not arrive in time */
+inline void Reassembler::expire(long long now) {
+	if (now - this->last_sweep < 1000000 || this->partials.empty()) {
+		return;
+	}
+	this->last_sweep = now;
+	for (auto it = this->partials.begin(); it != this->partials.end();) {
+		auto cur = it++;
+		if (now - cur->second.started > REASSEMBLY_TIMEOUT) {
+			drop(cur);
+		}
+	}
+}
+inline long long Reassembler::get_bytes() const {
+	return this->bytes;
+}
+inline long long Reassembler::get_dropped() const {
+	return this->dropped;
+}
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+
+/* Append-only history of the messages delivered to each chat room. A room's history is a
+ * series of segment files "room<R>-<first seq>.log" of HISTORY_SEGMENT_BYTES each,
+ * mapped into memory, so an append is a memory copy and never waits for the disk. A
+ * record is [uint32 length][uint32 seq][text]; the length is written last, so a record
+ * torn by a crash reads as the end of the segment. The segments on disk are listed once
+ * when the history is opened and tracked in memory from then on. Once the current
+ * segment of a room is half full, maintain() creates and maps the next one as a spare
+ * "room<R>-next.log" that append renames when it switches to it, and maintain() deletes
+ * segments beyond HISTORY_KEEP_SEGMENTS, so neither happens on the message path. Only the
+ * rooms append marked as due are visited. */
+
+const size_t HISTORY_SEGMENT_BYTES = 1 << 20;
+const int HISTORY_KEEP_SEGMENTS = 8; // retention per room, in segments
+const int HISTORY_RECORD_HEADER = 8;
+
+class HistoryLog {
+private:
+	struct Segment {
+		std::string path;
+		char* base; // NULL while not mapped
+		size_t used;
+		uint32_t first_seq;
+		std::vector<uint32_t> offsets; // record i of the segment, seq first_seq + i
+		Segment() {
+			this->base = NULL;
+			this->used = 0;
+			this->first_seq = 0;
+		}
+	};
+	struct RoomLog {
+		std::deque<Segment> segments;
+		Segment spare; // the next segment, mapped ahead of need
+		uint32_t next_seq;
+		size_t records;
+		bool due; // in due, for maintain() to map a spare or trim
+	};
+	std::string dir;
+	std::unordered_map<int, RoomLog> rooms;
+	std::vector<int> due;
+	std::unordered_map<int, std::vector<uint32_t>> index; // first seq of each segment on disk, per room
+	RoomLog& load(int room);
+	bool map_segment(Segment &s, bool create);
+	bool rotate(int room, RoomLog &r);
+	void trim(int room, RoomLog &r);
+	void check_due(int room, RoomLog &r);
+	std::string segment_path(int room, uint32_t first_seq) const;
+	std::string spare_path(int room) const;
+public:
+	bool open(const char* dir);
+	bool enabled() const;
+	bool append(int room, const char* text, int len);
+	void maintain();
+	int last(int room, int n, uint32_t &first, uint32_t &end);
+	bool read(int room, uint32_t &seq, const char* &text, int &len);
+	void close(int room);
+	void close_all();
+};
+inline std::string HistoryLog::segment_path(int room, uint32_t first_seq) const {
+	char name[64] = { };
+	snprintf(name, sizeof(name), "/room%d-%010u.log", room, first_seq);
+	return this->dir + name;
+}
+inline std::string HistoryLog::spare_path(int room) const {
+	return this->dir + "/room" + std::to_string(room) + "-next.log";
+}
+/* Use a directory for the history, creating it if needed, and list the segments a
+ * previous run left behind */
+inline bool HistoryLog::open(const char* dir) {
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		return false;
+	}
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		return false;
+	}
+	this->dir = dir;
+	this->index.clear();
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL) {
+		int rn = 0;
+		uint32_t first = 0;
+		char tail[8] = { };
+		if (sscanf(e->d_name, "room%d-%u.%7s", &rn, &first, tail) == 3
+				&& strcmp(tail, "log") == 0) {
+			this->index[rn].push_back(first);
+		} else if (sscanf(e->d_name, "room%d-next.%7s", &rn, tail) == 2
+				&& strcmp(tail, "log") == 0) { // a spare left by a crash
+			unlink(spare_path(rn).c_str());
+		}
+	}
+	closedir(d);
+	for (auto &e : this->index) {
+		std::sort(e.second.begin(), e.second.end());
+	}
+	return true;
+}
+inline bool HistoryLog::enabled() const {
+	return !this->dir.empty();
+}
+/* Map a segment file, creating it at full size or indexing the records it holds */
+inline bool HistoryLog::map_segment(Segment &s, bool create) {
+	int fd = ::open(s.path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (fd == -1) {
+		return false;
+	}
+	if (create && ftruncate(fd, HISTORY_SEGMENT_BYTES) == -1) {
+		::close(fd);
+		return false;
+	}
+	void* p = mmap(NULL, HISTORY_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	s.base = (char*) p;
+	s.used = 0;
+	s.offsets.clear();
+	while (!create && s.used + HISTORY_RECORD_HEADER <= HISTORY_SEGMENT_BYTES) {
+		uint32_t len;
+		memcpy(&len, s.base + s.used, sizeof(len));
+		if (len == 0 || s.used + HISTORY_RECORD_HEADER + len > HISTORY_SEGMENT_BYTES) {
+			break;
+		}
+		s.offsets.push_back(s.used);
+		s.used += HISTORY_RECORD_HEADER + len;
+	}
+	return true;
+}
+/* Find the history of a room, mapping the segments it has on disk when it is first used
+ * or used again after close */
+inline HistoryLog::RoomLog& HistoryLog::load(int room) {
+	auto it = this->rooms.find(room);
+	if (it != this->rooms.end()) {
+		return it->second;
+	}
+	RoomLog &r = this->rooms[room];
+	r.next_seq = 1;
+	r.records = 0;
+	r.due = false;
+	std::vector<uint32_t> &firsts = this->index[room];
+	for (size_t i = 0; i < firsts.size();) {
+		Segment s;
+		s.path = segment_path(room, firsts[i]);
+		s.first_seq = firsts[i];
+		if (!map_segment(s, false)) { // gone behind our back
+			firsts.erase(firsts.begin() + i);
+			continue;
+		}
+		r.records += s.offsets.size();
+		r.next_seq = s.first_seq + s.offsets.size();
+		r.segments.push_back(s);
+		i++;
+	}
+	check_due(room, r);
+	return r;
+}
+/* Switch a room to its next segment, the spare if maintain() mapped one in time */
+inline bool HistoryLog::rotate(int room, RoomLog &r) {
+	Segment s;
+	s.first_seq = r.next_seq;
+	s.path = segment_path(room, s.first_seq);
+	if (r.spare.base != NULL && rename(r.spare.path.c_str(), s.path.c_str()) == 0) {
+		s.base = r.spare.base;
+		r.spare = Segment();
+	} else if (!map_segment(s, true)) {
+		return false;
+	}
+	r.segments.push_back(s);
+	this->index[room].push_back(s.first_seq);
+	return true;
+}
+/* Drop the oldest segments of a room beyond the retention */
+inline void HistoryLog::trim(int room, RoomLog &r) {
+	if (r.segments.size() <= HISTORY_KEEP_SEGMENTS) {
+		return;
+	}
+	std::vector<uint32_t> &firsts = this->index[room];
+	while (r.segments.size() > HISTORY_KEEP_SEGMENTS) {
+		Segment &old = r.segments.front();
+		munmap(old.base, HISTORY_SEGMENT_BYTES);
+		unlink(old.path.c_str());
+		r.records -= old.offsets.size();
+		firsts.erase(std::find(firsts.begin(), firsts.end(), old.first_seq));
+		r.segments.pop_front();
+	}
+}
+/* Mark a room for maintain() if its current segment is half full and it has no spare
+ * yet, or it has more segments than it keeps */
+inline void HistoryLog::check_due(int room, RoomLog &r) {
+	if (!r.due && ((r.spare.base == NULL && !r.segments.empty()
+			&& r.segments.back().used > HISTORY_SEGMENT_BYTES / 2)
+			|| r.segments.size() > HISTORY_KEEP_SEGMENTS)) {
+		r.due = true;
+		this->due.push_back(room);
+	}
+}
+/* Map the next segment of the rooms whose current one is half full, and drop what is
+ * beyond the retention; called between batches of datagrams */
+inline void HistoryLog::maintain() {
+	for (int room : this->due) {
+		auto it = this->rooms.find(room);
+		if (it == this->rooms.end()) { // closed meanwhile
+			continue;
+		}
+		RoomLog &r = it->second;
+		if (r.spare.base == NULL && !r.segments.empty()
+				&& r.segments.back().used > HISTORY_SEGMENT_BYTES / 2) {
+			r.spare.path = spare_path(room);
+			map_segment(r.spare, true);
+		}
+		trim(room, r);
+		r.due = false;
+	}
+	this->due.clear();
+}
+/* Append a delivered message to the history of its room */
+inline bool HistoryLog::append(int room, const char* text, int len) {
+	if (!enabled() || len <= 0
+			|| HISTORY_RECORD_HEADER + (size_t) len > HISTORY_SEGMENT_BYTES) {
+		return false;
+	}
+	RoomLog &r = load(room);
+	if (r.segments.empty() || r.segments.back().used + HISTORY_RECORD_HEADER + len
+			> HISTORY_SEGMENT_BYTES) {
+		if (!rotate(room, r)) {
+			return false;
+		}
+	}
+	Segment &s = r.segments.back();
+	char* p = s.base + s.used;
+	uint32_t seq = r.next_seq++;
+	uint32_t n = len;
+	memcpy(p + 4, &seq, sizeof(seq));
+	memcpy(p + HISTORY_RECORD_HEADER, text, len);
+	__atomic_store_n((uint32_t*) p, n, __ATOMIC_RELEASE); // the length makes it visible
+	s.offsets.push_back(s.used);
+	s.used += HISTORY_RECORD_HEADER + len;
+	r.records++;
+	check_due(room, r);
+	return true;
+}
+/* The sequence numbers first .. end of the last n messages of a room; returns how many
+ * there are */
+inline int HistoryLog::last(int room, int n, uint32_t &first, uint32_t &end) {
+	if (!enabled() || n <= 0) {
+		return 0;
+	}
+	RoomLog &r = load(room);
+	size_t count = std::min(r.records, (size_t) n);
+	end = r.next_seq - 1;
+	first = r.next_seq - count;
+	return count;
+}
+/* Point text at message seq of a room in the mapped segments, or at the oldest one kept
+ * after it if it is gone, updating seq; false past the end */
+inline bool HistoryLog::read(int room, uint32_t &seq, const char* &text, int &len) {
+	if (!enabled()) {
+		return false;
+	}
+	RoomLog &r = load(room);
+	for (Segment &s : r.segments) {
+		if (seq >= s.first_seq + s.offsets.size()) {
+			continue;
+		}
+		seq = std::max(seq, s.first_seq);
+		const char* p = s.base + s.offsets[seq - s.first_seq];
+		uint32_t n;
+		memcpy(&n, p, sizeof(n));
+		text = p + HISTORY_RECORD_HEADER;
+		len = n;
+		return true;
+	}
+	return false;
+}
+/* Unmap the history of a room; it is picked up from disk again on next use */
+inline void HistoryLog::close(int room) {
+	auto it = this->rooms.find(room);
+	if (it == this->rooms.end()) {
+		return;
+	}
+	for (Segment &s : it->second.segments) {
+		munmap(s.base, HISTORY_SEGMENT_BYTES);
+	}
+	if (it->second.spare.base != NULL) {
+		munmap(it->second.spare.base, HISTORY_SEGMENT_BYTES);
+		unlink(it->second.spare.path.c_str());
+	}
+	this->rooms.erase(it);
+}
+inline void HistoryLog::close_all() {
+	while (!this->rooms.empty()) {
+		close(this->rooms.begin()->first);
+	}
+}
+
+#endif
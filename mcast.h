@@ -0,0 +1,134 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <map>
+
+/* Delivery of a room's messages over IP multicast (chatserver -m, chatclient -m). A
+ * server sends each message of a room once to the room's group, as
+ * "\x06room:seq:text" with a sequence number per room, instead of once per member.
+ * Clients ask for it with /mcast; on /join they get "\x06J room group:port seq cookie"
+ * and subscribe, on /part "\x06P room". A client that sees a gap asks for the missing
+ * messages by unicast with "/repair room first last cookie", the cookie being the one
+ * its J carried, so only an address that got the J can have messages sent to it. A
+ * repair resends what fits in one message at most and takes a token of the client's
+ * rate limit; what the server no longer has is answered with "\x06G room seq", the
+ * first message it still has. */
+
+const char MCAST_MARK = '\x06';
+const int MCAST_BACKLOG = 256; // messages a server keeps per room for repairs
+const long long MCAST_REPAIR_INTERVAL = 100000; // microseconds between repair requests
+const int MCAST_REPAIR_TRIES = 5; // requests for a gap before the client skips it
+
+/* The cookie of a client address, a keyed hash a server gives out in J and checks on
+ * /repair */
+inline unsigned int mcast_cookie(const sockaddr_in &addr, unsigned int secret) {
+	unsigned int h = (secret ^ addr.sin_addr.s_addr) * 0x9e3779b1u;
+	h = (h ^ (h >> 15) ^ ((unsigned int) addr.sin_port << 16)) * 0x85ebca6bu;
+	return h ^ (h >> 13);
+}
+
+/* The group of a room: rooms count up from the base address, servers from the base port,
+ * so servers sharing a segment do not deliver into each other's groups */
+inline sockaddr_in mcast_group(const sockaddr_in &base, int server, int room) {
+	sockaddr_in addr = base;
+	addr.sin_addr.s_addr = htonl(ntohl(base.sin_addr.s_addr) + room - 1);
+	addr.sin_port = htons(ntohs(base.sin_port) + server - 1);
+	return addr;
+}
+
+/* The messages of the room a client is subscribed to, put back in sequence. Messages
+ * after a gap are held until the gap is repaired or given up on. */
+class McastStream {
+private:
+	int room;
+	unsigned int next;
+	std::map<unsigned int, std::string> held;
+	long long last_repair;
+	int tries;
+	template<typename F> void flush(F deliver);
+public:
+	McastStream() {
+		this->room = -1;
+		this->next = 0;
+		this->last_repair = 0;
+		this->tries = 0;
+	}
+	void reset(int room, unsigned int next);
+	int get_room() const;
+	template<typename F> void add(unsigned int seq, const std::string &text, F deliver);
+	template<typename F> void skip_to(unsigned int seq, F deliver);
+	template<typename F> bool repair(long long now, unsigned int &first,
+			unsigned int &last, F deliver);
+	long long wait(long long now) const;
+};
+/* Start over in a room, expecting seq next */
+inline void McastStream::reset(int room, unsigned int next) {
+	this->room = room;
+	this->next = next;
+	this->held.clear();
+	this->tries = 0;
+}
+inline int McastStream::get_room() const {
+	return this->room;
+}
+template<typename F> void McastStream::flush(F deliver) {
+	auto it = this->held.begin();
+	while (it != this->held.end() && it->first == this->next) {
+		deliver(it->second);
+		this->next++;
+		this->tries = 0;
+		it = this->held.erase(it);
+	}
+}
+/* Take a message from the group or a repair, handing deliver(text) whatever is in
+ * sequence now; duplicates are dropped */
+template<typename F> void McastStream::add(unsigned int seq, const std::string &text,
+		F deliver) {
+	if (this->room == -1 || (int) (seq - this->next) < 0) {
+		return;
+	}
+	this->held.insert(std::make_pair(seq, text));
+	flush(deliver);
+}
+/* Give up on the messages before seq */
+template<typename F> void McastStream::skip_to(unsigned int seq, F deliver) {
+	if ((int) (seq - this->next) <= 0) {
+		return;
+	}
+	this->next = seq;
+	this->tries = 0;
+	this->held.erase(this->held.begin(), this->held.lower_bound(seq));
+	flush(deliver);
+}
+/* Whether it is time to ask for the gap first .. last again; after MCAST_REPAIR_TRIES
+ * requests the gap is skipped */
+template<typename F> bool McastStream::repair(long long now, unsigned int &first,
+		unsigned int &last, F deliver) {
+	if (this->held.empty() || now - this->last_repair < MCAST_REPAIR_INTERVAL) {
+		return false;
+	}
+	if (this->tries == MCAST_REPAIR_TRIES) {
+		skip_to(this->held.begin()->first, deliver);
+		return false;
+	}
+	this->tries++;
+	this->last_repair = now;
+	first = this->next;
+	last = this->held.begin()->first - 1;
+	return true;
+}
+/* Microseconds until repair has something to do, -1 if there is no gap */
+inline long long McastStream::wait(long long now) const {
+	if (this->held.empty()) {
+		return -1;
+	}
+	long long w = this->last_repair + MCAST_REPAIR_INTERVAL - now;
+	return w < 0 ? 0 : w;
+}
+
+#endif
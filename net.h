@@ -0,0 +1,82 @@
+#ifndef NET_H
+#define NET_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Datagram sockets and the clock of a server. Normally these are the kernel's. A
+ * simulator runs each server as a thread with a Network of its own installed in NET,
+ * so many servers share one process, a simulated network and virtual time (see
+ * test/simulate.cc). Everything a server keeps is thread_local for that reason. */
+
+class Network {
+public:
+	virtual ~Network() {
+	}
+	virtual int open(const sockaddr_in &addr) = 0; // a socket bound to addr, -1 if taken
+	virtual void close(int fd) = 0;
+	virtual ssize_t send(int fd, const char* msg, size_t len, const sockaddr_in &to) = 0;
+	virtual ssize_t receive(int fd, char* buffer, size_t len, sockaddr_in &from) = 0; // -1 if none
+	virtual int select(int nfds, fd_set* readfds, fd_set* writefds, long long timeout) = 0; // -1 to shut down
+	virtual long long now() = 0; // microseconds
+};
+
+inline thread_local Network* NET = NULL;
+
+inline int net_open(const sockaddr_in &addr) {
+	if (NET != NULL) {
+		return NET->open(addr);
+	}
+	int fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd != -1 && bind(fd, (const struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+inline void net_close(int fd) {
+	if (NET != NULL) {
+		NET->close(fd);
+	} else {
+		::close(fd);
+	}
+}
+inline ssize_t net_sendto(int fd, const char* msg, size_t len, int flags,
+		const sockaddr_in &to) {
+	if (NET != NULL) {
+		return NET->send(fd, msg, len, to);
+	}
+	return sendto(fd, msg, len, flags, (const struct sockaddr*) &to, sizeof(to));
+}
+/* Receive into the first buffer of mh; a simulated network reports no kernel drops */
+inline ssize_t net_recvmsg(int fd, msghdr* mh, int flags) {
+	if (NET == NULL) {
+		return recvmsg(fd, mh, flags);
+	}
+	mh->msg_controllen = 0;
+	return NET->receive(fd, (char*) mh->msg_iov[0].iov_base, mh->msg_iov[0].iov_len,
+			*(sockaddr_in*) mh->msg_name);
+}
+inline int net_setsockopt(int fd, int level, int name, const void* value, socklen_t len) {
+	return NET != NULL ? 0 : setsockopt(fd, level, name, value, len);
+}
+/* Wait up to timeout microseconds for the sockets */
+inline int net_select(int nfds, fd_set* readfds, fd_set* writefds, long long timeout) {
+	if (NET != NULL) {
+		return NET->select(nfds, readfds, writefds, timeout);
+	}
+	struct timeval tv;
+	tv.tv_sec = timeout / 1000000;
+	tv.tv_usec = timeout % 1000000;
+	return ::select(nfds, readfds, writefds, NULL, &tv);
+}
+/* Seconds since the epoch, to tell restarts of a server apart */
+inline long long net_time() {
+	return NET != NULL ? NET->now() / 1000000 + 1 : time(NULL);
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include "fragment.h"
+
+/* Messages waiting for a client while the socket's send buffer is full. Sends to clients
+ * never block: what the kernel does not take now is queued per client and sent when the
+ * socket is writable again, so one slow receiver cannot stall the fan-out to the others.
+ * A queue holds at most a limit of messages; beyond it the slow-consumer policy either
+ * drops the oldest message, gives up on the client, or coalesces the newest messages
+ * into one. A replay of a room's history waits in the queue as a range of sequence
+ * numbers and is read from the history when its turn comes, so it is never copied. */
+
+const int OUTBOX_LEN = 256; // messages queued per client by default
+const int OUTBOX_DROP_OLDEST = 0;
+const int OUTBOX_DROP_CLIENT = 1;
+const int OUTBOX_COALESCE = 2;
+
+/* A message waiting for a client, or the rest of a history replay if room is set */
+struct Queued {
+	std::string msg;
+	int room;
+	uint32_t seq; // next message of the replay
+	uint32_t end; // last message of the replay
+	Queued(const char* msg, int len) : msg(msg, len) {
+		this->room = 0;
+		this->seq = 0;
+		this->end = 0;
+	}
+	Queued(int room, uint32_t seq, uint32_t end) {
+		this->room = room;
+		this->seq = seq;
+		this->end = end;
+	}
+};
+
+class Outbox {
+private:
+	std::deque<Queued> msgs;
+	int head_frag; // fragments of the first message already sent
+	unsigned int head_id;
+	long long dropped;
+	long long coalesced;
+	bool send_head(int fd, const sockaddr_in &addr, const char* msg, int len,
+			unsigned int &next_id);
+	template<typename F> bool send_replay(int fd, const sockaddr_in &addr,
+			unsigned int &next_id, Queued &q, F read);
+public:
+	Outbox() {
+		this->head_frag = 0;
+		this->head_id = 0;
+		this->dropped = 0;
+		this->coalesced = 0;
+	}
+	bool send(int fd, const sockaddr_in &addr, unsigned int &next_id, const char* msg,
+			int len, int limit, int policy);
+	template<typename F> void replay(int fd, const sockaddr_in &addr, unsigned int &next_id,
+			int room, uint32_t first, uint32_t end, F read);
+	template<typename F> bool flush(int fd, const sockaddr_in &addr, unsigned int &next_id,
+			F read);
+	bool empty() const;
+	int size() const;
+	long long get_dropped() const;
+	long long get_coalesced() const;
+};
+/* Send what is left of a message; false if the socket is full */
+inline bool Outbox::send_head(int fd, const sockaddr_in &addr, const char* msg, int len,
+		unsigned int &next_id) {
+	bool whole = fits_datagram(msg, len);
+	int count = whole ? 1 : fragment_count(len);
+	if (this->head_frag == 0 && !whole) {
+		this->head_id = next_id++;
+	}
+	char dgram[FRAG_MTU];
+	for (; this->head_frag < count; this->head_frag++) {
+		const char* d = msg;
+		int n = len;
+		if (!whole) {
+			n = make_fragment(dgram, msg, len, this->head_id, this->head_frag);
+			d = dgram;
+		}
+		if (net_sendto(fd, d, n, MSG_DONTWAIT, addr) == -1
+				&& (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+			return false;
+		}
+	}
+	this->head_frag = 0;
+	return true;
+}
+/* Send what is left of a history replay, reading each message with read(room, seq, text,
+ * len) as HistoryLog::read does; false if the socket is full */
+template<typename F> bool Outbox::send_replay(int fd, const sockaddr_in &addr,
+		unsigned int &next_id, Queued &q, F read) {
+	while (q.seq <= q.end) {
+		uint32_t seq = q.seq;
+		const char* text;
+		int len;
+		if (!read(q.room, seq, text, len) || seq > q.end) {
+			break;
+		}
+		if (seq != q.seq) { // gone from the history meanwhile
+			this->head_frag = 0;
+			q.seq = seq;
+		}
+		if (!send_head(fd, addr, text, len, next_id)) {
+			return false;
+		}
+		q.seq++;
+	}
+	this->head_frag = 0;
+	return true;
+}
+/* Send a message now or queue it behind the ones still waiting; false if the client
+ * is over its limit and the policy is to give up on it */
+inline bool Outbox::send(int fd, const sockaddr_in &addr, unsigned int &next_id,
+		const char* msg, int len, int limit, int policy) {
+	if (this->msgs.empty()) {
+		if (send_head(fd, addr, msg, len, next_id)) {
+			return true;
+		}
+		this->msgs.push_back(Queued(msg, len)); // head_frag tells how far it got
+		return true;
+	}
+	if ((int) this->msgs.size() >= limit) {
+		if (policy == OUTBOX_DROP_CLIENT) {
+			this->dropped++;
+			return false;
+		}
+		int busy = this->head_frag > 0 ? 1 : 0; // a partly sent message must stay as it is
+		std::string &last = this->msgs.back().msg; // empty for a replay
+		bool text = len > 0 && (unsigned char) msg[0] >= ' ' && !last.empty()
+				&& (unsigned char) last[0] >= ' '; // control messages stay whole
+		if (policy == OUTBOX_COALESCE && text && (int) this->msgs.size() > busy
+				&& last.size() + 1 + len <= (size_t) MAX_MESSAGE_LEN) {
+			last += '\n';
+			last.append(msg, len);
+			this->coalesced++;
+			return true;
+		}
+		this->dropped++;
+		if ((int) this->msgs.size() == busy) { // nothing older to drop, drop this one
+			return true;
+		}
+		this->msgs.erase(this->msgs.begin() + busy);
+	}
+	this->msgs.push_back(Queued(msg, len));
+	return true;
+}
+/* Replay the messages first .. end of a room's history now, or queue what the socket
+ * does not take; the replay counts as one queued message */
+template<typename F> void Outbox::replay(int fd, const sockaddr_in &addr,
+		unsigned int &next_id, int room, uint32_t first, uint32_t end, F read) {
+	Queued q(room, first, end);
+	if (this->msgs.empty() && send_replay(fd, addr, next_id, q, read)) {
+		return;
+	}
+	this->msgs.push_back(q);
+}
+/* Send queued messages until the socket is full; true once the queue is empty */
+template<typename F> bool Outbox::flush(int fd, const sockaddr_in &addr,
+		unsigned int &next_id, F read) {
+	while (!this->msgs.empty()) {
+		Queued &q = this->msgs.front();
+		if (q.room != 0 ? !send_replay(fd, addr, next_id, q, read)
+				: !send_head(fd, addr, q.msg.data(), q.msg.size(), next_id)) {
+			return false;
+		}
+		this->msgs.pop_front();
+	}
+	return true;
+}
+inline bool Outbox::empty() const {
+	return this->msgs.empty();
+}
+inline int Outbox::size() const {
+	return this->msgs.size();
+}
+inline long long Outbox::get_dropped() const {
+	return this->dropped;
+}
+inline long long Outbox::get_coalesced() const {
+	return this->coalesced;
+}
+
+#endif
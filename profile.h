@@ -0,0 +1,175 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+/* Per stage hardware counters of the message path. With -p a server opens a group of
+ * perf counters for its thread: cycles, instructions, cache misses and branch misses.
+ * Each stage reads the group as it starts and ends and adds up the difference, so a
+ * stage run inside another one, like the fan-out inside an engine, counts for both.
+ * Where the kernel refuses the counters only the clock is kept. A read costs a system
+ * call, so this is for finding where the time goes, not for leaving on. */
+
+const int PROF_COUNTERS = 4;
+const char* const PROF_COUNTER_NAMES[PROF_COUNTERS] = { "cycles", "instructions",
+		"cache misses", "branch misses" };
+const int PROF_MAX_STAGES = 16;
+
+struct ProfSample {
+	long long ns;
+	uint64_t counts[PROF_COUNTERS];
+};
+
+struct ProfStage {
+	long long calls;
+	long long ns;
+	uint64_t counts[PROF_COUNTERS];
+};
+
+class Profiler {
+private:
+	bool on;
+	int leader; // fd of the group, -1 for the clock only
+	int slot[PROF_COUNTERS]; // where each counter comes in a read of the group, -1 if none
+	int opened;
+	ProfStage stages[PROF_MAX_STAGES];
+	void read_sample(ProfSample &s);
+public:
+	Profiler() {
+		this->on = false;
+		this->leader = -1;
+		this->opened = 0;
+		for (int i = 0; i < PROF_COUNTERS; i++) {
+			this->slot[i] = -1;
+		}
+		this->reset();
+	}
+	bool open();
+	bool enabled() const;
+	bool counting() const;
+	void reset();
+	void start(ProfSample &s);
+	void stop(int stage, const ProfSample &s, bool call = true);
+	const ProfStage& stage(int i) const;
+	std::string report(const char* const names[], int n) const;
+};
+/* Start profiling; false if only the clock is available */
+inline bool Profiler::open() {
+	const uint64_t configs[PROF_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES };
+	this->on = true;
+	for (int i = 0; i < PROF_COUNTERS; i++) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = this->leader == -1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, this->leader, 0);
+		if (fd == -1) {
+			if (this->leader == -1) { // no cycles, no counters at all
+				return false;
+			}
+			continue;
+		}
+		if (this->leader == -1) {
+			this->leader = fd;
+		}
+		this->slot[i] = this->opened++;
+	}
+	ioctl(this->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(this->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+}
+inline bool Profiler::enabled() const {
+	return this->on;
+}
+inline bool Profiler::counting() const {
+	return this->leader != -1;
+}
+inline void Profiler::reset() {
+	memset(this->stages, 0, sizeof(this->stages));
+}
+inline void Profiler::read_sample(ProfSample &s) {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	s.ns = t.tv_sec * 1000000000LL + t.tv_nsec;
+	uint64_t values[1 + PROF_COUNTERS] = { };
+	if (this->leader != -1
+			&& read(this->leader, values, sizeof(values)) < (ssize_t) sizeof(uint64_t)) {
+		values[0] = 0;
+	}
+	for (int i = 0; i < PROF_COUNTERS; i++) {
+		s.counts[i] = this->slot[i] == -1 || this->slot[i] >= values[0] ?
+				0 : values[1 + this->slot[i]];
+	}
+}
+/* Mark the start of a stage */
+inline void Profiler::start(ProfSample &s) {
+	if (this->on) {
+		this->read_sample(s);
+	}
+}
+/* Add what passed since the start to a stage; a stage measured in several pieces
+ * counts the call with one of them only */
+inline void Profiler::stop(int stage, const ProfSample &s, bool call) {
+	if (!this->on) {
+		return;
+	}
+	ProfSample end;
+	this->read_sample(end);
+	ProfStage &p = this->stages[stage];
+	p.calls += call;
+	p.ns += end.ns - s.ns;
+	for (int i = 0; i < PROF_COUNTERS; i++) {
+		p.counts[i] += end.counts[i] - s.counts[i];
+	}
+}
+/* What a stage added up so far */
+inline const ProfStage& Profiler::stage(int i) const {
+	return this->stages[i];
+}
+/* One line per stage that ran, with its averages per call */
+inline std::string Profiler::report(const char* const names[], int n) const {
+	std::string lines = this->leader != -1 ? "+OK Per call: ns" : "+OK Per call (no counters): ns";
+	for (int i = 0; i < PROF_COUNTERS; i++) {
+		if (this->slot[i] != -1) {
+			lines += std::string(", ") + PROF_COUNTER_NAMES[i];
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		const ProfStage &p = this->stages[i];
+		if (p.calls == 0) {
+			continue;
+		}
+		char line[256];
+		int len = snprintf(line, sizeof(line), "\n%s %lld calls, %.0f", names[i], p.calls,
+				(double) p.ns / p.calls);
+		for (int j = 0; j < PROF_COUNTERS; j++) {
+			if (this->slot[j] != -1) {
+				len += snprintf(line + len, sizeof(line) - len, ", %.1f",
+						(double) p.counts[j] / p.calls);
+			}
+		}
+		if (this->slot[0] != -1 && this->slot[1] != -1 && p.counts[0] > 0) {
+			snprintf(line + len, sizeof(line) - len, " (%.2f IPC)",
+					(double) p.counts[1] / p.counts[0]);
+		}
+		lines += line;
+	}
+	return lines;
+}
+
+#endif
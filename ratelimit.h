@@ -0,0 +1,77 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+
+/* Token buckets limiting how fast clients and rooms may post. A bucket holds up to burst
+ * tokens and gains rate tokens per second; a post takes one. Buckets are two words kept
+ * inline in their client or room, refilled lazily when they are checked, so checking
+ * allocates nothing and a bucket that never runs dry costs one comparison. */
+
+struct TokenBucket {
+	double tokens;
+	long long last; // when tokens was last brought up to date, 0 for a full bucket
+	TokenBucket() {
+		this->tokens = 0;
+		this->last = 0;
+	}
+};
+
+class RateLimit {
+private:
+	double rate; // tokens per second, 0 for no limit
+	double burst;
+public:
+	RateLimit() {
+		this->rate = 0;
+		this->burst = 0;
+	}
+	bool parse(const char* spec);
+	bool enabled() const;
+	bool ready(TokenBucket &b, long long now) const;
+	void take(TokenBucket &b) const;
+	long long wait(const TokenBucket &b, long long now) const;
+};
+/* Read "rate[:burst]", the burst defaulting to one second's worth */
+inline bool RateLimit::parse(const char* spec) {
+	double r = 0, b = 0;
+	int n = sscanf(spec, "%lf:%lf", &r, &b);
+	if (n < 1 || r <= 0 || (n == 2 && b < 1)) {
+		return false;
+	}
+	this->rate = r;
+	this->burst = n == 2 ? b : (r < 1 ? 1 : r);
+	return true;
+}
+inline bool RateLimit::enabled() const {
+	return this->rate > 0;
+}
+/* Refill a bucket; true if it has a token to take */
+inline bool RateLimit::ready(TokenBucket &b, long long now) const {
+	if (this->rate <= 0) {
+		return true;
+	}
+	if (b.last == 0) {
+		b.tokens = this->burst;
+	} else if (b.tokens < this->burst) {
+		b.tokens += (now - b.last) * this->rate / 1e6;
+		b.tokens = b.tokens > this->burst ? this->burst : b.tokens;
+	}
+	b.last = now;
+	return b.tokens >= 1;
+}
+inline void RateLimit::take(TokenBucket &b) const {
+	if (this->rate > 0) {
+		b.tokens -= 1;
+	}
+}
+/* Microseconds until a bucket refilled by ready has a token again */
+inline long long RateLimit::wait(const TokenBucket &b, long long now) const {
+	if (this->rate <= 0 || b.last == 0 || b.tokens >= 1) {
+		return 0;
+	}
+	long long w = b.last + (long long) ((1 - b.tokens) * 1e6 / this->rate) + 1 - now;
+	return w < 0 ? 0 : w;
+}
+
+#endif
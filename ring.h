@@ -0,0 +1,61 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+/* A queue in a circular buffer, for the per-room backlogs kept of recent multicasts.
+ * Popped slots are reused as they are, so a string assigned to one keeps the capacity
+ * it had and a queue that stays about the same length allocates nothing. When full, the
+ * buffer doubles. */
+
+template<typename T> class Ring {
+private:
+	std::vector<T> slots;
+	size_t head;
+	size_t count;
+public:
+	Ring() {
+		this->head = 0;
+		this->count = 0;
+	}
+	bool empty() const;
+	size_t size() const;
+	T& front();
+	T& operator[](size_t i);
+	T& push_back();
+	void pop_front();
+};
+template<typename T> inline bool Ring<T>::empty() const {
+	return this->count == 0;
+}
+template<typename T> inline size_t Ring<T>::size() const {
+	return this->count;
+}
+template<typename T> inline T& Ring<T>::front() {
+	return this->slots[this->head];
+}
+/* The i-th oldest entry */
+template<typename T> inline T& Ring<T>::operator[](size_t i) {
+	return this->slots[(this->head + i) % this->slots.size()];
+}
+/* Make room for a new newest entry and return it, still holding whatever its slot held
+ * before; the caller overwrites it */
+template<typename T> inline T& Ring<T>::push_back() {
+	if (this->count == this->slots.size()) {
+		std::vector<T> grown(this->slots.empty() ? 8 : this->slots.size() * 2);
+		for (size_t i = 0; i < this->count; i++) {
+			grown[i] = std::move((*this)[i]);
+		}
+		this->slots.swap(grown);
+		this->head = 0;
+	}
+	return this->slots[(this->head + this->count++) % this->slots.size()];
+}
+template<typename T> inline void Ring<T>::pop_front() {
+	this->head = (this->head + 1) % this->slots.size();
+	this->count--;
+}
+
+#endif
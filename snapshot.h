@@ -0,0 +1,268 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/* On-disk snapshot of a chatserver's state (-S). The file is SNAP_MAGIC, SNAP_VERSION and
+ * a series of sections [uint8 type][int32 key][uint32 length][bytes], each built by the
+ * server with a SnapWriter and cached until its part of the state changes. The server
+ * hands the sections to a SnapshotWriter, whose thread writes them into a mapped
+ * temporary file that is renamed over the last one, so a crash leaves either the old or
+ * the new snapshot and the event loop never waits for the disk. All fields are in host
+ * byte order. */
+
+const char SNAP_MAGIC[4] = { 'C', 'H', 'S', 'N' };
+const uint16_t SNAP_VERSION = 6;
+
+/* Builds a section */
+class SnapWriter {
+private:
+	std::string &out;
+public:
+	SnapWriter(std::string &out, uint8_t type, int32_t key) :
+			out(out) {
+		this->out.clear();
+		put_raw(&type, sizeof(type));
+		put_raw(&key, sizeof(key));
+		uint32_t len = 0;
+		put_raw(&len, sizeof(len)); // patched by finish
+	}
+	void put_raw(const void* p, size_t n) {
+		this->out.append((const char*) p, n);
+	}
+	void put_int(int32_t v) {
+		put_raw(&v, sizeof(v));
+	}
+	void put_ll(int64_t v) {
+		put_raw(&v, sizeof(v));
+	}
+	void put_str(const std::string &s) {
+		put_int(s.size());
+		put_raw(s.data(), s.size());
+	}
+	void finish() {
+		uint32_t len = this->out.size() - 9;
+		memcpy(&this->out[5], &len, sizeof(len));
+	}
+};
+
+/* Reads the fields of a section; a read past its end yields zeros and clears ok */
+class SnapReader {
+private:
+	const char* p;
+	const char* end;
+public:
+	bool ok;
+	SnapReader(const char* p, size_t n) {
+		this->p = p;
+		this->end = p + n;
+		this->ok = true;
+	}
+	bool get_raw(void* v, size_t n) {
+		if (!this->ok || (size_t) (this->end - this->p) < n) {
+			this->ok = false;
+			memset(v, 0, n);
+			return false;
+		}
+		memcpy(v, this->p, n);
+		this->p += n;
+		return true;
+	}
+	int32_t get_int() {
+		int32_t v;
+		get_raw(&v, sizeof(v));
+		return v;
+	}
+	int64_t get_ll() {
+		int64_t v;
+		get_raw(&v, sizeof(v));
+		return v;
+	}
+	std::string get_str() {
+		int32_t n = get_int();
+		if (n < 0 || (size_t) n > (size_t) (this->end - this->p)) {
+			this->ok = false;
+			return "";
+		}
+		std::string s(this->p, n);
+		this->p += n;
+		return s;
+	}
+};
+
+/* A finished section. The server replaces a section rather than changing it, so one
+ * handed to the writer stays as it was until the writer lets go of it */
+typedef std::shared_ptr<const std::string> Section;
+
+/* Write the sections into a new snapshot at path */
+inline bool write_snapshot(const char* path, const std::vector<Section> &sections) {
+	size_t size = sizeof(SNAP_MAGIC) + sizeof(SNAP_VERSION);
+	for (const Section &s : sections) {
+		size += s->size();
+	}
+	std::string tmp = std::string(path) + ".tmp";
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return false;
+	}
+	char* base = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+	char* p = base;
+	memcpy(p, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	p += sizeof(SNAP_MAGIC);
+	memcpy(p, &SNAP_VERSION, sizeof(SNAP_VERSION));
+	p += sizeof(SNAP_VERSION);
+	for (const Section &s : sections) {
+		memcpy(p, s->data(), s->size());
+		p += s->size();
+	}
+	munmap(base, size); // the kernel writes the pages back, we do not wait for it
+	return rename(tmp.c_str(), path) == 0;
+}
+
+/* Writes snapshots on a thread of its own. A snapshot handed over while the last one is
+ * still being written replaces the one waiting, if any, as it holds all that one does */
+class SnapshotWriter {
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread thread;
+	std::string path;
+	std::vector<Section> next;
+	bool waiting;
+	bool stopping;
+	long long failed;
+	void run();
+public:
+	SnapshotWriter() {
+		this->waiting = false;
+		this->stopping = false;
+		this->failed = 0;
+	}
+	~SnapshotWriter() {
+		stop();
+	}
+	void start(const char* path);
+	void submit(std::vector<Section> &sections);
+	void stop();
+	long long get_failed();
+};
+inline void SnapshotWriter::run() {
+	std::unique_lock<std::mutex> l(this->lock);
+	while (true) {
+		this->wake.wait(l, [this] { return this->waiting || this->stopping; });
+		if (!this->waiting) { // stopped, and the last snapshot is written
+			return;
+		}
+		std::vector<Section> sections;
+		sections.swap(this->next);
+		this->waiting = false;
+		l.unlock();
+		bool ok = write_snapshot(this->path.c_str(), sections);
+		sections.clear();
+		l.lock();
+		if (!ok) {
+			this->failed++;
+		}
+	}
+}
+inline void SnapshotWriter::start(const char* path) {
+	this->path = path;
+	this->stopping = false;
+	this->thread = std::thread(&SnapshotWriter::run, this);
+}
+/* Hand over the sections of a snapshot, leaving sections empty */
+inline void SnapshotWriter::submit(std::vector<Section> &sections) {
+	std::lock_guard<std::mutex> l(this->lock);
+	this->next.swap(sections);
+	sections.clear();
+	this->waiting = true;
+	this->wake.notify_one();
+}
+/* Write the snapshot still waiting, if any, and end the thread */
+inline void SnapshotWriter::stop() {
+	if (!this->thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->stopping = true;
+		this->wake.notify_one();
+	}
+	this->thread.join();
+}
+/* Snapshots that could not be written */
+inline long long SnapshotWriter::get_failed() {
+	std::lock_guard<std::mutex> l(this->lock);
+	return this->failed;
+}
+
+/* Map the snapshot at path and hand each section to section(type, key, reader); returns
+ * false if there is no valid snapshot */
+template<typename F> bool load_snapshot(const char* path, F section) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) (sizeof(SNAP_MAGIC)
+			+ sizeof(SNAP_VERSION))) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	const char* base = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+	uint16_t version;
+	memcpy(&version, base + sizeof(SNAP_MAGIC), sizeof(version));
+	bool ok = memcmp(base, SNAP_MAGIC, sizeof(SNAP_MAGIC)) == 0
+			&& version == SNAP_VERSION;
+	size_t off = sizeof(SNAP_MAGIC) + sizeof(SNAP_VERSION);
+	while (ok && off < size) {
+		uint8_t type;
+		int32_t key;
+		uint32_t len;
+		if (size - off < 9) {
+			ok = false;
+			break;
+		}
+		memcpy(&type, base + off, sizeof(type));
+		memcpy(&key, base + off + 1, sizeof(key));
+		memcpy(&len, base + off + 5, sizeof(len));
+		off += 9;
+		if (len > size - off) {
+			ok = false;
+			break;
+		}
+		SnapReader r(base + off, len);
+		ok = section(type, key, r) && r.ok;
+		off += len;
+	}
+	munmap((void*) base, size);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,244 @@
+/* Microbenchmarks of the server's hot paths. The server is compiled into this file, so
+   the benchmarks call its internals directly: client and server lookup, encoding and
+   parsing frames between servers, the fifo, causal and total order engines and the
+   fan-out to clients. Datagrams go to a network that drops them. Each benchmark runs
+   for at least the given time and reports nanoseconds and heap allocations per
+   operation as JSON, so the numbers of two builds can be compared with a diff. */
+
+#define SERVER_LIBRARY
+#include "../chatserver.cc"
+#include "heapcount.h"
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
+
+#define NUM_SERVERS 3
+#define NUM_CLIENTS 10000
+#define FANOUT_CLIENTS 1000
+#define REORDER_WINDOW 8
+
+const char *benchText = "<127.0.0.1:40000> The quick brown fox jumps over the lazy dog";
+
+/* Sockets that swallow everything, with the real clock */
+
+struct NullNet : public Network {
+  int open(const sockaddr_in &addr) { return 3; }
+  void close(int fd) {}
+  ssize_t send(int fd, const char *msg, size_t len, const sockaddr_in &to) { return len; }
+  ssize_t receive(int fd, char *buffer, size_t len, sockaddr_in &from) { errno = EAGAIN; return -1; }
+  int select(int nfds, fd_set *readfds, fd_set *writefds, long long timeout) { return -1; }
+  long long now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+  }
+};
+
+NullNet nullNet;
+long long minMicros = 200000;
+const char *only = NULL;
+bool first = true;
+
+sockaddr_in clientAddr(int i)
+{
+  sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(0x0a000000 + i / 50000);
+  addr.sin_port = htons(1024 + i % 50000);
+  return addr;
+}
+
+/* Start over with a server 1 of NUM_SERVERS, no clients and no rooms */
+
+void resetServer()
+{
+  CLIENTS = ClientTable();
+  ROOMS.clear();
+  SERVERS.clear();
+  ACTIVE.clear();
+  AGREED.clear();
+  AGREED_ORDER.clear();
+  BACKLOGGED.clear();
+  SLOW.clear();
+  SELF_IDX = 1;
+  grow_servers(NUM_SERVERS);
+  for (int i=0; i<NUM_SERVERS; i++) {
+    SERVERS[i].sin_family = AF_INET;
+    SERVERS[i].sin_addr.s_addr = htonl(0x7f000001);
+    SERVERS[i].sin_port = htons(8000 + i);
+    ACTIVE[i] = true;
+  }
+}
+
+/* A room the other servers are interested in and have told us where they start */
+
+Room &benchRoom(int room, int order)
+{
+  Room &r = get_room(room);
+  r.order = order;
+  for (int i=0; i<NUM_SERVERS; i++) {
+    r.interested[i] = true;
+    r.baseline[i] = true;
+  }
+  return r;
+}
+
+/* Run op(i) for i = 0, 1, ... in batches, doubling until a batch takes minMicros,
+   and report that batch */
+
+template<typename Op> void run(const char *name, Op op)
+{
+  if (only != NULL && strcmp(only, name) != 0)
+    return;
+  long long iterations = 1, ns = 0, allocs = 0, next = 0;
+  while (true) {
+    long long allocsBefore = heapAllocs;
+    long long start = now_ns();
+    for (long long i=0; i<iterations; i++)
+      op(next ++);
+    ns = now_ns() - start;
+    allocs = heapAllocs - allocsBefore;
+    if (ns >= minMicros * 1000)
+      break;
+    iterations *= 2;
+  }
+  printf("%s\n    { \"name\": \"%s\", \"iterations\": %lld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f }",
+    first ? "" : ",", name, iterations, (double) ns / iterations, (double) allocs / iterations);
+  first = false;
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+  while ((c = getopt(argc, argv, "b:t:")) != -1) {
+    switch (c) {
+      case 'b':
+        only = optarg;
+        break;
+      case 't':
+        minMicros = atoll(optarg) * 1000LL;
+        break;
+      default:
+        panic("Syntax: %s [-b benchmark] [-t minMillisecondsPerBenchmark]", argv[0]);
+    }
+  }
+
+  NET = &nullNet;
+  ORDER = UNORDERED;
+  TOTAL_EPOCH = net_time();
+  IDLE_WHEEL.start(now_us() / 1000000);
+  ROOM_WHEEL.start(now_us() / 1000000);
+  Proposals proposals;
+  printf("{\n  \"benchmarks\": [");
+
+  /* Classifying datagrams */
+
+  resetServer();
+  for (int i=0; i<NUM_CLIENTS; i++)
+    CLIENTS.add(Client(clientAddr(i)));
+  run("is_client", [](long long i) {
+    ClientId id;
+    int room;
+    if (!is_client(clientAddr(i % NUM_CLIENTS), id, room))
+      panic("Client %lld not found", i % NUM_CLIENTS);
+  });
+  run("is_server", [](long long i) {
+    int idx;
+    if (!is_server(SERVERS[NUM_SERVERS - 1], idx))
+      panic("Server not found");
+  });
+
+  /* Frames between servers */
+
+  run("frame_encode", [](long long i) {
+    char frame[FRAME_LEN + 1];
+    encode_frame(frame, i, "1700000000000000:1", PLAIN_MSG + FIFO, 0, 1, benchText);
+  });
+  char frameTemplate[FRAME_LEN + 1];
+  encode_frame(frameTemplate, 12345, "1700000000000000:1", PLAIN_MSG + FIFO, 0, 1, benchText);
+  int frameLen = strlen(frameTemplate);
+  run("frame_parse", [&](long long i) { // parsing is in place, so this copies the frame too
+    char buffer[FRAME_LEN + 1];
+    memcpy(buffer, frameTemplate, frameLen + 1);
+    Frame f;
+    parse_frame(2, buffer, frameLen, f);
+  });
+
+  /* Fifo: server 2's messages come in reversed windows, so most are held back first */
+
+  resetServer();
+  Room &fifoRoom = benchRoom(1, FIFO);
+  fifoRoom.epoch[1] = 1;
+  run("do_fifo_reorder", [&](long long i) {
+    long long window = i / REORDER_WINDOW;
+    int id = window * REORDER_WINDOW + REORDER_WINDOW - i % REORDER_WINDOW;
+    char clock[32] = "1:1";
+    char text[128];
+    strcpy(text, benchText);
+    Frame f = { 2, id, clock, PLAIN_MSG + FIFO, 0, 1, text };
+    FifoEngine::receive(f, fifoRoom);
+  });
+
+  /* Causal: server 3's message depends on one of server 2's that comes after it */
+
+  resetServer();
+  Room &causalRoom = benchRoom(1, CAUSAL);
+  run("do_causal", [&](long long i) {
+    long long k = i / 2 + 1;
+    char clock[64];
+    char text[128];
+    strcpy(text, benchText);
+    if (i % 2 == 0)
+      sprintf(clock, "0$%lld$%lld", k, k);
+    else
+      sprintf(clock, "0$%lld$%lld", k, k - 1);
+    Frame f = { i % 2 == 0 ? 3 : 2, 0, clock, PLAIN_MSG + CAUSAL, 0, 1, text };
+    CausalEngine::receive(f, causalRoom);
+  });
+
+  /* Total: a message of server 2 through both phases we take part in, and one of ours
+     through the proposals of every server */
+
+  resetServer();
+  Room &totalRoom = benchRoom(1, TOTAL);
+  run("do_total_remote", [&](long long i) {
+    char key[64];
+    char text[128];
+    strcpy(text, benchText);
+    sprintf(key, "2:1:%lld", i + 1);
+    Frame f = { 2, 0, key, NEW_MSG, 0, 1, text };
+    TotalEngine::receive(f, totalRoom, proposals);
+    Frame a = { 2, totalRoom.proposed, key, AGREEMENT, 2, 1, (char*) "" };
+    TotalEngine::receive(a, totalRoom, proposals);
+  });
+  run("do_total_origin", [&](long long i) {
+    char frame[FRAME_LEN + 1];
+    if (!TotalEngine::post(1, totalRoom, benchText, frame, proposals))
+      panic("Total order post refused");
+    char key[64];
+    sprintf(key, "%d:%lld:%u", SELF_IDX, TOTAL_EPOCH, TOTAL_SEQ);
+    for (int s=1; s<=NUM_SERVERS; s++) {
+      Frame p = { s, (int) i + s, key, PROPOSAL, s, 1, (char*) "" };
+      TotalEngine::receive(p, totalRoom, proposals);
+    }
+    if (AGREED.size() > 100000) { // expired after AGREED_KEEP in a server
+      AGREED.clear();
+      AGREED_ORDER.clear();
+    }
+  });
+
+  /* Fan-out of one message to the clients in a room */
+
+  resetServer();
+  for (int i=0; i<FANOUT_CLIENTS; i++) {
+    ClientId id = CLIENTS.add(Client(clientAddr(i)));
+    join_room(*CLIENTS.get(id), 1);
+  }
+  run("forward_client_1000", [](long long i) {
+    forward_client(1, benchText);
+  });
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
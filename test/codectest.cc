@@ -0,0 +1,343 @@
+/* Tests of the codecs of the wire: splitting long messages into fragments and
+   reassembling them, which servers and clients share, and the compression of datagrams
+   between servers. The fragment tests send messages over a network that keeps the
+   datagrams, then hand them back in whatever order they need. Prints one line per test
+   and exits non-zero if any failed. */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../fragment.h"
+#include "../compress.h"
+
+#define expect(cond, a...) do { if (!(cond)) { printf("FAIL %s: ", testName); printf(a); printf("\n"); failed = true; } } while (0)
+
+/* Sockets that keep what is sent, for the tests to hand back */
+
+struct CaptureNet : public Network {
+  std::vector<std::string> sent;
+
+  int open(const sockaddr_in &addr) { return 3; }
+  void close(int fd) {}
+  ssize_t send(int fd, const char *msg, size_t len, const sockaddr_in &to) {
+    sent.push_back(std::string(msg, len));
+    return len;
+  }
+  ssize_t receive(int fd, char *buffer, size_t len, sockaddr_in &from) { errno = EAGAIN; return -1; }
+  int select(int nfds, fd_set *readfds, fd_set *writefds, long long timeout) { return -1; }
+  long long now() { return 0; }
+};
+
+CaptureNet captureNet;
+const char *testName = "";
+bool failed = false;
+
+sockaddr_in makeAddr(const char *ip, int port)
+{
+  sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_aton(ip, &addr.sin_addr);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+/* A message of len bytes that differs from position to position, so a fragment in the
+   wrong place shows */
+
+std::string makeMessage(int len)
+{
+  std::string msg(len, ' ');
+  for (int i=0; i<len; i++)
+    msg[i] = 'a' + (i * 7 + i / 26) % 26;
+  return msg;
+}
+
+/* The datagrams a message goes out as */
+
+std::vector<std::string> fragment(const std::string &msg)
+{
+  unsigned int nextId = 1;
+  captureNet.sent.clear();
+  send_fragmented(3, msg.data(), msg.size(), makeAddr("127.0.0.1", 5000), nextId);
+  return captureNet.sent;
+}
+
+/* Hand datagrams to a reassembler in the given order; true with the message if the
+   last one completed it, and none before */
+
+bool reassemble(Reassembler &r, const sockaddr_in &from, const std::vector<std::string> &dgrams,
+  const std::vector<int> &order, std::string &msg)
+{
+  for (size_t i=0; i<order.size(); i++) {
+    const std::string &d = dgrams[order[i]];
+    if (r.add(from, d.data(), d.size(), 0, msg) != (i == order.size() - 1))
+      return false;
+  }
+  return true;
+}
+
+std::vector<int> inOrder(int n)
+{
+  std::vector<int> order;
+  for (int i=0; i<n; i++)
+    order.push_back(i);
+  return order;
+}
+
+/* Messages up to one datagram go out as they are, longer ones in fragments of at most
+   FRAG_MTU bytes that reassemble into the message */
+
+void testFragmentRoundTrip()
+{
+  const int lens[] = { 0, 1, FRAG_MTU - 1, FRAG_MTU, FRAG_MTU + 1, 3 * (FRAG_MTU - FRAG_HEADER_LEN), MAX_MESSAGE_LEN };
+  sockaddr_in from = makeAddr("10.0.0.1", 4000);
+  for (size_t k=0; k<sizeof(lens)/sizeof(lens[0]); k++) {
+    std::string msg = makeMessage(lens[k]);
+    std::vector<std::string> dgrams = fragment(msg);
+    if (lens[k] <= FRAG_MTU) {
+      expect(dgrams.size() == 1 && dgrams[0] == msg, "a message of %d bytes did not go out as it is", lens[k]);
+      continue;
+    }
+    expect((int) dgrams.size() == fragment_count(lens[k]), "a message of %d bytes went out as %d fragments",
+      lens[k], (int) dgrams.size());
+    for (size_t i=0; i<dgrams.size(); i++)
+      expect(dgrams[i].size() <= (size_t) FRAG_MTU && dgrams[i][0] == FRAG_MARK,
+        "fragment %d of a message of %d bytes is %d bytes", (int) i, lens[k], (int) dgrams[i].size());
+    Reassembler r;
+    std::string whole;
+    expect(reassemble(r, from, dgrams, inOrder(dgrams.size()), whole) && whole == msg,
+      "a message of %d bytes was not reassembled", lens[k]);
+    expect(r.get_bytes() == 0, "%lld bytes left behind", r.get_bytes());
+  }
+}
+
+/* A short message that starts like a fragment is sent as one, so it is not mistaken for
+   one */
+
+void testFragmentMark()
+{
+  std::string msg = std::string(1, FRAG_MARK) + "1:0:1:hello";
+  std::vector<std::string> dgrams = fragment(msg);
+  expect(dgrams.size() == 1 && dgrams[0] != msg, "a message that looks like a fragment went out as it is");
+  Reassembler r;
+  std::string whole;
+  expect(reassemble(r, makeAddr("10.0.0.1", 4000), dgrams, inOrder(1), whole) && whole == msg,
+    "a message that looks like a fragment was not reassembled");
+}
+
+/* Fragments are put together whatever order they come in, a duplicate is ignored, and
+   two senders that picked the same id are kept apart */
+
+void testFragmentOrder()
+{
+  sockaddr_in from = makeAddr("10.0.0.1", 4000);
+  sockaddr_in other = makeAddr("10.0.0.2", 4000);
+  std::string msg = makeMessage(5 * (FRAG_MTU - FRAG_HEADER_LEN) - 10);
+  std::string otherMsg = makeMessage(5 * (FRAG_MTU - FRAG_HEADER_LEN));
+  std::reverse(otherMsg.begin(), otherMsg.end());
+  std::vector<std::string> dgrams = fragment(msg);
+  std::vector<std::string> otherDgrams = fragment(otherMsg);
+  Reassembler r;
+  std::string whole;
+  int order[] = { 3, 0, 4, 1, 2 };
+  for (int i=0; i<5; i++) {
+    bool last = i == 4;
+    expect(r.add(from, dgrams[order[i]].data(), dgrams[order[i]].size(), 0, whole) == last,
+      "fragment %d of 5 completed the message", i + 1);
+    if (!last) {
+      expect(!r.add(from, dgrams[order[i]].data(), dgrams[order[i]].size(), 0, whole),
+        "a duplicate fragment completed the message");
+      expect(!r.add(other, otherDgrams[order[i]].data(), otherDgrams[order[i]].size(), 0, whole),
+        "another sender's fragment completed the message");
+    }
+  }
+  expect(whole == msg, "fragments out of order were put together wrongly");
+  expect(r.add(other, otherDgrams[2].data(), otherDgrams[2].size(), 0, whole) && whole == otherMsg,
+    "another sender's message with the same id was not kept apart");
+}
+
+/* A message missing a fragment is never delivered, and is dropped once it is older than
+   REASSEMBLY_TIMEOUT */
+
+void testFragmentMissing()
+{
+  sockaddr_in from = makeAddr("10.0.0.1", 4000);
+  std::vector<std::string> dgrams = fragment(makeMessage(3 * (FRAG_MTU - FRAG_HEADER_LEN)));
+  Reassembler r;
+  std::string whole;
+  long long now = 1000000;
+  for (size_t i=0; i<dgrams.size(); i++)
+    if (i != 1)
+      expect(!r.add(from, dgrams[i].data(), dgrams[i].size(), now, whole), "a message missing a fragment was delivered");
+  expect(r.get_bytes() > 0, "the fragments that came were not kept");
+
+  r.expire(now + REASSEMBLY_TIMEOUT);
+  expect(r.get_dropped() == 0 && r.get_bytes() > 0, "a partial message was dropped before its time");
+  r.expire(now + REASSEMBLY_TIMEOUT + 1000000);
+  expect(r.get_dropped() == 1 && r.get_bytes() == 0, "a partial message was kept past its time");
+  expect(!r.add(from, dgrams[1].data(), dgrams[1].size(), now + REASSEMBLY_TIMEOUT + 1000000, whole),
+    "the missing fragment completed a message that was dropped");
+}
+
+/* Partial messages take at most REASSEMBLY_BYTES, the oldest given up first, and
+   datagrams that claim more fragments than the largest message has are refused */
+
+void testFragmentCap()
+{
+  std::vector<std::string> dgrams = fragment(makeMessage(MAX_MESSAGE_LEN));
+  Reassembler r;
+  std::string whole;
+  int senders = 2 * REASSEMBLY_BYTES / MAX_MESSAGE_LEN;
+  for (int s=0; s<senders; s++) {
+    sockaddr_in from = makeAddr("10.0.0.1", 4000 + s);
+    for (size_t i=0; i+1<dgrams.size(); i++)
+      r.add(from, dgrams[i].data(), dgrams[i].size(), s, whole);
+    expect(r.get_bytes() <= REASSEMBLY_BYTES, "%lld bytes held with %d senders", r.get_bytes(), s + 1);
+  }
+  expect(r.get_dropped() > 0, "no partial message was given up over the budget");
+
+  sockaddr_in last = makeAddr("10.0.0.1", 4000 + senders - 1);
+  const std::string &d = dgrams.back();
+  expect(r.add(last, d.data(), d.size(), senders, whole) && whole == makeMessage(MAX_MESSAGE_LEN),
+    "the newest message was given up for older ones");
+  sockaddr_in first = makeAddr("10.0.0.1", 4000);
+  expect(!r.add(first, d.data(), d.size(), senders, whole), "the oldest message was not given up");
+
+  char header[64];
+  int n = snprintf(header, sizeof(header), "%c1:0:%d:x", FRAG_MARK, 2 * MAX_MESSAGE_LEN / (FRAG_MTU - FRAG_HEADER_LEN));
+  expect(!r.add(first, header, n, 0, whole) && r.get_bytes() < REASSEMBLY_BYTES,
+    "a fragment of a message longer than MAX_MESSAGE_LEN was taken");
+}
+
+/* Bytes that do not compress, the same on every run */
+
+std::string noise(int len, unsigned int seed)
+{
+  std::string s(len, 0);
+  for (int i=0; i<len; i++) {
+    seed = seed * 1103515245 + 12345;
+    s[i] = seed >> 16;
+  }
+  return s;
+}
+
+/* Compress and decompress; true if the result is the input. A byte past each buffer
+   shows a write beyond its cap */
+
+bool zipRoundTrip(const std::string &in, int &zipped)
+{
+  int cap = 2 * in.size() + 16;
+  std::vector<char> block(cap + 1, '#');
+  zipped = zip_compress(in.data(), in.size(), block.data(), cap);
+  if (zipped < 0 || block[cap] != '#')
+    return false;
+  std::vector<char> out(in.size() + 1, '#');
+  int n = zip_decompress(block.data(), zipped, out.data(), in.size());
+  return n == (int) in.size() && out[in.size()] == '#' && memcmp(out.data(), in.data(), n) == 0;
+}
+
+/* Blocks decompress into what was compressed: empty, short, one datagram and the
+   largest message, of chat text, of one repeated byte (matches that overlap and lengths
+   that take extra bytes), and of noise (long runs of literals) */
+
+void testZipRoundTrip()
+{
+  std::string chat;
+  while (chat.size() < (size_t) MAX_MESSAGE_LEN)
+    chat += "<127.0.0.1:" + std::to_string(40000 + chat.size() % 7) + "> The quick brown fox jumps over the lazy dog\n";
+  struct { const char *what; std::string in; bool smaller; } cases[] = {
+    { "empty", "", false },
+    { "short", "hello", false },
+    { "one datagram of chat", chat.substr(0, FRAG_MTU), true },
+    { "the largest message of chat", chat.substr(0, MAX_MESSAGE_LEN), true },
+    { "one repeated byte", std::string(MAX_MESSAGE_LEN, 'x'), true },
+    { "noise", noise(MAX_MESSAGE_LEN, 1), false },
+    { "noise then repeats", noise(1000, 2) + std::string(1000, 'y') + noise(300, 3), false },
+  };
+  for (size_t i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    int zipped = 0;
+    expect(zipRoundTrip(cases[i].in, zipped), "%s did not come back as it was", cases[i].what);
+    expect(!cases[i].smaller || zipped < (int) cases[i].in.size() / 2, "%s only compressed from %d to %d bytes",
+      cases[i].what, (int) cases[i].in.size(), zipped);
+  }
+}
+
+/* What does not fit the cap is refused rather than written past it, in both directions */
+
+void testZipLimits()
+{
+  std::string in = noise(FRAG_MTU, 4);
+  std::vector<char> block(in.size() + 1, '#');
+  int cap = in.size() - 2; // as the server asks, to send it compressed only if it saves
+  expect(zip_compress(in.data(), in.size(), block.data(), cap) == -1 && block[cap] == '#',
+    "noise was compressed into less than its size");
+
+  std::string text(4000, 'z');
+  int zipped = zip_compress(text.data(), text.size(), block.data(), block.size() - 1);
+  expect(zipped > 0, "a repeated byte did not compress");
+  std::vector<char> out(text.size(), '#');
+  expect(zip_decompress(block.data(), zipped, out.data(), text.size() - 1) == -1 && out[text.size() - 1] == '#',
+    "a block was decompressed beyond the cap");
+}
+
+/* Corrupt blocks are refused, or at least decompress within the cap: a block cut short
+   anywhere, a match before the start of the output, and a match with offset 0 */
+
+void testZipCorrupt()
+{
+  std::string in = "<a> hello hello hello hello, and hello again " + noise(100, 5) + std::string(300, 'q');
+  std::vector<char> block(2 * in.size());
+  int zipped = zip_compress(in.data(), in.size(), block.data(), block.size());
+  std::vector<char> out(in.size() + 1);
+  for (int len=0; len<zipped; len++) {
+    out[in.size()] = '#';
+    int n = zip_decompress(block.data(), len, out.data(), in.size());
+    expect(n <= (int) in.size() && out[in.size()] == '#', "a block cut to %d bytes went past the cap", len);
+  }
+  const char before[] = { 0x10, 'a', 5, 0 }; // one literal, then a match 5 bytes back
+  expect(zip_decompress(before, sizeof(before), out.data(), in.size()) == -1,
+    "a match before the start of the output was taken");
+  const char zero[] = { 0x10, 'a', 0, 0 };
+  expect(zip_decompress(zero, sizeof(zero), out.data(), in.size()) == -1, "a match with offset 0 was taken");
+}
+
+struct Test {
+  const char *name;
+  void (*run)();
+};
+
+Test tests[] = {
+  { "fragment_round_trip", testFragmentRoundTrip },
+  { "fragment_mark", testFragmentMark },
+  { "fragment_order", testFragmentOrder },
+  { "fragment_missing", testFragmentMissing },
+  { "fragment_cap", testFragmentCap },
+  { "zip_round_trip", testZipRoundTrip },
+  { "zip_limits", testZipLimits },
+  { "zip_corrupt", testZipCorrupt },
+};
+
+int main(int argc, char *argv[])
+{
+  NET = &captureNet;
+  int numFailed = 0;
+  for (size_t i=0; i<sizeof(tests)/sizeof(tests[0]); i++) {
+    testName = tests[i].name;
+    failed = false;
+    tests[i].run();
+    printf("%s %s\n", failed ? "FAIL" : "PASS", testName);
+    numFailed += failed;
+  }
+  if (numFailed > 0) {
+    printf("%d of %d tests failed\n", numFailed, (int) (sizeof(tests)/sizeof(tests[0])));
+    return 1;
+  }
+  printf("All %d tests passed\n", (int) (sizeof(tests)/sizeof(tests[0])));
+  return 0;
+}
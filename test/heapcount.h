@@ -0,0 +1,32 @@
+/* Counts the heap allocations of each thread by replacing operator new, so a benchmark
+   or a test can tell when a path of the server starts to allocate. Include it in one
+   file of a program only. */
+
+#ifndef HEAPCOUNT_H
+#define HEAPCOUNT_H
+
+#include <stdlib.h>
+#include <new>
+
+thread_local long long heapAllocs;
+
+void *operator new(size_t n)
+{
+  heapAllocs ++;
+  void *p = malloc(n == 0 ? 1 : n);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+#endif
@@ -7,6 +7,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <signal.h>
+#include <math.h>
 
 #define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
 #define logVerbose(a...) do { if (verbose) { fprintf(stderr, a); fprintf(stderr, "\n"); } } while (0)
@@ -14,8 +16,13 @@
 #define log(a...) do { struct timeval tv; gettimeofday(&tv, NULL); fprintf(stderr, "PRX %d.%03d ", (int)tv.tv_sec, (int)(tv.tv_usec/1000)); fprintf(stderr, a); fprintf(stderr, "\n"); } while(0)
 
 #define MAX_SERVERS 10
-#define MAX_MSG_LEN 1000
-#define MAX_QUEUE_LEN 1000
+#define MAX_MSG_LEN 2000
+#define MAX_QUEUE_LEN 10000
+#define NUM_DELAY_BUCKETS 32
+
+#define DIST_UNIFORM 0
+#define DIST_NORMAL 1
+#define DIST_EXPONENTIAL 2
 
 struct {
   in_addr_t ip;
@@ -29,12 +36,47 @@ struct {
   int srcServerIdx;
   int dstServerIdx;
   long long xmitTime;
+  long long enqueueSeq;          // breaks ties between packets due at the same time
+  int length;
   char buffer[MAX_MSG_LEN];
 } holdbackQueue[MAX_QUEUE_LEN];
+int dueList[MAX_QUEUE_LEN];
+
+/* Model of the (directed) link between two servers. The defaults reproduce the
+   old behavior: a uniform delay in [0, maxDelay), independent per packet */
+
+struct {
+  long long baseDelayMicros;
+  long long jitterMicros;
+  int distribution;
+  double lossProbability;
+  long long bandwidthBps;        // bits per second, 0 means unlimited
+  long long queueLimitBytes;     // tail drop beyond this backlog, 0 means unlimited
+  double reorderProbability;     // chance that a packet may overtake earlier ones
+
+  long long busyUntil;           // when the link finishes serializing its backlog
+  long long lastXmitTime;
+
+  long long numPackets;
+  long long numBytes;
+  long long numLost;
+  long long numQueueDrops;
+  long long numReordered;
+  long long sumQueueMicros;
+  long long maxQueueMicros;
+  long long queueHistogram[NUM_DELAY_BUCKETS];
+} linkModel[MAX_SERVERS][MAX_SERVERS];
 
 int numServers = 0;
 int queueLength = 0;
+long long nextEnqueueSeq = 0;
 bool verbose = false;
+volatile bool running = true;
+
+void sigHandler(int arg)
+{
+  running = false;
+}
 
 int findServer(in_addr_t ip, int port, bool useBind)
 {
@@ -76,20 +118,252 @@ void deliverQueuedMessage(int idx)
     holdbackQueue[idx].buffer
   );
 
-  int w = sendto(server[holdbackQueue[idx].srcServerIdx].proxySocket, holdbackQueue[idx].buffer, strlen(holdbackQueue[idx].buffer), 0, (struct sockaddr*)&target, sizeof(target));
+  int w = sendto(server[holdbackQueue[idx].srcServerIdx].proxySocket, holdbackQueue[idx].buffer, holdbackQueue[idx].length, 0, (struct sockaddr*)&target, sizeof(target));
   if (w<0)
     panic("sendto() failed (%s)", strerror(errno));
 }
 
+int compareDue(const void *a, const void *b)
+{
+  int i = *(const int*)a, j = *(const int*)b;
+  if (holdbackQueue[i].xmitTime != holdbackQueue[j].xmitTime)
+    return (holdbackQueue[i].xmitTime < holdbackQueue[j].xmitTime) ? -1 : 1;
+  return (holdbackQueue[i].enqueueSeq < holdbackQueue[j].enqueueSeq) ? -1 : 1;
+}
+
+int compareIndex(const void *a, const void *b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+double randomUniform()
+{
+  return (rand() + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+long long samplePropagationDelay(int src, int dst)
+{
+  long long jitter = linkModel[src][dst].jitterMicros;
+  double sample = 0;
+  if (jitter > 0) {
+    switch (linkModel[src][dst].distribution) {
+      case DIST_NORMAL:     // Box-Muller, jitter is the standard deviation
+        sample = jitter * sqrt(-2.0 * logl(randomUniform())) * cos(2.0 * M_PI * randomUniform());
+        break;
+      case DIST_EXPONENTIAL: // jitter is the mean
+        sample = -jitter * logl(randomUniform());
+        break;
+      default:
+        sample = rand() % jitter;
+        break;
+    }
+  }
+
+  long long delay = linkModel[src][dst].baseDelayMicros + (long long)sample;
+  return (delay < 0) ? 0 : delay;
+}
+
+long long parseRate(const char *value)
+{
+  char *end;
+  double rate = strtod(value, &end);
+  if ((*end == 'k') || (*end == 'K'))
+    rate *= 1000;
+  else if ((*end == 'm') || (*end == 'M'))
+    rate *= 1000000;
+  else if ((*end == 'g') || (*end == 'G'))
+    rate *= 1000000000;
+  return (long long)rate;
+}
+
+/* Reads lines of the form 'src dst key=value ...', where src and dst are 1-based
+   server indexes or '*'; later lines override earlier ones */
+
+void readLinkModel(const char *filename)
+{
+  FILE *infile = fopen(filename, "r");
+  if (!infile)
+    panic("Cannot read link model from '%s'", filename);
+
+  char linebuf[1000];
+  int lineNo = 0;
+  while (fgets(linebuf, sizeof(linebuf), infile)) {
+    lineNo ++;
+    char *hash = strchr(linebuf, '#');
+    if (hash)
+      *hash = 0;
+    char *ssrc = strtok(linebuf, " \t\r\n");
+    if (!ssrc)
+      continue;
+    char *sdst = strtok(NULL, " \t\r\n");
+    if (!sdst)
+      panic("Line %d of '%s' needs a source and a destination server", lineNo, filename);
+
+    int srcFrom = 0, srcTo = numServers-1, dstFrom = 0, dstTo = numServers-1;
+    if (strcmp(ssrc, "*")) {
+      srcFrom = srcTo = atoi(ssrc)-1;
+      if ((srcFrom < 0) || (srcFrom >= numServers))
+        panic("Line %d of '%s' refers to unknown server %s", lineNo, filename, ssrc);
+    }
+    if (strcmp(sdst, "*")) {
+      dstFrom = dstTo = atoi(sdst)-1;
+      if ((dstFrom < 0) || (dstFrom >= numServers))
+        panic("Line %d of '%s' refers to unknown server %s", lineNo, filename, sdst);
+    }
+
+    char *option;
+    while ((option = strtok(NULL, " \t\r\n"))) {
+      char *value = strchr(option, '=');
+      if (!value)
+        panic("Line %d of '%s': expected key=value, got '%s'", lineNo, filename, option);
+      *value++ = 0;
+
+      for (int i=srcFrom; i<=srcTo; i++) {
+        for (int j=dstFrom; j<=dstTo; j++) {
+          if (!strcmp(option, "delay"))
+            linkModel[i][j].baseDelayMicros = atoll(value);
+          else if (!strcmp(option, "jitter"))
+            linkModel[i][j].jitterMicros = atoll(value);
+          else if (!strcmp(option, "dist")) {
+            if (!strcmp(value, "uniform"))
+              linkModel[i][j].distribution = DIST_UNIFORM;
+            else if (!strcmp(value, "normal"))
+              linkModel[i][j].distribution = DIST_NORMAL;
+            else if (!strcmp(value, "exp"))
+              linkModel[i][j].distribution = DIST_EXPONENTIAL;
+            else
+              panic("Line %d of '%s': unknown distribution '%s' (supported: uniform, normal, exp)", lineNo, filename, value);
+          } else if (!strcmp(option, "loss"))
+            linkModel[i][j].lossProbability = atof(value);
+          else if (!strcmp(option, "bw"))
+            linkModel[i][j].bandwidthBps = parseRate(value);
+          else if (!strcmp(option, "queue"))
+            linkModel[i][j].queueLimitBytes = atoll(value);
+          else if (!strcmp(option, "reorder"))
+            linkModel[i][j].reorderProbability = atof(value);
+          else
+            panic("Line %d of '%s': unknown option '%s'", lineNo, filename, option);
+        }
+      }
+    }
+  }
+  fclose(infile);
+  logVerbose("Link model read from '%s'", filename);
+}
+
+/* Puts a packet from src to dst into the holdback queue, according to the link model */
+
+void scheduleMessage(int src, int dst, const char *buffer, int length)
+{
+  linkModel[src][dst].numPackets ++;
+  linkModel[src][dst].numBytes += length;
+
+  if (randomUniform() < linkModel[src][dst].lossProbability) {
+    linkModel[src][dst].numLost ++;
+    return;
+  }
+
+  /* The link serializes one packet at a time; whatever exceeds its capacity has to wait */
+
+  long long now = currentTimeMicros();
+  long long departure = now;
+  if (linkModel[src][dst].bandwidthBps > 0) {
+    long long backlogStart = (linkModel[src][dst].busyUntil > now) ? linkModel[src][dst].busyUntil : now;
+    long long backlogBytes = (backlogStart - now) * linkModel[src][dst].bandwidthBps / 8000000LL;
+    if ((linkModel[src][dst].queueLimitBytes > 0) && (backlogBytes + length > linkModel[src][dst].queueLimitBytes)) {
+      linkModel[src][dst].numQueueDrops ++;
+      return;
+    }
+
+    long long queueMicros = backlogStart - now;
+    linkModel[src][dst].sumQueueMicros += queueMicros;
+    if (queueMicros > linkModel[src][dst].maxQueueMicros)
+      linkModel[src][dst].maxQueueMicros = queueMicros;
+    int bucket = 0;
+    while ((queueMicros >> bucket) > 0 && bucket < NUM_DELAY_BUCKETS-1)
+      bucket ++;
+    linkModel[src][dst].queueHistogram[bucket] ++;
+
+    departure = backlogStart + length * 8000000LL / linkModel[src][dst].bandwidthBps;
+    linkModel[src][dst].busyUntil = departure;
+  } else {
+    linkModel[src][dst].queueHistogram[0] ++;
+  }
+
+  long long xmitTime = departure + samplePropagationDelay(src, dst);
+  if (randomUniform() >= linkModel[src][dst].reorderProbability) {
+    if (xmitTime < linkModel[src][dst].lastXmitTime)
+      xmitTime = linkModel[src][dst].lastXmitTime;
+  } else if (xmitTime < linkModel[src][dst].lastXmitTime) {
+    linkModel[src][dst].numReordered ++;
+  }
+  if (xmitTime > linkModel[src][dst].lastXmitTime)
+    linkModel[src][dst].lastXmitTime = xmitTime;
+
+  if (queueLength >= MAX_QUEUE_LEN)
+    panic("Too many queued messages!");
+  if (length > (int)sizeof(holdbackQueue[queueLength].buffer)) {
+    warning("Truncating a %d-byte message from server %d to server %d", length, src+1, dst+1);
+    length = sizeof(holdbackQueue[queueLength].buffer);
+  }
+
+  holdbackQueue[queueLength].srcServerIdx = src;
+  holdbackQueue[queueLength].dstServerIdx = dst;
+  holdbackQueue[queueLength].xmitTime = xmitTime;
+  holdbackQueue[queueLength].enqueueSeq = nextEnqueueSeq ++;
+  holdbackQueue[queueLength].length = length;
+  memcpy(holdbackQueue[queueLength].buffer, buffer, length);
+  queueLength ++;
+}
+
+/* Approximates a percentile of the queueing delay from the power-of-two histogram */
+
+long long queuePercentile(int src, int dst, double fraction)
+{
+  long long total = 0;
+  for (int b=0; b<NUM_DELAY_BUCKETS; b++)
+    total += linkModel[src][dst].queueHistogram[b];
+
+  long long seen = 0;
+  for (int b=0; b<NUM_DELAY_BUCKETS; b++) {
+    seen += linkModel[src][dst].queueHistogram[b];
+    if (seen >= fraction * total) {
+      long long bound = (b == 0) ? 0 : (1LL << b);
+      return (bound < linkModel[src][dst].maxQueueMicros) ? bound : linkModel[src][dst].maxQueueMicros;
+    }
+  }
+  return linkModel[src][dst].maxQueueMicros;
+}
+
+void printLinkReport()
+{
+  fprintf(stderr, "Link          packets      bytes    lost   qdrops  reordered  queue avg/p50/p99/max (us)\n");
+  for (int i=0; i<numServers; i++) {
+    for (int j=0; j<numServers; j++) {
+      if (!linkModel[i][j].numPackets)
+        continue;
+      long long queued = linkModel[i][j].numPackets - linkModel[i][j].numLost;
+      fprintf(stderr, "S%02d->S%02d %11lld %10lld %7lld %8lld %10lld  %lld/%lld/%lld/%lld\n",
+        i+1, j+1, linkModel[i][j].numPackets, linkModel[i][j].numBytes, linkModel[i][j].numLost,
+        linkModel[i][j].numQueueDrops, linkModel[i][j].numReordered,
+        queued ? (linkModel[i][j].sumQueueMicros / queued) : 0,
+        queuePercentile(i, j, 0.5), queuePercentile(i, j, 0.99), linkModel[i][j].maxQueueMicros
+      );
+    }
+  }
+}
+
 int main(int argc, char *argv[])
 {
   long long maxDelayMicros = 5000;
   double lossProbability = 0;
+  const char *linkModelFile = NULL;
+  long long reportIntervalMicros = 0;
 
   /* Parse arguments */
 
   int c;
-  while ((c = getopt(argc, argv, "d:l:v")) != -1) {
+  while ((c = getopt(argc, argv, "d:l:m:r:v")) != -1) {
     switch (c) {
       case 'd':
         maxDelayMicros = atoll(optarg);
@@ -97,11 +371,17 @@ int main(int argc, char *argv[])
       case 'l':
         lossProbability = atof(optarg);
         break;
+      case 'm':
+        linkModelFile = optarg;
+        break;
+      case 'r':
+        reportIntervalMicros = atoll(optarg)*1000000LL;
+        break;
       case 'v':
         verbose = true;
         break;
       default:
-        fprintf(stderr, "Syntax: %s [-v] [-d maxDelayMicroseconds] [-l lossProbability] serverListFile\n", argv[0]);
+        fprintf(stderr, "Syntax: %s [-v] [-d maxDelayMicroseconds] [-l lossProbability] [-m linkModelFile] [-r reportIntervalSeconds] serverListFile\n", argv[0]);
         exit(1);
     }
   }
@@ -141,6 +421,19 @@ int main(int argc, char *argv[])
   fclose(infile);
   logVerbose("%d server(s) read from '%s'", numServers, argv[optind]);
 
+  /* Every link starts out with the global delay and loss settings */
+
+  for (int i=0; i<numServers; i++) {
+    for (int j=0; j<numServers; j++) {
+      linkModel[i][j].jitterMicros = maxDelayMicros;
+      linkModel[i][j].distribution = DIST_UNIFORM;
+      linkModel[i][j].lossProbability = lossProbability;
+      linkModel[i][j].reorderProbability = 1.0;
+    }
+  }
+  if (linkModelFile)
+    readLinkModel(linkModelFile);
+
   /* Open server sockets */
 
   for (int i=0; i<numServers; i++) {
@@ -163,10 +456,14 @@ int main(int argc, char *argv[])
       panic("Cannot set SO_REUSEADDR option on server socket (%s)", strerror(errno));
   }
 
+  signal(SIGINT, sigHandler);
+  signal(SIGTERM, sigHandler);
+
   /* Main loop */
 
   char addrbuf1[200], addrbuf2[200];
-  while (true) {
+  long long nextReport = currentTimeMicros() + reportIntervalMicros;
+  while (running) {
 
     fd_set rdset;
     FD_ZERO(&rdset);
@@ -193,18 +490,29 @@ int main(int argc, char *argv[])
     log("Sleep %lld micros", maxWaitMicros);
 
     int ret = select(maxFD+1, &rdset, NULL, NULL, &tv);
+    if ((ret<0) && (errno == EINTR))
+      continue;
     if (ret<0)
       panic("select() failed (%s)", strerror(errno));
 
     long long now = currentTimeMicros();
-    for (int i=0; i<queueLength; ) {
-      if (holdbackQueue[i].xmitTime <= now) {
-        deliverQueuedMessage(i);
-        holdbackQueue[i] = holdbackQueue[--queueLength];
-      } else {
-        i++;
-      }
+    if (reportIntervalMicros && (now >= nextReport)) {
+      printLinkReport();
+      nextReport = now + reportIntervalMicros;
     }
+    /* Deliver what is due in the order of xmitTime, and of arrival among packets due at
+       the same time, so only the link model reorders packets */
+
+    int numDue = 0;
+    for (int i=0; i<queueLength; i++)
+      if (holdbackQueue[i].xmitTime <= now)
+        dueList[numDue++] = i;
+    qsort(dueList, numDue, sizeof(int), compareDue);
+    for (int i=0; i<numDue; i++)
+      deliverQueuedMessage(dueList[i]);
+    qsort(dueList, numDue, sizeof(int), compareIndex);
+    for (int i=numDue-1; i>=0; i--)  // from the back, so the entry moved into a hole is never due
+      holdbackQueue[dueList[i]] = holdbackQueue[--queueLength];
 
     /* Receive a new message */
 
@@ -225,21 +533,11 @@ int main(int argc, char *argv[])
 
         log("RECV %s->%s '%s'", paddr(sender.sin_addr.s_addr, ntohs(sender.sin_port), addrbuf1), paddr(server[i].ip, server[i].port, addrbuf2), buffer);
 
-        if (queueLength >= MAX_QUEUE_LEN)
-          panic("Too many queued messages!");
-
-        bool isLost = (rand()%1000)<(int)(lossProbability * 1000);
-        if (!isLost) {
-          holdbackQueue[queueLength].srcServerIdx = senderIdx;
-          holdbackQueue[queueLength].dstServerIdx = i;
-          holdbackQueue[queueLength].xmitTime = currentTimeMicros() + (rand() % maxDelayMicros);
-          strncpy(holdbackQueue[queueLength].buffer, buffer, sizeof(holdbackQueue[queueLength].buffer)-1);
-          queueLength ++;
-        }
-
+        scheduleMessage(senderIdx, i, buffer, len);
       }
     }
   }
 
+  printLinkReport();
   return 0;
 }  
\ No newline at end of file
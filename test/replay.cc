@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include "../trace.h"
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
+#define logVerbose(a...) do { if (verbose) { fprintf(stderr, a); fprintf(stderr, "\n"); } } while (0)
+#define warning(a...) do { fprintf(stderr, "WARNING: "); fprintf(stderr, a); fprintf(stderr, "\n"); } while (0)
+
+#define MAX_SERVERS 10
+#define MAX_MSG_LEN 65535
+
+struct {
+  in_addr_t ip;
+  int port;
+} server[MAX_SERVERS];
+
+/* A datagram from the trace that will be re-injected */
+
+struct Event {
+  long long time;                 // microseconds since the start of the earliest trace
+  int serverIdx;
+  int clientIdx;
+  std::string payload;
+};
+
+/* One replay socket per client address that appears in the traces */
+
+struct Client {
+  int sock;
+  std::multimap<std::string, long long> pending;  // chat lines sent, awaiting their echo
+};
+
+std::vector<Event> events;
+std::vector<Client> clients;
+std::map<std::pair<int, long long>, int> clientIndex;   // (server, ip:port) -> client
+std::vector<long long> latencies;
+int numServers = 0;
+long long numPeerRecords = 0;
+bool verbose = false;
+
+void readServerList(const char *filename)
+{
+  FILE *infile = fopen(filename, "r");
+  if (!infile)
+    panic("Cannot read server list from '%s'", filename);
+  char linebuf[1000];
+  while (fgets(linebuf, sizeof(linebuf), infile)) {
+    char *sproxyaddr = strtok(linebuf, ",\r\n");
+    char *srealaddr = sproxyaddr ? strtok(NULL, ",\r\n") : NULL;
+    char *sclientaddr = srealaddr ? strtok(NULL, ",\r\n") : NULL; // the server's client socket, if it has one
+    char *serveraddr = sclientaddr ? sclientaddr : srealaddr ? srealaddr : sproxyaddr;
+    char *sip = strtok(serveraddr, ":");
+    char *sport = strtok(NULL, ":\r\n");
+    struct in_addr ip;
+    inet_aton(sip, &ip);
+    if (numServers >= MAX_SERVERS)
+      panic("Too many servers defined in '%s' (max %d)", filename, MAX_SERVERS);
+    server[numServers].ip = ip.s_addr;
+    server[numServers].port = atoi(sport);
+    numServers ++;
+  }
+  fclose(infile);
+  logVerbose("%d server(s) found in '%s'", numServers, filename);
+}
+
+/* Loads the client datagrams of one trace; returns the wall clock start of the capture */
+
+long long readTrace(const char *filename, std::vector<Event> &traceEvents)
+{
+  FILE *infile = fopen(filename, "rb");
+  if (!infile)
+    panic("Cannot read trace from '%s'", filename);
+
+  TraceHeader header;
+  if ((fread(&header, sizeof(header), 1, infile) != 1) || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)))
+    panic("'%s' is not a chatserver trace", filename);
+  if (header.version != TRACE_VERSION)
+    panic("'%s' has trace version %d, but only version %d is supported", filename, header.version, TRACE_VERSION);
+  if ((header.server < 1) || (header.server > numServers))
+    panic("'%s' was captured by server %d, which is not in the server list", filename, header.server);
+
+  TraceRecord record;
+  long long time = 0;
+  char payload[MAX_MSG_LEN];
+  while (fread(&record, sizeof(record), 1, infile) == 1) {
+    if (fread(payload, 1, record.len, infile) != record.len)
+      panic("'%s' is truncated", filename);
+    time += record.delta_us;
+    if (record.kind != TRACE_CLIENT) {
+      numPeerRecords ++;   // the cluster regenerates its own peer traffic
+      continue;
+    }
+
+    long long addr = ((long long)record.ip << 16) | record.port;
+    std::pair<int, long long> key(header.server-1, addr);
+    if (!clientIndex.count(key)) {
+      Client c;
+      c.sock = socket(AF_INET, SOCK_DGRAM, 0);
+      if (c.sock < 0)
+        panic("Cannot open client socket (%s)", strerror(errno));
+      clientIndex[key] = clients.size();
+      clients.push_back(c);
+    }
+
+    Event e;
+    e.time = time;
+    e.serverIdx = header.server-1;
+    e.clientIdx = clientIndex[key];
+    e.payload = std::string(payload, record.len);
+    traceEvents.push_back(e);
+  }
+  fclose(infile);
+  logVerbose("%d client datagram(s) read from '%s'", (int)traceEvents.size(), filename);
+  return header.start_us;
+}
+
+long long currentTimeMicros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000LL + t.tv_nsec/1000;
+}
+
+void sendEvent(const Event &e, long long now)
+{
+  struct sockaddr_in dest;
+  bzero((void*)&dest, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_addr.s_addr = server[e.serverIdx].ip;
+  dest.sin_port = htons(server[e.serverIdx].port);
+
+  int w = sendto(clients[e.clientIdx].sock, e.payload.data(), e.payload.size(), 0, (struct sockaddr*)&dest, sizeof(dest));
+  if (w<0)
+    panic("sendto() failed (%s)", strerror(errno));
+  if (!e.payload.empty() && (e.payload[0] != '/'))
+    clients[e.clientIdx].pending.insert(std::make_pair(e.payload, now));
+}
+
+/* A delivery looks like '<sender> text'; if the text is one of our own pending lines, it is our echo */
+
+void receiveDelivery(int clientIdx, const char *buffer, long long now)
+{
+  if (buffer[0] != '<')
+    return;
+  const char *text = strstr(buffer, "> ");
+  if (!text)
+    return;
+
+  std::multimap<std::string, long long>::iterator it = clients[clientIdx].pending.find(std::string(text+2));
+  if (it != clients[clientIdx].pending.end()) {
+    latencies.push_back(now - it->second);
+    clients[clientIdx].pending.erase(it);
+  }
+}
+
+long long percentile(double fraction)
+{
+  if (latencies.empty())
+    return 0;
+  size_t idx = (size_t)(fraction * (latencies.size()-1));
+  return latencies[idx];
+}
+
+/* Reads a report written by an earlier run, as 'key value' lines */
+
+std::map<std::string, double> readReport(const char *filename)
+{
+  std::map<std::string, double> report;
+  FILE *infile = fopen(filename, "r");
+  if (!infile)
+    panic("Cannot read baseline report from '%s'", filename);
+  char key[200];
+  double value;
+  while (fscanf(infile, "%199s %lf", key, &value) == 2)
+    report[key] = value;
+  fclose(infile);
+  return report;
+}
+
+int main(int argc, char *argv[])
+{
+  double speed = 1.0;
+  int finalDelaySeconds = 5;
+  const char *baselineFile = NULL;
+  const char *outputFile = NULL;
+
+  /* Parse arguments */
+
+  int c;
+  while ((c = getopt(argc, argv, "s:f:b:o:v")) != -1) {
+    switch (c) {
+      case 's':
+        speed = strcmp(optarg, "max") ? atof(optarg) : 0;
+        if (speed < 0)
+          panic("Speed must be positive or 'max'");
+        break;
+      case 'f':
+        finalDelaySeconds = atoi(optarg);
+        break;
+      case 'b':
+        baselineFile = optarg;
+        break;
+      case 'o':
+        outputFile = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Syntax: %s [-v] [-s speed|max] [-f finalDelaySeconds] [-b baselineReport] [-o report] serverListFile traceFile...\n", argv[0]);
+        exit(1);
+    }
+  }
+
+  if (optind > (argc-2)) {
+    fprintf(stderr, "Error: Server list file and at least one trace file are required!\n");
+    return 1;
+  }
+
+  /* Merge the traces on their wall clock start times, so cross-server timing is preserved */
+
+  readServerList(argv[optind]);
+  std::vector<std::vector<Event> > traces;
+  std::vector<long long> starts;
+  long long earliest = 0;
+  for (int i=optind+1; i<argc; i++) {
+    traces.push_back(std::vector<Event>());
+    starts.push_back(readTrace(argv[i], traces.back()));
+    if ((i == optind+1) || (starts.back() < earliest))
+      earliest = starts.back();
+  }
+  for (size_t i=0; i<traces.size(); i++) {
+    for (size_t j=0; j<traces[i].size(); j++) {
+      traces[i][j].time += starts[i] - earliest;
+      events.push_back(traces[i][j]);
+    }
+  }
+  std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.time < b.time; });
+
+  fprintf(stderr, "Replaying %d datagrams from %d clients at %s speed (%lld peer datagrams in the traces)\n",
+    (int)events.size(), (int)clients.size(), speed ? "scaled" : "max", numPeerRecords);
+
+  /* Main loop */
+
+  std::vector<struct pollfd> fds(clients.size());
+  for (size_t i=0; i<clients.size(); i++) {
+    fds[i].fd = clients[i].sock;
+    fds[i].events = POLLIN;
+  }
+
+  long long start = currentTimeMicros();
+  long long lastSend = start;
+  long long lastActivity = start;
+  long long lastDelivery = start;
+  long long numDeliveries = 0;
+  size_t next = 0;
+  while ((next < events.size()) || (currentTimeMicros() - lastActivity < finalDelaySeconds * 1000000LL)) {
+    long long now = currentTimeMicros();
+    while ((next < events.size()) && ((speed == 0) || (start + (long long)(events[next].time / speed) <= now))) {
+      sendEvent(events[next++], now);
+      lastSend = lastActivity = now;
+      if (speed == 0)
+        break;          // still drain the sockets between sends
+    }
+
+    int timeoutMillis = 100;
+    if ((next < events.size()) && speed) {
+      long long wait = start + (long long)(events[next].time / speed) - now;
+      timeoutMillis = (wait <= 0) ? 0 : (int)((wait + 999) / 1000);
+      if (timeoutMillis > 100)
+        timeoutMillis = 100;
+    } else if (next < events.size()) {
+      timeoutMillis = 0;
+    }
+
+    int ret = poll(fds.data(), fds.size(), timeoutMillis);
+    if ((ret < 0) && (errno != EINTR))
+      panic("poll() failed (%s)", strerror(errno));
+
+    now = currentTimeMicros();
+    for (size_t i=0; (ret > 0) && (i<fds.size()); i++) {
+      if (fds[i].revents & POLLIN) {
+        char buffer[MAX_MSG_LEN+1];
+        int len = recv(fds[i].fd, buffer, MAX_MSG_LEN, 0);
+        if (len < 0)
+          panic("Error during recv (%s)", strerror(errno));
+        buffer[len] = 0;
+        if (buffer[0] == '<') {
+          numDeliveries ++;
+          lastDelivery = now;
+        }
+        receiveDelivery(i, buffer, now);
+        lastActivity = now;
+      }
+    }
+  }
+
+  /* Report throughput and echo latency; compare against a baseline if we have one */
+
+  long long numSent = events.size();
+  long long numUnmatched = 0;
+  for (size_t i=0; i<clients.size(); i++)
+    numUnmatched += clients[i].pending.size();
+  std::sort(latencies.begin(), latencies.end());
+  double seconds = (lastSend - start) / 1000000.0;
+  double deliverySeconds = (lastDelivery - start) / 1000000.0;
+
+  std::vector<std::pair<std::string, double> > report;
+  report.push_back(std::make_pair("datagrams_sent", (double)numSent));
+  report.push_back(std::make_pair("deliveries", (double)numDeliveries));
+  report.push_back(std::make_pair("send_seconds", seconds));
+  report.push_back(std::make_pair("send_rate", seconds > 0 ? numSent / seconds : 0));
+  report.push_back(std::make_pair("delivery_seconds", deliverySeconds));
+  report.push_back(std::make_pair("delivery_rate", deliverySeconds > 0 ? numDeliveries / deliverySeconds : 0));
+  report.push_back(std::make_pair("echoes_missing", (double)numUnmatched));
+  report.push_back(std::make_pair("latency_p50_us", (double)percentile(0.5)));
+  report.push_back(std::make_pair("latency_p90_us", (double)percentile(0.9)));
+  report.push_back(std::make_pair("latency_p99_us", (double)percentile(0.99)));
+  report.push_back(std::make_pair("latency_max_us", (double)percentile(1.0)));
+
+  FILE *outfile = outputFile ? fopen(outputFile, "w") : NULL;
+  if (outputFile && !outfile)
+    panic("Cannot write report to '%s'", outputFile);
+  for (size_t i=0; i<report.size(); i++) {
+    printf("%s %.3f\n", report[i].first.c_str(), report[i].second);
+    if (outfile)
+      fprintf(outfile, "%s %.3f\n", report[i].first.c_str(), report[i].second);
+  }
+  if (outfile)
+    fclose(outfile);
+
+  if (baselineFile) {
+    std::map<std::string, double> baseline = readReport(baselineFile);
+    printf("\nChange against '%s':\n", baselineFile);
+    for (size_t i=0; i<report.size(); i++) {
+      if (!baseline.count(report[i].first))
+        continue;
+      double before = baseline[report[i].first];
+      double after = report[i].second;
+      if (before != 0)
+        printf("%-16s %12.3f -> %12.3f (%+.1f%%)\n", report[i].first.c_str(), before, after, 100.0 * (after - before) / before);
+      else
+        printf("%-16s %12.3f -> %12.3f\n", report[i].first.c_str(), before, after);
+    }
+  }
+
+  return 0;
+}
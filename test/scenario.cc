@@ -0,0 +1,380 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+/* Runs benchmarks on a local cluster as a scenario file describes them. Each line of the
+   file sets one or more parameters as key=value; a comma separated list of values makes
+   a sweep, and every combination of the values is run. For each run this starts the
+   proxy and the servers, drives them with stresstest, shuts everything down and prints
+   a row of results: the rate stresstest really sent at, throughput and latency as it
+   saw them, and the datagrams the servers sent each other as the proxy counted them.
+   The output is CSV, or JSON with -j, ready for plotting. */
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
+#define logVerbose(a...) do { if (verbose) { fprintf(stderr, a); fprintf(stderr, "\n"); } } while (0)
+#define warning(a...) do { fprintf(stderr, "WARNING: "); fprintf(stderr, a); fprintf(stderr, "\n"); } while (0)
+
+#define BASE_PORT 31000         // each run gets ports of its own, so stragglers of the last one are not mistaken
+#define PORTS_PER_RUN 40
+#define MAX_SERVERS 10          // as many as the proxy and stresstest take
+#define STARTUP_MICROS 300000   // for the servers to bind and greet each other
+#define MAX_RATE 1000           // stresstest sends at intervals of whole milliseconds
+
+/* The parameters, in the order they nest in a sweep: the last one varies fastest */
+
+struct Param {
+  const char *key;
+  const char *help;
+  std::vector<std::string> values;
+};
+
+Param params[] = {
+  { "servers", "number of servers", { "3" } },
+  { "order", "unordered, fifo, causal or total", { "fifo" } },
+  { "delay", "maximum delay the proxy adds, in microseconds", { "0" } },
+  { "loss", "probability the proxy drops a datagram", { "0" } },
+  { "clients", "number of clients", { "10" } },
+  { "rooms", "number of chat rooms", { "1" } },
+  { "rate", "messages per second, at most 1000", { "100" } },
+  { "messages", "messages per run", { "100" } },
+  { "wait", "seconds to wait for stragglers", { "2" } },
+};
+const int NUM_PARAMS = sizeof(params) / sizeof(params[0]);
+
+struct Result {
+  int delivered, expected, errors;
+  double rate, seconds, throughput;
+  long long latencyMean, latencyMedian, latency99, latencyMax;
+  long long datagrams, bytes, lost;
+};
+
+bool verbose = false;
+bool json = false;
+std::string binDir;
+pid_t children[MAX_SERVERS + 2];   // of the run in progress, 0 once stopped
+volatile sig_atomic_t numChildren = 0;
+
+Param *findParam(const char *key)
+{
+  for (int i=0; i<NUM_PARAMS; i++)
+    if (!strcmp(params[i].key, key))
+      return &params[i];
+  return NULL;
+}
+
+/* The value a run uses for a parameter */
+
+const char *valueOf(const int *pick, const char *key)
+{
+  Param *p = findParam(key);
+  return p->values[pick[p - params]].c_str();
+}
+
+void readScenario(const char *filename)
+{
+  FILE *infile = fopen(filename, "r");
+  if (!infile)
+    panic("Cannot read scenario from '%s'", filename);
+
+  char linebuf[1000];
+  int lineNo = 0;
+  while (fgets(linebuf, sizeof(linebuf), infile)) {
+    lineNo ++;
+    char *hash = strchr(linebuf, '#');
+    if (hash)
+      *hash = 0;
+    char *option;
+    for (char *rest = linebuf; (option = strtok(rest, " \t\r\n")); rest = NULL) {
+      char *value = strchr(option, '=');
+      if (!value)
+        panic("Line %d of '%s': expected key=value, got '%s'", lineNo, filename, option);
+      *value++ = 0;
+      Param *p = findParam(option);
+      if (!p)
+        panic("Line %d of '%s': unknown parameter '%s'", lineNo, filename, option);
+      p->values.clear();
+      for (char *v = value; *v; ) {
+        char *comma = strchr(v, ',');
+        p->values.push_back(comma ? std::string(v, comma - v) : std::string(v));
+        v = comma ? comma + 1 : v + strlen(v);
+      }
+      if (p->values.empty())
+        panic("Line %d of '%s': no value for '%s'", lineNo, filename, option);
+    }
+  }
+  fclose(infile);
+}
+
+/* Start a program with its output going to a file */
+
+pid_t launch(std::vector<std::string> args, const char *outFile)
+{
+  pid_t pid = fork();
+  if (pid < 0)
+    panic("Cannot fork (%s)", strerror(errno));
+  if (pid == 0) {
+    int fd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+    std::vector<char*> argv;
+    for (size_t i=0; i<args.size(); i++)
+      argv.push_back((char*) args[i].c_str());
+    argv.push_back(NULL);
+    execv(argv[0], argv.data());
+    fprintf(stderr, "Cannot run %s (%s)\n", argv[0], strerror(errno));
+    _exit(1);
+  }
+  children[numChildren] = pid;
+  numChildren = numChildren + 1;
+  logVerbose("Started %s as %d", args[0].c_str(), (int) pid);
+  return pid;
+}
+
+void stop(pid_t pid)
+{
+  for (int i=0; i<numChildren; i++)
+    if (children[i] == pid)
+      children[i] = 0;
+  kill(pid, SIGINT);
+  waitpid(pid, NULL, 0);
+}
+
+/* Interrupted: take the proxy, the servers and stresstest down with us */
+
+void sigHandler(int arg)
+{
+  for (int i=0; i<numChildren; i++)
+    if (children[i] > 0) {
+      kill(children[i], SIGINT);
+      waitpid(children[i], NULL, 0);
+    }
+  _exit(1);
+}
+
+/* stresstest sends every so many milliseconds, so it can only approximate most rates */
+
+int intervalMillis(double rate)
+{
+  int interval = (int)(1000 / rate + 0.5);
+  return interval > 0 ? interval : 1;
+}
+
+/* Pick the results out of what stresstest and the proxy printed */
+
+void readResults(const char *stressFile, const char *proxyFile, Result &r)
+{
+  memset(&r, 0, sizeof(r));
+  r.delivered = r.expected = r.errors = -1;
+  char linebuf[1000];
+  FILE *infile = fopen(stressFile, "r");
+  while (infile && fgets(linebuf, sizeof(linebuf), infile)) {
+    if (sscanf(linebuf, "Delivered %d of %d in %lf s (%lf per second), latency (us): mean %lld, median %lld, 99th percentile %lld, max %lld",
+        &r.delivered, &r.expected, &r.seconds, &r.throughput, &r.latencyMean, &r.latencyMedian, &r.latency99, &r.latencyMax) == 8)
+      continue;
+    if (!strncmp(linebuf, "Ordering OK", 11))
+      r.errors = 0;
+    else if (strstr(linebuf, "ordering error(s) found"))
+      r.errors = atoi(linebuf);
+  }
+  if (infile)
+    fclose(infile);
+
+  infile = fopen(proxyFile, "r");
+  while (infile && fgets(linebuf, sizeof(linebuf), infile)) {
+    int src, dst;
+    long long packets, bytes, lost;
+    if (sscanf(linebuf, "S%d->S%d %lld %lld %lld", &src, &dst, &packets, &bytes, &lost) == 5) {
+      r.datagrams += packets;
+      r.bytes += bytes;
+      r.lost += lost;
+    }
+  }
+  if (infile)
+    fclose(infile);
+}
+
+/* One run with the values chosen in pick[] */
+
+void runScenario(int run, const int *pick, Result &r)
+{
+  int numServers = atoi(valueOf(pick, "servers"));
+  std::string order = valueOf(pick, "order");
+  if ((numServers < 1) || (numServers > MAX_SERVERS))
+    panic("Cannot run %d servers (1 to %d)", numServers, MAX_SERVERS);
+
+  /* Every server gets a proxy address its peers send to and the address it binds */
+
+  char listFile[] = "/tmp/scenario-XXXXXX";
+  int fd = mkstemp(listFile);
+  if (fd < 0)
+    panic("Cannot create a server list (%s)", strerror(errno));
+  FILE *list = fdopen(fd, "w");
+  int basePort = BASE_PORT + (run % 100) * PORTS_PER_RUN;
+  for (int i=0; i<numServers; i++)
+    fprintf(list, "127.0.0.1:%d,127.0.0.1:%d\n", basePort + 2*i, basePort + 2*i + 1);
+  fclose(list);
+  std::string proxyFile = std::string(listFile) + ".proxy";
+  std::string stressFile = std::string(listFile) + ".stress";
+
+  pid_t proxy = launch({ binDir + "/proxy", "-d", valueOf(pick, "delay"), "-l", valueOf(pick, "loss"), listFile }, proxyFile.c_str());
+  std::vector<pid_t> servers;
+  for (int i=1; i<=numServers; i++)
+    servers.push_back(launch({ binDir + "/../chatserver", "-o", order, listFile, std::to_string(i) }, "/dev/null"));
+  usleep(STARTUP_MICROS);
+
+  /* stresstest checks causal order as fifo, which it implies */
+
+  std::string check = (order == "causal") ? "fifo" : order;
+  char interval[32];
+  sprintf(interval, "%d", intervalMillis(atof(valueOf(pick, "rate"))));
+  pid_t stress = launch({ binDir + "/stresstest", "-o", check, "-c", valueOf(pick, "clients"),
+    "-g", valueOf(pick, "rooms"), "-m", valueOf(pick, "messages"), "-i", interval,
+    "-f", valueOf(pick, "wait"), listFile }, stressFile.c_str());
+  waitpid(stress, NULL, 0);
+
+  for (size_t i=0; i<servers.size(); i++)
+    stop(servers[i]);
+  stop(proxy);
+  numChildren = 0;
+  readResults(stressFile.c_str(), proxyFile.c_str(), r);
+  r.rate = 1000.0 / atoi(interval);
+  if (r.delivered < 0)
+    warning("Run %d produced no results; see %s", run + 1, stressFile.c_str());
+  else
+    unlink(stressFile.c_str());
+  unlink(proxyFile.c_str());
+  unlink(listFile);
+}
+
+void printRow(int run, const int *pick, const Result &r)
+{
+  const char *resultKeys[] = { "rate_sent", "delivered", "expected", "seconds", "throughput", "latency_mean_us",
+    "latency_p50_us", "latency_p99_us", "latency_max_us", "datagrams", "datagrams_per_message",
+    "bytes", "lost", "errors" };
+  char results[14][32];
+  int messages = atoi(valueOf(pick, "messages"));
+  sprintf(results[0], "%.1f", r.rate);
+  sprintf(results[1], "%d", r.delivered);
+  sprintf(results[2], "%d", r.expected);
+  sprintf(results[3], "%.3f", r.seconds);
+  sprintf(results[4], "%.1f", r.throughput);
+  sprintf(results[5], "%lld", r.latencyMean);
+  sprintf(results[6], "%lld", r.latencyMedian);
+  sprintf(results[7], "%lld", r.latency99);
+  sprintf(results[8], "%lld", r.latencyMax);
+  sprintf(results[9], "%lld", r.datagrams);
+  sprintf(results[10], "%.2f", messages > 0 ? (double) r.datagrams / messages : 0.0);
+  sprintf(results[11], "%lld", r.bytes);
+  sprintf(results[12], "%lld", r.lost);
+  sprintf(results[13], "%d", r.errors);
+
+  if (json) {
+    printf("%s\n    {", run ? "," : "");
+    for (int i=0; i<NUM_PARAMS; i++) {
+      const char *v = params[i].values[pick[i]].c_str();
+      if (!strcmp(params[i].key, "order"))
+        printf(" \"%s\": \"%s\",", params[i].key, v);
+      else
+        printf(" \"%s\": %s,", params[i].key, v);
+    }
+    for (int i=0; i<14; i++)
+      printf(" \"%s\": %s%s", resultKeys[i], results[i], (i < 13) ? "," : " }");
+  } else {
+    if (!run) {
+      for (int i=0; i<NUM_PARAMS; i++)
+        printf("%s,", params[i].key);
+      for (int i=0; i<14; i++)
+        printf("%s%s", resultKeys[i], (i < 13) ? "," : "\n");
+    }
+    for (int i=0; i<NUM_PARAMS; i++)
+      printf("%s,", params[i].values[pick[i]].c_str());
+    for (int i=0; i<14; i++)
+      printf("%s%s", results[i], (i < 13) ? "," : "\n");
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  /* Parse arguments */
+
+  int c;
+  while ((c = getopt(argc, argv, "jv")) != -1) {
+    switch (c) {
+      case 'j':
+        json = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Syntax: %s [-v] [-j] scenarioFile\n\nParameters, each key=value or key=value1,value2,... for a sweep:\n", argv[0]);
+        for (int i=0; i<NUM_PARAMS; i++)
+          fprintf(stderr, "  %-9s %s (default %s)\n", params[i].key, params[i].help, params[i].values[0].c_str());
+        exit(1);
+    }
+  }
+
+  if (optind != (argc-1)) {
+    fprintf(stderr, "Error: Name of the scenario file is missing!\n");
+    return 1;
+  }
+  readScenario(argv[optind]);
+  const char *slash = strrchr(argv[0], '/');
+  binDir = slash ? std::string(argv[0], slash - argv[0]) : std::string(".");
+  std::vector<std::string> &orders = findParam("order")->values;
+  for (size_t i=0; i<orders.size(); i++)
+    if ((orders[i] != "unordered") && (orders[i] != "fifo") && (orders[i] != "causal") && (orders[i] != "total"))
+      panic("Unknown ordering: '%s' (supported: unordered, fifo, causal, total)", orders[i].c_str());
+  std::vector<std::string> &rates = findParam("rate")->values;
+  for (size_t i=0; i<rates.size(); i++) {
+    double rate = atof(rates[i].c_str());
+    if ((rate <= 0) || (rate > MAX_RATE))
+      panic("Invalid message rate: '%s' (more than 0, at most %d per second)", rates[i].c_str(), MAX_RATE);
+    if (1000.0 / intervalMillis(rate) != rate)
+      warning("A rate of %s is sent as %.1f messages per second; see rate_sent", rates[i].c_str(), 1000.0 / intervalMillis(rate));
+  }
+
+  int numRuns = 1;
+  for (int i=0; i<NUM_PARAMS; i++)
+    numRuns *= params[i].values.size();
+
+  /* Run every combination, counting through the values like an odometer */
+
+  signal(SIGINT, sigHandler);
+  signal(SIGTERM, sigHandler);
+  int pick[NUM_PARAMS] = { };
+  if (json)
+    printf("{\n  \"runs\": [");
+  for (int run=0; run<numRuns; run++) {
+    fprintf(stderr, "Run %d/%d:", run + 1, numRuns);
+    for (int i=0; i<NUM_PARAMS; i++)
+      fprintf(stderr, " %s=%s", params[i].key, params[i].values[pick[i]].c_str());
+    fprintf(stderr, "\n");
+
+    Result r;
+    runScenario(run, pick, r);
+    printRow(run, pick, r);
+
+    for (int i=NUM_PARAMS-1; i>=0; i--) {
+      if (++pick[i] < (int) params[i].values.size())
+        break;
+      pick[i] = 0;
+    }
+  }
+  if (json)
+    printf("\n  ]\n}\n");
+
+  return 0;
+}
@@ -0,0 +1,575 @@
+/* Tests of the server's handling of single datagrams. The server is compiled into this
+   file, as for the benchmarks, and runs on a network where each test puts datagrams
+   in front of it and looks at what it sent back and at its state. Each test starts
+   from a server 1 of a view of NUM_SERVERS, on a clock that only moves when a test
+   moves it. Prints one line per test and exits non-zero if any failed. */
+
+#define SERVER_LIBRARY
+#include "../chatserver.cc"
+#include "heapcount.h"
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
+#define expect(cond, a...) do { if (!(cond)) { printf("FAIL %s: ", testName); printf(a); printf("\n"); failed = true; } } while (0)
+
+#define NUM_SERVERS 3
+
+/* Sockets whose traffic the tests see, with a clock of their own */
+
+struct TestNet : public Network {
+  std::deque<std::pair<sockaddr_in, std::string> > inbox;
+  std::vector<std::pair<sockaddr_in, std::string> > sent;
+  bool recording; // keep what is sent in sent, off where the test counts allocations
+  bool full; // refuse to send, as a socket whose buffer is full
+  long long clock;
+
+  int open(const sockaddr_in &addr) { return 3; }
+  void close(int fd) {}
+  ssize_t send(int fd, const char *msg, size_t len, const sockaddr_in &to) {
+    if (full) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (recording)
+      sent.push_back(std::make_pair(to, std::string(msg, len)));
+    return len;
+  }
+  ssize_t receive(int fd, char *buffer, size_t len, sockaddr_in &from) {
+    if (inbox.empty()) {
+      errno = EAGAIN;
+      return -1;
+    }
+    size_t n = std::min(len, inbox.front().second.size());
+    memcpy(buffer, inbox.front().second.data(), n);
+    from = inbox.front().first;
+    inbox.pop_front();
+    return n;
+  }
+  int select(int nfds, fd_set *readfds, fd_set *writefds, long long timeout) { return -1; }
+  long long now() { return clock; }
+};
+
+TestNet testNet;
+Proposals proposals;
+const char *testName = "";
+bool failed = false;
+
+sockaddr_in makeAddr(const char *ip, int port)
+{
+  sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_aton(ip, &addr.sin_addr);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+bool sameAddr(const sockaddr_in &a, const sockaddr_in &b)
+{
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+/* Start over as server 1, the coordinator of a view of servers 1 .. NUM_SERVERS */
+
+void resetServer()
+{
+  CLIENTS = ClientTable();
+  ROOMS.clear();
+  SERVERS.clear();
+  ACTIVE.clear();
+  PEER_ZIP.clear();
+  LAST_HEARD.clear();
+  VIEW_HINT.clear();
+  AGREED.clear();
+  AGREED_ORDER.clear();
+  ORPHANS.clear();
+  ROOM_ORDERS.clear();
+  ORDER_UNACKED.clear();
+  TOTAL_ROOMS = 0;
+  BACKLOGGED.clear();
+  SLOW.clear();
+  proposals.clear();
+  testNet.inbox.clear();
+  testNet.sent.clear();
+  testNet.recording = true;
+  testNet.full = false;
+  testNet.clock = 1000000000LL;
+  INTEREST_DENIED.clear();
+  bzero(&MCAST_GROUP, sizeof(MCAST_GROUP));
+  MCAST_LOST = 0;
+  CLIENT_RATE = RateLimit();
+  ADMIN_TOKEN = NULL;
+  FAILURE_TIMEOUT = 0;
+  HOLD = HoldBudget();
+  HOLD_POLICY = HOLD_SHED;
+  LAST_PING = 0;
+  SELF_IDX = 1;
+  VIEW_ID = 0;
+  IN_VIEW = true;
+  HAVE_STATE = true;
+  listen_fd = client_fd = 3;
+  grow_servers(NUM_SERVERS);
+  for (int i=0; i<NUM_SERVERS; i++) {
+    SERVERS[i] = makeAddr("127.0.0.1", 8000 + i);
+    ACTIVE[i] = true;
+  }
+}
+
+/* Hand the server a datagram as if it came from an address */
+
+void inject(const sockaddr_in &from, const std::string &msg)
+{
+  testNet.inbox.push_back(std::make_pair(from, msg));
+  receive(3, proposals);
+}
+
+/* A server is known by its address and port, not by its port alone */
+
+void testServerAddress()
+{
+  int idx = 0;
+  expect(is_server(SERVERS[1], idx) && idx == 2, "server 2 was not recognized");
+  expect(!is_server(makeAddr("10.0.0.9", 8001), idx), "another host on server 2's port was taken for it");
+  expect(!is_server(makeAddr("127.0.0.1", 9001), idx), "another port of server 2's host was taken for it");
+}
+
+/* A JOIN that claims a slot is only taken from the address it claims, and never moves
+   a member of the view */
+
+void testForgedJoin()
+{
+  sockaddr_in attacker = makeAddr("10.0.0.9", 9999);
+  sockaddr_in second = SERVERS[1];
+
+  inject(attacker, std::string(1, CTRL_MARK) + "JOIN 2 10.0.0.9:9999");
+  expect(VIEW_ID == 0 && sameAddr(SERVERS[1], second), "an outsider took over server 2");
+
+  inject(attacker, std::string(1, CTRL_MARK) + "JOIN 4 127.0.0.1:8003");
+  expect(VIEW_ID == 0 && SERVERS.size() == NUM_SERVERS, "a join from another address was let in");
+
+  inject(second, std::string(1, CTRL_MARK) + "JOIN 2 10.0.0.9:9999");
+  expect(VIEW_ID == 0 && sameAddr(SERVERS[1], second), "an active member was moved to another address");
+
+  inject(attacker, std::string(1, CTRL_MARK) + "JOIN 4 garbage");
+  expect(VIEW_ID == 0, "a join without a port was let in");
+
+  sockaddr_in fourth = makeAddr("127.0.0.1", 8003);
+  inject(fourth, std::string(1, CTRL_MARK) + "JOIN 4 127.0.0.1:8003");
+  expect(VIEW_ID == 1 && SERVERS.size() == 4 && ACTIVE[3] && sameAddr(SERVERS[3], fourth),
+    "a new server joining from its own address was not let in");
+}
+
+/* Datagrams sent to an address that start with a prefix */
+
+int countSent(const sockaddr_in &to, const std::string &prefix)
+{
+  int n = 0;
+  for (size_t i=0; i<testNet.sent.size(); i++)
+    if (sameAddr(testNet.sent[i].first, to) && testNet.sent[i].second.compare(0, prefix.size(), prefix) == 0)
+      n ++;
+  return n;
+}
+
+/* An INTEREST is sent again until its SEQ comes back, and a server that keeps sending
+   us a room we left is told again */
+
+void testInterestRetry()
+{
+  std::string interest = std::string(1, CTRL_MARK) + "INTEREST 1 1";
+  inject(makeAddr("10.1.0.1", 4000), "/join 1");
+  expect(countSent(SERVERS[1], interest) == 1 && countSent(SERVERS[2], interest) == 1,
+    "joining did not announce the interest");
+
+  testNet.sent.clear();
+  testNet.clock += INTEREST_RETRY;
+  retry_interest(now_us());
+  expect(countSent(SERVERS[1], interest) == 1 && countSent(SERVERS[2], interest) == 1,
+    "an unanswered interest was not sent again");
+
+  inject(SERVERS[1], std::string(1, CTRL_MARK) + "SEQ 1 1 0 0");
+  testNet.sent.clear();
+  testNet.clock += INTEREST_RETRY;
+  retry_interest(now_us());
+  expect(countSent(SERVERS[1], interest) == 0, "an answered interest was sent again");
+  expect(countSent(SERVERS[2], interest) == 1, "an unanswered interest was not sent again");
+
+  testNet.sent.clear();
+  char frame[FRAME_LEN + 1];
+  encode_frame(frame, 1, "1:1", PLAIN_MSG + FIFO, 0, 2, "<x> hello");
+  inject(SERVERS[1], frame);
+  expect(countSent(SERVERS[1], std::string(1, CTRL_MARK) + "INTEREST 2 0") == 1,
+    "a server sending a room without members here was not told");
+}
+
+/* A /repair is only served with the cookie of the client's address, resends one
+   message's worth and takes a token of the client's rate limit */
+
+void testRepairLimits()
+{
+  MCAST_GROUP = makeAddr("239.1.0.1", 6000);
+  MCAST_SECRET = 12345;
+  sockaddr_in client = makeAddr("10.1.0.1", 4000);
+  inject(client, "/mcast");
+  inject(client, "/join 1");
+  std::string text(1000, 'x');
+  for (int i=0; i<MCAST_BACKLOG; i++)
+    forward_group(1, text.c_str());
+  std::string frames = std::string(1, MCAST_MARK) + "1:";
+  unsigned cookie = mcast_cookie(client, MCAST_SECRET);
+  char repair[128];
+
+  testNet.sent.clear();
+  snprintf(repair, sizeof(repair), "/repair 1 1 %d", MCAST_BACKLOG);
+  inject(client, repair);
+  snprintf(repair, sizeof(repair), "/repair 1 1 %d %u", MCAST_BACKLOG, cookie + 1);
+  inject(client, repair);
+  expect(countSent(client, frames) == 0, "a repair without the client's cookie was served");
+
+  snprintf(repair, sizeof(repair), "/repair 1 1 %d %u", MCAST_BACKLOG, cookie);
+  inject(client, repair);
+  int resent = countSent(client, frames);
+  expect(resent > 0 && resent * text.size() <= (size_t) MAX_MESSAGE_LEN,
+    "a repair resent %d messages of %d bytes", resent, (int) text.size());
+
+  CLIENT_RATE.parse("1:2");
+  testNet.sent.clear();
+  for (int i=0; i<5; i++)
+    inject(client, repair);
+  expect(countSent(client, frames) == 2 * resent, "repairs were not rate limited");
+}
+
+/* A group frame the socket does not take is counted and still kept for repairs */
+
+void testMcastLost()
+{
+  MCAST_GROUP = makeAddr("239.1.0.1", 6000);
+  MCAST_SECRET = 12345;
+  sockaddr_in client = makeAddr("127.0.0.1", 4000);
+  inject(client, "/mcast");
+  inject(client, "/join 1");
+  testNet.full = true;
+  forward_group(1, "<x> lost");
+  testNet.full = false;
+  expect(MCAST_LOST == 1 && get_room(1).mcast_sent.size() == 1, "a frame the socket refused was not counted");
+
+  inject(client, "/admin stats");
+  expect(countSent(client, "+OK") == 3 && testNet.sent.back().second.find(", 1 multicast frames not sent") != std::string::npos,
+    "the stats do not show the frame that was not sent");
+
+  char repair[128];
+  snprintf(repair, sizeof(repair), "/repair 1 1 1 %u", mcast_cookie(client, MCAST_SECRET));
+  inject(client, repair);
+  expect(countSent(client, std::string(1, MCAST_MARK) + "1:1:<x> lost") == 1, "the frame was not repaired");
+}
+
+/* /admin is for clients on the loopback interface, and for others with the token */
+
+void testAdminAccess()
+{
+  sockaddr_in outsider = makeAddr("10.1.0.1", 4000);
+  sockaddr_in local = makeAddr("127.0.0.1", 4000);
+  std::string refused = "-ERR Admin";
+  inject(outsider, "/join 1");
+  inject(outsider, "/admin stats");
+  inject(outsider, "/admin order total");
+  expect(countSent(outsider, refused) == 2 && get_room(1).order == UNORDERED,
+    "an outsider used /admin");
+
+  inject(local, "/join 1");
+  inject(local, "/admin stats");
+  expect(countSent(local, "+OK") == 2, "a local client could not use /admin");
+
+  ADMIN_TOKEN = "s3cret";
+  testNet.sent.clear();
+  inject(outsider, "/admin secret stats");
+  expect(countSent(outsider, refused) == 1, "a wrong token was taken");
+  inject(outsider, "/admin s3cret order fifo");
+  expect(countSent(outsider, refused) == 1 && get_room(1).order == FIFO,
+    "the admin token was not taken");
+}
+
+/* A view without the servers that went silent is only issued if it keeps a majority */
+
+void testViewQuorum()
+{
+  FAILURE_TIMEOUT = 1000000;
+  testNet.clock += 2 * FAILURE_TIMEOUT;
+  long long now = now_us();
+  LAST_HEARD.assign(NUM_SERVERS, now - 2 * FAILURE_TIMEOUT);
+  LAST_PING = now - FAILURE_TIMEOUT / 2;
+  check_peers(now, proposals);
+  expect(VIEW_ID == 0 && ACTIVE[1] && ACTIVE[2], "a minority issued a view");
+
+  LAST_HEARD[1] = now;
+  LAST_PING = now - FAILURE_TIMEOUT / 2;
+  check_peers(now, proposals);
+  expect(VIEW_ID == 1 && ACTIVE[1] && !ACTIVE[2], "a majority did not issue a view");
+}
+
+/* Of two views with the same id, the one with more members or else the lowest server
+   the other lacks is installed, so the two sides of a partition merge */
+
+void testViewTie()
+{
+  std::string view = std::string(1, CTRL_MARK) + "VIEW 0 1=127.0.0.1:8000 2=127.0.0.1:8001 ";
+  inject(SERVERS[1], view + "4=127.0.0.1:8003");
+  expect(ACTIVE[2] && SERVERS.size() == NUM_SERVERS, "a view that lost the tie was installed");
+
+  inject(SERVERS[1], view + "3=127.0.0.1:8002 4=127.0.0.1:8003");
+  expect(VIEW_ID == 0 && SERVERS.size() == 4 && ACTIVE[2] && ACTIVE[3],
+    "a view with more members and the same id was not installed");
+
+  inject(SERVERS[1], std::string(1, CTRL_MARK) + "VIEW 0 2=127.0.0.1:8001 3=127.0.0.1:8002 "
+    "4=127.0.0.1:8003 5=127.0.0.1:8004 6=127.0.0.1:8005");
+  expect(!IN_VIEW, "left out of a view that won the tie, we did not join again");
+}
+
+/* The messages of a server that left are settled with the other members: one that any
+   of them has the agreement for is delivered, one that none has is dropped */
+
+void testOrphans()
+{
+  sockaddr_in client = makeAddr("10.1.0.1", 4000);
+  get_room(1).order = TOTAL;
+  inject(client, "/join 1");
+  char frame[FRAME_LEN + 1];
+  encode_frame(frame, 0, "2:1:1", NEW_MSG, 0, 1, "<x> one");
+  inject(SERVERS[1], frame);
+  encode_frame(frame, 0, "2:1:2", NEW_MSG, 0, 1, "<x> two");
+  inject(SERVERS[1], frame);
+
+  testNet.sent.clear();
+  std::vector<std::pair<int, sockaddr_in> > members;
+  members.push_back(std::make_pair(1, SERVERS[0]));
+  members.push_back(std::make_pair(3, SERVERS[2]));
+  install_view(1, members, proposals);
+  std::string ask = std::string(1, CTRL_MARK) + "ASK 2:1:";
+  expect(countSent(SERVERS[2], ask) == 2 && get_room(1).total_index.size() == 2,
+    "the messages of the server that left were not asked for");
+
+  encode_frame(frame, 7, "2:1:2", AGREEMENT, 3, 1, "");
+  inject(SERVERS[1], frame);
+  expect(get_room(1).total_index.size() == 2, "an agreement from a server that left was taken");
+
+  encode_frame(frame, 5, "2:1:1", AGREEMENT, 2, 1, "");
+  inject(SERVERS[2], frame);
+  expect(countSent(client, "<x> one") == 0, "a message was delivered before an older one was settled");
+
+  inject(SERVERS[2], std::string(1, CTRL_MARK) + "NONE 2:1:2");
+  expect(countSent(client, "<x> one") == 1 && countSent(client, "<x> two") == 0
+    && get_room(1).total_queue.empty() && ORPHANS.empty(),
+    "the messages were not settled once every member answered");
+}
+
+/* A NEW_MSG sent again that arrives after its agreement is answered with the agreement,
+   not taken for a new message, and a proposal that comes after the agreement is
+   dropped */
+
+void testTotalLate()
+{
+  sockaddr_in client = makeAddr("10.1.0.1", 4000);
+  get_room(1).order = TOTAL;
+  inject(client, "/join 1");
+  char frame[FRAME_LEN + 1];
+  encode_frame(frame, 0, "2:1:1", NEW_MSG, 0, 1, "<x> one");
+  std::string resent = frame;
+  inject(SERVERS[1], resent);
+  encode_frame(frame, get_room(1).proposed, "2:1:1", AGREEMENT, 2, 1, "");
+  std::string agreement = frame;
+  inject(SERVERS[1], agreement);
+
+  expect(countSent(client, "<x> one") == 1, "the message was not delivered");
+  int agreements = countSent(SERVERS[1], agreement);
+  inject(SERVERS[1], resent);
+  expect(countSent(SERVERS[1], agreement) == agreements + 1, "the agreement was not sent back for a late NEW_MSG");
+  expect(get_room(1).total_queue.empty() && get_room(1).total_index.empty(),
+    "a late NEW_MSG was queued again");
+  inject(SERVERS[1], agreement);
+  expect(countSent(client, "<x> one") == 1, "the message was delivered %d times", countSent(client, "<x> one"));
+
+  inject(client, "two");
+  char key[64];
+  sprintf(key, "%d:%lld:%u", SELF_IDX, TOTAL_EPOCH, TOTAL_SEQ);
+  for (int i=0; i<NUM_SERVERS; i++) {
+    encode_frame(frame, 10 + i, key, PROPOSAL, i + 1, 1, "");
+    inject(SERVERS[i], frame);
+  }
+  expect(proposals.empty(), "the message was not agreed on");
+  inject(SERVERS[1], frame);
+  expect(proposals.empty(), "a late proposal left an entry behind");
+}
+
+/* Under the shed policy what peers send in fifo order is held beyond the budget, as
+   they would not send it again, and only our own clients' posts are refused */
+
+void testShedClientsOnly()
+{
+  sockaddr_in client = makeAddr("10.1.0.1", 4000);
+  HOLD.parse("1k");
+  inject(client, "/join 1");
+  Room &r = get_room(1);
+  r.order = FIFO;
+  r.baseline[1] = true;
+  r.epoch[1] = 1;
+  std::string text = "<y> " + std::string(600, 'x');
+  char frame[FRAME_LEN + 1];
+  for (int id=3; id>=1; id--) {
+    encode_frame(frame, id, "1:1", PLAIN_MSG + FIFO, 0, 1, (text + (char) ('0' + id)).c_str());
+    inject(SERVERS[1], frame);
+  }
+  int delivered = 0;
+  for (size_t i=0; i<testNet.sent.size(); i++)
+    if (sameAddr(testNet.sent[i].first, client) && testNet.sent[i].second.compare(0, 4, "<y> ") == 0)
+      expect(testNet.sent[i].second == text + (char) ('0' + ++delivered), "message %d out of order", delivered);
+  expect(delivered == 3, "%d of 3 fifo messages held beyond the budget were delivered", delivered);
+
+  for (int id=6; id>=5; id--) {
+    encode_frame(frame, id, "1:1", PLAIN_MSG + FIFO, 0, 1, text.c_str());
+    inject(SERVERS[1], frame);
+  }
+  expect(r.fifo_queue[1].size() == 2, "a peer's message was refused under the shed policy");
+  inject(client, "hello");
+  expect(countSent(client, BUSY) == 1, "a post was not refused while over the budget");
+}
+
+/* A changed order goes to the members once, and again only to those that have not
+   acknowledged it */
+
+void testOrderAcks()
+{
+  sockaddr_in local = makeAddr("127.0.0.1", 4000);
+  std::string order = std::string(1, CTRL_MARK) + "ORDER 1 fifo 1";
+  inject(local, "/join 1");
+  inject(local, "/admin order fifo");
+  expect(countSent(SERVERS[1], order) == 1 && countSent(SERVERS[2], order) == 1,
+    "the new order was not sent to the members");
+
+  inject(SERVERS[1], std::string(1, CTRL_MARK) + "ORDERED 1 1");
+  testNet.sent.clear();
+  resend_orders();
+  expect(countSent(SERVERS[1], order) == 0 && countSent(SERVERS[2], order) == 1,
+    "the order was not sent again to just the member that did not acknowledge it");
+
+  inject(SERVERS[2], std::string(1, CTRL_MARK) + "ORDERED 1 1");
+  testNet.sent.clear();
+  resend_orders();
+  expect(testNet.sent.empty(), "an acknowledged order was sent again");
+
+  inject(SERVERS[1], std::string(1, CTRL_MARK) + "ORDER 2 causal 3");
+  expect(room_order(2) == CAUSAL && countSent(SERVERS[1], std::string(1, CTRL_MARK) + "ORDERED 2 3") == 1,
+    "an order from the coordinator was not taken and acknowledged");
+}
+
+/* A room's next history segment is only created once its current one is half full, and
+   is deleted with the room's history when it is closed */
+
+void testHistorySpare()
+{
+  char dir[] = "/tmp/servertest-XXXXXX";
+  if (!mkdtemp(dir))
+    panic("Cannot create %s", dir);
+  HistoryLog log;
+  log.open(dir);
+  std::string spare = std::string(dir) + "/room1-next.log";
+  std::string text(1000, 'x');
+  uint32_t first, end;
+  log.last(2, 10, first, end); // a room without history
+  log.append(1, text.c_str(), text.size());
+  log.maintain();
+  expect(access(spare.c_str(), F_OK) != 0 && access((std::string(dir) + "/room2-next.log").c_str(), F_OK) != 0,
+    "a spare was created for a room that is far from full");
+
+  for (size_t n=text.size(); n<=HISTORY_SEGMENT_BYTES / 2; n+=text.size() + HISTORY_RECORD_HEADER)
+    log.append(1, text.c_str(), text.size());
+  log.maintain();
+  expect(access(spare.c_str(), F_OK) == 0, "no spare was created for a room that is half full");
+
+  log.close(1);
+  expect(access(spare.c_str(), F_OK) != 0, "the spare was left behind when the room was closed");
+  log.close_all();
+  std::string rm = std::string("rm -rf ") + dir;
+  if (system(rm.c_str()) != 0)
+    panic("Cannot remove %s", dir);
+}
+
+/* Posting a chat line allocates nothing once the room and the client are set up, in
+   each order that does not keep the line for later */
+
+void testPostAllocs()
+{
+  const int orders[] = { UNORDERED, FIFO, CAUSAL };
+  for (int k=0; k<3; k++) {
+    sockaddr_in client = makeAddr("10.1.0.1", 4000 + k);
+    inject(client, (std::string("/join ") + (char) ('1' + k)).c_str());
+    Room &r = get_room(1 + k);
+    r.order = orders[k];
+    for (int i=0; i<NUM_SERVERS; i++)
+      r.interested[i] = r.baseline[i] = true;
+    ClientId id;
+    int room;
+    is_client(client, id, room);
+    char line[64];
+    testNet.recording = false;
+    /* A post every 10 ms, until the recent multicasts kept level off and each of their
+       slots has held a frame as long as the ones measured */
+    for (int i=0; i<2000; i++) {
+      testNet.clock += 10000;
+      strcpy(line, "hello, world");
+      do_client(id, line, proposals);
+    }
+    long long before = heapAllocs;
+    for (int i=0; i<1000; i++) {
+      testNet.clock += 10000;
+      strcpy(line, "hello, world");
+      do_client(id, line, proposals);
+    }
+    testNet.recording = true;
+    expect(heapAllocs == before, "%lld allocations for 1000 posts in %s order",
+      heapAllocs - before, ORDER_NAMES[orders[k]]);
+  }
+}
+
+struct Test {
+  const char *name;
+  void (*run)();
+};
+
+Test tests[] = {
+  { "server_address", testServerAddress },
+  { "forged_join", testForgedJoin },
+  { "interest_retry", testInterestRetry },
+  { "repair_limits", testRepairLimits },
+  { "mcast_lost", testMcastLost },
+  { "admin_access", testAdminAccess },
+  { "view_quorum", testViewQuorum },
+  { "view_tie", testViewTie },
+  { "orphans", testOrphans },
+  { "total_late", testTotalLate },
+  { "shed_clients_only", testShedClientsOnly },
+  { "order_acks", testOrderAcks },
+  { "history_spare", testHistorySpare },
+  { "post_allocs", testPostAllocs },
+};
+
+int main(int argc, char *argv[])
+{
+  NET = &testNet;
+  ORDER = UNORDERED;
+  int numFailed = 0;
+  for (size_t i=0; i<sizeof(tests)/sizeof(tests[0]); i++) {
+    testName = tests[i].name;
+    failed = false;
+    resetServer();
+    TOTAL_EPOCH = net_time();
+    IDLE_WHEEL.start(now_us() / 1000000);
+    ROOM_WHEEL.start(now_us() / 1000000);
+    tests[i].run();
+    printf("%s %s\n", failed ? "FAIL" : "PASS", testName);
+    numFailed += failed;
+  }
+  if (numFailed > 0) {
+    printf("%d of %d tests failed\n", numFailed, (int) (sizeof(tests)/sizeof(tests[0])));
+    return 1;
+  }
+  printf("All %d tests passed\n", (int) (sizeof(tests)/sizeof(tests[0])));
+  return 0;
+}
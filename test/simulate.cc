@@ -0,0 +1,507 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../net.h"
+
+/* Runs a whole cluster of chatservers inside this process. Each server is a thread
+   running server_main() from chatserver.cc with a simulated network installed, which
+   delays, loses and reorders datagrams as drawn from a seeded generator, in virtual
+   time. Only one thread runs at a time, handed control by the scheduler below, so a
+   run with the same seed and arguments always plays out the same way. The clients
+   are simulated here as well: they join, post and check what they receive, like
+   stresstest does. It exits with status 1 if messages were delivered out of order or
+   not at all. */
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
+#define logVerbose(a...) do { if (verbose) { printf("SIM %lld.%06lld ", simNow / 1000000, simNow % 1000000); printf(a); printf("\n"); } } while (0)
+#define warning(a...) do { fprintf(stderr, "WARNING: "); fprintf(stderr, a); fprintf(stderr, "\n"); } while (0)
+
+#define ORDER_UNORDERED 0
+#define ORDER_FIFO 1
+#define ORDER_CAUSAL 2
+#define ORDER_TOTAL 3
+
+#define SERVER_PORT 20000       // server i listens on 127.0.0.1:SERVER_PORT+i
+#define CLIENT_PORT 1024        // client c sends from 127.0.0.2:CLIENT_PORT+c
+#define MAX_CLIENTS 60000
+
+#define EV_SERVER 0             // a datagram reaches a server
+#define EV_CLIENT 1             // a datagram reaches a client
+#define EV_WAKE 2               // a server's select() times out
+#define EV_POST 3               // a client posts the next message
+
+int server_main(int argc, char *argv[]);
+
+struct Event {
+  long long time;
+  long long seq;                // keeps events at the same time in the order they were made
+  int kind;
+  int target;                   // server or client index
+  long long gen;                // of the select() an EV_WAKE ends
+  sockaddr_in from;
+  std::string payload;
+};
+
+struct Later {
+  bool operator()(const Event &a, const Event &b) const {
+    return a.time > b.time || (a.time == b.time && a.seq > b.seq);
+  }
+};
+
+/* A server thread and its end of the simulated network */
+
+struct SimServer : public Network {
+  int idx;
+  std::thread thread;
+  std::condition_variable cv;
+  bool running;                 // has control; the scheduler waits until it gives it back
+  bool stopping;
+  bool finished;
+  std::deque<std::pair<sockaddr_in, std::string> > inbox;
+  long long wakeGen;
+  int sockets;
+
+  SimServer() : idx(0), running(false), stopping(false), finished(false), wakeGen(0), sockets(0) {}
+  int open(const sockaddr_in &addr);
+  void close(int fd) {}
+  ssize_t send(int fd, const char *msg, size_t len, const sockaddr_in &to);
+  ssize_t receive(int fd, char *buffer, size_t len, sockaddr_in &from);
+  int select(int nfds, fd_set *readfds, fd_set *writefds, long long timeout);
+  long long now();
+};
+
+struct SimClient {
+  int serverIdx;
+  int groupID;
+  sockaddr_in addr;
+  size_t position;              // messages received, for checking total order
+  std::unordered_map<int, int> lastFrom;  // sender -> last message received from it, for FIFO
+};
+
+struct SimMessage {
+  int senderIdx;
+  int groupID;
+  long long sentAt;
+};
+
+std::mutex simLock;
+std::condition_variable schedulerCv;
+std::priority_queue<Event, std::vector<Event>, Later> events;
+long long eventSeq = 0;
+long long simNow = 0;
+std::mt19937_64 rng;
+std::vector<SimServer> servers;
+std::vector<SimClient> clients;
+std::vector<SimMessage> messages;
+std::vector<std::vector<int> > groupSequence;  // total order each group's first receiver saw
+std::vector<int> latencies;
+
+bool verbose = false;
+int ordering = ORDER_UNORDERED;
+int numServers = 3;
+int numClients = 10;
+int numGroups = 1;
+int maxMessages = 100;
+long long xmitIntervalMicros = 1000;
+long long minDelayMicros = 1000;
+long long maxDelayMicros = 5000;
+long long clientDelayMicros = 100;
+long long joinMicros = 200000;
+long long finalDelayMicros = 2000000;
+double lossProbability = 0;
+unsigned int seed = 1;
+
+long long peerDatagrams = 0;
+long long peerBytes = 0;
+long long peerLost = 0;
+long long deliveries = 0;
+long long responses = 0;
+int numErrors = 0;
+
+const char *orderNames[] = { "unordered", "fifo", "causal", "total" };
+
+sockaddr_in makeAddr(const char *ip, int port)
+{
+  sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_aton(ip, &addr.sin_addr);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+/* Must be called by the thread that has control */
+
+void schedule(long long time, int kind, int target, const sockaddr_in &from, const char *payload, size_t len)
+{
+  Event e;
+  e.time = time;
+  e.seq = eventSeq ++;
+  e.kind = kind;
+  e.target = target;
+  e.gen = 0;
+  e.from = from;
+  e.payload.assign(payload, len);
+  events.push(e);
+}
+
+long long linkDelay()
+{
+  return minDelayMicros + (long long)(rng() % (unsigned long long)(maxDelayMicros - minDelayMicros + 1));
+}
+
+int SimServer::open(const sockaddr_in &addr)
+{
+  return 3 + sockets ++;
+}
+
+ssize_t SimServer::send(int fd, const char *msg, size_t len, const sockaddr_in &to)
+{
+  int port = ntohs(to.sin_port);
+  sockaddr_in self = makeAddr("127.0.0.1", SERVER_PORT + idx);
+  if (to.sin_addr.s_addr == self.sin_addr.s_addr && port > SERVER_PORT && port <= SERVER_PORT + numServers) {
+    peerDatagrams ++;
+    peerBytes += len;
+    if ((lossProbability > 0) && (std::uniform_real_distribution<double>(0, 1)(rng) < lossProbability)) {
+      peerLost ++;
+      return len;
+    }
+    schedule(simNow + linkDelay(), EV_SERVER, port - SERVER_PORT, self, msg, len);
+  } else if (port >= CLIENT_PORT && port < CLIENT_PORT + numClients && to.sin_addr.s_addr == clients[port - CLIENT_PORT].addr.sin_addr.s_addr) {
+    schedule(simNow + clientDelayMicros, EV_CLIENT, port - CLIENT_PORT, self, msg, len);
+  }
+  return len;                   // anything else, like multicast groups, goes nowhere
+}
+
+ssize_t SimServer::receive(int fd, char *buffer, size_t len, sockaddr_in &from)
+{
+  if (inbox.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+  std::pair<sockaddr_in, std::string> &d = inbox.front();
+  size_t n = std::min(len, d.second.size());
+  memcpy(buffer, d.second.data(), n);
+  from = d.first;
+  inbox.pop_front();
+  return n;
+}
+
+/* Give control back to the scheduler until a datagram arrives or the timeout passes */
+
+int SimServer::select(int nfds, fd_set *readfds, fd_set *writefds, long long timeout)
+{
+  std::unique_lock<std::mutex> lk(simLock);
+  if (inbox.empty() && !stopping) {
+    Event e;
+    e.time = simNow + std::max(timeout, 1LL);
+    e.seq = eventSeq ++;
+    e.kind = EV_WAKE;
+    e.target = idx;
+    e.gen = ++ wakeGen;
+    events.push(e);
+    running = false;
+    schedulerCv.notify_one();
+    cv.wait(lk, [this] { return running; });
+  }
+  FD_ZERO(writefds);            // simulated sockets are never full
+  if (stopping)
+    return -1;
+  FD_ZERO(readfds);
+  if (inbox.empty())
+    return 0;
+  for (int fd = 3; fd < 3 + sockets; fd ++)
+    FD_SET(fd, readfds);
+  return 1;
+}
+
+long long SimServer::now()
+{
+  return simNow;
+}
+
+/* Hand control to a server until it waits again; the caller holds simLock */
+
+void resume(SimServer &s, std::unique_lock<std::mutex> &lk)
+{
+  if (s.finished)
+    return;
+  s.running = true;
+  s.cv.notify_one();
+  schedulerCv.wait(lk, [&s] { return !s.running; });
+}
+
+void runServer(SimServer *s, std::vector<std::string> args)
+{
+  {
+    std::unique_lock<std::mutex> lk(simLock);
+    s->cv.wait(lk, [s] { return s->running; });
+  }
+  NET = s;
+  std::vector<char*> argv;
+  for (size_t i=0; i<args.size(); i++)
+    argv.push_back((char*) args[i].c_str());
+  argv.push_back(NULL);
+  server_main(args.size(), argv.data());
+  std::unique_lock<std::mutex> lk(simLock);
+  s->finished = true;
+  s->running = false;
+  schedulerCv.notify_one();
+}
+
+void sendFromClient(int clientIdx, const char *text)
+{
+  SimClient &c = clients[clientIdx];
+  schedule(simNow + clientDelayMicros, EV_SERVER, c.serverIdx, c.addr, text, strlen(text));
+}
+
+/* A client got a datagram: check chat lines against what was posted */
+
+void receiveAtClient(int clientIdx, const std::string &payload)
+{
+  SimClient &c = clients[clientIdx];
+  size_t gt = payload.find("> M");
+  if ((payload[0] != '<') || (gt == std::string::npos)) {
+    responses ++;
+    return;
+  }
+  int msgID = atoi(payload.c_str() + gt + 3);
+  if ((msgID < 0) || (msgID >= (int) messages.size())) {
+    warning("Client C%02d received a message that was never sent (%s)", clientIdx+1, payload.c_str());
+    numErrors ++;
+    return;
+  }
+  SimMessage &m = messages[msgID];
+  deliveries ++;
+  latencies.push_back(simNow - m.sentAt);
+  logVerbose("Client C%02d receives message M%d", clientIdx+1, msgID+1);
+
+  if ((ordering == ORDER_FIFO) || (ordering == ORDER_CAUSAL)) {
+    int &last = c.lastFrom[m.senderIdx];
+    if (last > msgID) {
+      warning("Client C%02d sent message M%d before message M%d, but client C%02d received them in the reverse order",
+        m.senderIdx+1, msgID+1, last+1, clientIdx+1);
+      numErrors ++;
+    }
+    last = std::max(last, msgID);
+  }
+
+  if (ordering == ORDER_TOTAL) {
+    std::vector<int> &seq = groupSequence[c.groupID];
+    if (c.position < seq.size() && seq[c.position] != msgID) {
+      warning("Client C%02d received message M%d as #%d, but another client received M%d there",
+        clientIdx+1, msgID+1, (int) c.position+1, seq[c.position]+1);
+      numErrors ++;
+    } else if (c.position == seq.size()) {
+      seq.push_back(msgID);
+    }
+    c.position ++;
+  }
+}
+
+void post()
+{
+  SimMessage m;
+  m.senderIdx = rng() % numClients;
+  m.groupID = clients[m.senderIdx].groupID;
+  m.sentAt = simNow;
+  messages.push_back(m);
+  char text[32];
+  sprintf(text, "M%d", (int) messages.size()-1);
+  logVerbose("Client C%02d sends message M%d to group G%d", m.senderIdx+1, (int) messages.size(), m.groupID);
+  sendFromClient(m.senderIdx, text);
+  if ((int) messages.size() < maxMessages) {
+    sockaddr_in none = makeAddr("0.0.0.0", 0);
+    schedule(simNow + xmitIntervalMicros, EV_POST, 0, none, "", 0);
+  }
+}
+
+long long currentTimeMicros()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec*1000000LL + tv.tv_usec);
+}
+
+int main(int argc, char *argv[])
+{
+  /* Parse arguments; whatever follows -- is passed on to every server */
+
+  int c;
+  while ((c = getopt(argc, argv, "c:d:f:g:i:l:m:n:o:s:v")) != -1) {
+    switch (c) {
+      case 'c':
+        numClients = atoi(optarg);
+        break;
+      case 'd':
+        if (sscanf(optarg, "%lld:%lld", &minDelayMicros, &maxDelayMicros) == 1)
+          maxDelayMicros = minDelayMicros;
+        break;
+      case 'f':
+        finalDelayMicros = atoll(optarg)*1000LL;
+        break;
+      case 'g':
+        numGroups = atoi(optarg);
+        break;
+      case 'i':
+        xmitIntervalMicros = atoll(optarg);
+        break;
+      case 'l':
+        lossProbability = atof(optarg);
+        break;
+      case 'm':
+        maxMessages = atoi(optarg);
+        break;
+      case 'n':
+        numServers = atoi(optarg);
+        break;
+      case 'o':
+        for (ordering = ORDER_TOTAL; (ordering >= 0) && strcmp(optarg, orderNames[ordering]); ordering --)
+          ;
+        if (ordering < 0)
+          panic("Unknown ordering: '%s' (supported: unordered, fifo, causal, total)", optarg);
+        break;
+      case 's':
+        seed = atoi(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Syntax: %s [-v] [-n servers] [-c clients] [-g groups] [-m messages] [-i intervalMicroseconds] [-o order] [-d minDelay[:maxDelay]Microseconds] [-l lossProbability] [-f finalDelayMilliseconds] [-s seed] [-- server options]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if ((numServers < 1) || (numClients < 1) || (numClients > MAX_CLIENTS) || (numGroups < 1) || (maxMessages < 1) || (maxDelayMicros < minDelayMicros))
+    panic("Invalid arguments");
+
+  rng.seed(seed);
+  fprintf(stderr, "Simulating %d servers, %d clients in %d groups, %d messages in %lldus intervals in %s order, seed %u\n",
+    numServers, numClients, numGroups, maxMessages, xmitIntervalMicros, orderNames[ordering], seed);
+
+  /* The servers read their addresses from a configuration file as usual */
+
+  char configFile[] = "/tmp/simulate-XXXXXX";
+  int fd = mkstemp(configFile);
+  if (fd < 0)
+    panic("Cannot create a server list (%s)", strerror(errno));
+  FILE *config = fdopen(fd, "w");
+  for (int i=1; i<=numServers; i++)
+    fprintf(config, "127.0.0.1:%d\n", SERVER_PORT + i);
+  fclose(config);
+
+  servers = std::vector<SimServer>(numServers + 1);  // by index, 0 unused
+  for (int i=1; i<=numServers; i++) {
+    std::vector<std::string> args;
+    args.push_back("chatserver");
+    args.push_back("-o");
+    args.push_back(orderNames[ordering]);
+    for (int j=optind; j<argc; j++)
+      args.push_back(argv[j]);
+    args.push_back(configFile);
+    args.push_back(std::to_string(i));
+    servers[i].idx = i;
+    servers[i].thread = std::thread(runServer, &servers[i], args);
+  }
+
+  clients.resize(numClients);
+  groupSequence.resize(numGroups + 1);
+  messages.reserve(maxMessages);
+  for (int i=0; i<numClients; i++) {
+    clients[i].serverIdx = 1 + i % numServers;
+    clients[i].groupID = 1 + (i / numServers) % numGroups;
+    clients[i].addr = makeAddr("127.0.0.2", CLIENT_PORT + i);
+    clients[i].position = 0;
+  }
+
+  /* Run the scheduler: start the servers, have every client join its group, then post
+     the messages and wait a little for stragglers */
+
+  long long wallStart = currentTimeMicros();
+  long long endTime = joinMicros + (maxMessages - 1) * xmitIntervalMicros + finalDelayMicros;
+  std::unique_lock<std::mutex> lk(simLock);
+  for (int i=1; i<=numServers; i++)
+    resume(servers[i], lk);
+  for (int i=0; i<numClients; i++) {
+    char join[32];
+    sprintf(join, "/join %d", clients[i].groupID);
+    sendFromClient(i, join);
+  }
+  sockaddr_in none = makeAddr("0.0.0.0", 0);
+  schedule(joinMicros, EV_POST, 0, none, "", 0);
+
+  while (!events.empty() && (events.top().time <= endTime)) {
+    Event e = events.top();
+    events.pop();
+    simNow = e.time;
+    if (e.kind == EV_SERVER) {
+      servers[e.target].inbox.push_back(std::make_pair(e.from, e.payload));
+      resume(servers[e.target], lk);
+    } else if (e.kind == EV_WAKE) {
+      if (e.gen == servers[e.target].wakeGen)
+        resume(servers[e.target], lk);
+    } else if (e.kind == EV_CLIENT) {
+      receiveAtClient(e.target, e.payload);
+    } else {
+      post();
+    }
+  }
+  simNow = endTime;
+  for (int i=1; i<=numServers; i++) {
+    servers[i].stopping = true;
+    resume(servers[i], lk);
+  }
+  lk.unlock();
+  for (int i=1; i<=numServers; i++)
+    servers[i].thread.join();
+  unlink(configFile);
+  long long wallMicros = currentTimeMicros() - wallStart;
+
+  /* Report */
+
+  long long expected = 0;
+  std::vector<int> groupSize(numGroups + 1, 0);
+  for (int i=0; i<numClients; i++)
+    groupSize[clients[i].groupID] ++;
+  for (size_t i=0; i<messages.size(); i++)
+    expected += groupSize[messages[i].groupID];
+  std::sort(latencies.begin(), latencies.end());
+  double mean = 0;
+  for (size_t i=0; i<latencies.size(); i++)
+    mean += latencies[i];
+  mean = latencies.empty() ? 0 : mean / latencies.size();
+
+  fprintf(stderr, "Virtual time %.3f s in %.3f s wall time (%.1fx real time)\n",
+    endTime / 1e6, wallMicros / 1e6, wallMicros > 0 ? (double) endTime / wallMicros : 0.0);
+  fprintf(stderr, "%lld server datagrams (%.2f per message), %lld bytes, %lld lost\n",
+    peerDatagrams, (double) peerDatagrams / messages.size(), peerBytes, peerLost);
+  if (!latencies.empty())
+    fprintf(stderr, "Latency (us): mean %.0f, median %d, 99th percentile %d, max %d\n",
+      mean, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+  fprintf(stderr, "%lld of %lld deliveries, %lld responses\n", deliveries, expected, responses);
+  if (deliveries != expected) {
+    warning("%lld deliveries missing", expected - deliveries);
+    numErrors ++;
+  }
+
+  if (!numErrors)
+    fprintf(stderr, "Ordering OK\n");
+  else
+    fprintf(stderr, "%d ordering error(s) found\n", numErrors);
+
+  return numErrors ? 1 : 0;
+}
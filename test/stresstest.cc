@@ -39,8 +39,13 @@ struct {
   char text[MAX_MSG_LEN+1];
   int groupID;
   int recvSeq[MAX_CLIENTS];
+  long long sentAt;
 } message[MAX_MESSAGES];
 
+int latency[MAX_MESSAGES*MAX_CLIENTS];  // of each delivery, in microseconds
+int numDeliveries = 0;
+long long firstXmit = 0, lastDelivery = 0;
+
 bool verbose = false;
 int ordering = ORDER_UNORDERED;
 int numServers;
@@ -60,7 +65,8 @@ void readServerList(const char *filename)
   while (fgets(linebuf, sizeof(linebuf), infile)) {
     char *sproxyaddr = strtok(linebuf, ",\r\n");
     char *srealaddr = sproxyaddr ? strtok(NULL, ",\r\n") : NULL;
-    char *serveraddr = srealaddr ? srealaddr : sproxyaddr;
+    char *sclientaddr = srealaddr ? strtok(NULL, ",\r\n") : NULL; // the server's client socket, if it has one
+    char *serveraddr = sclientaddr ? sclientaddr : srealaddr ? srealaddr : sproxyaddr;
     char *sip = strtok(serveraddr, ":");
     char *sport = strtok(NULL, ":\r\n");
     struct in_addr ip;
@@ -154,6 +160,37 @@ int countMissingMessages()
 	return numMissing;
 }
 
+int compareInts(const void *a, const void *b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+/* Prints how many messages arrived, how fast and how long they took, on one line that
+   scripts can pick up */
+
+void printSummary()
+{
+  int expected = 0;
+  for (int i=0; i<numMessages; i++)
+    for (int j=0; j<numClients; j++)
+      if (client[j].groupID == message[i].groupID)
+        expected ++;
+
+  long long sum = 0;
+  for (int i=0; i<numDeliveries; i++)
+    sum += latency[i];
+  qsort(latency, numDeliveries, sizeof(int), compareInts);
+
+  double seconds = (lastDelivery - firstXmit) / 1e6;
+  fprintf(stderr, "Delivered %d of %d in %.3f s (%.1f per second), latency (us): mean %lld, median %d, 99th percentile %d, max %d\n",
+    numDeliveries, expected, seconds, (seconds > 0) ? numDeliveries / seconds : 0.0,
+    numDeliveries ? sum / numDeliveries : 0,
+    numDeliveries ? latency[numDeliveries/2] : 0,
+    numDeliveries ? latency[(int)(numDeliveries*0.99)] : 0,
+    numDeliveries ? latency[numDeliveries-1] : 0
+  );
+}
+
 int main(int argc, char *argv[])
 {
   /* Parse arguments */
@@ -278,6 +315,9 @@ int main(int argc, char *argv[])
         );
         for (int i=0; i<MAX_CLIENTS; i++)
           message[numMessages].recvSeq[i] = -1;
+        message[numMessages].sentAt = currentTimeMicros();
+        if (!numMessages)
+          firstXmit = message[numMessages].sentAt;
         logVerbose("Client C%02d sends message M%03d (%s) to group G%d", 
         	message[numMessages].senderIdx+1,
         	numMessages+1,
@@ -329,6 +369,10 @@ int main(int argc, char *argv[])
               if ((0<=msgID) && (msgID < numMessages)) {
                 if (!strcmp(mptr, message[msgID].text)) {
                 	logVerbose("Client C%02d receives message M%03d (%s) as seq #%d", 1+i, 1+msgID, mptr, client[i].nextRecvSeq);
+                  if (message[msgID].recvSeq[i] < 0) {
+                    lastDelivery = currentTimeMicros();
+                    latency[numDeliveries ++] = lastDelivery - message[msgID].sentAt;
+                  }
                   message[msgID].recvSeq[i] = client[i].nextRecvSeq ++;
       
                   if (!checkMessageOrdering(msgID, i))
@@ -356,6 +400,7 @@ int main(int argc, char *argv[])
      all the messages have been delivered to all the clients */
 
   numErrors += countMissingMessages();
+  printSummary();
  
   if (!numErrors)
   	fprintf(stderr, "Ordering OK\n");
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Binary trace of the datagrams received by a chatserver (-w), replayed by test/replay.
+   A file holds one TraceHeader followed by TraceRecords, each followed by its payload.
+   All fields are in host byte order, except the address which stays in network order. */
+
+const char TRACE_MAGIC[4] = { 'C', 'H', 'T', 'R' };
+const uint16_t TRACE_VERSION = 1;
+const uint8_t TRACE_CLIENT = 0; // datagram from a client
+const uint8_t TRACE_PEER = 1; // datagram from another server
+
+struct __attribute__((packed)) TraceHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t server; // index of the capturing server in the configuration file
+	uint64_t start_us; // wall clock time when the capture started
+};
+
+struct __attribute__((packed)) TraceRecord {
+	uint32_t delta_us; // time since the previous record, saturates after ~71 minutes
+	uint32_t ip;
+	uint16_t port;
+	uint8_t kind;
+	uint16_t len;
+};
+
+#endif